@@ -4,18 +4,38 @@
 
 #include "audio.h"
 #include "hwdefs.h"
+#include "state.h"
+#include "prof.h"
+
+struct emu_audio_state {
+    /* Envelope of channel 2 */
+    int env_step_cur;
+    int env_step_start;
+    int env_step_cyc_left;
+    int env_running;
+    int env_vol;
+
+    u8 sndbuf[]; /* AUDIO_SNDBUF_SIZE * AUDIO_CHANNELS */
+};
+
+/* Bytes audio_init takes from the state arena. */
+size_t audio_arena_size(void) {
+    return sizeof(struct emu_audio_state) + AUDIO_SNDBUF_SIZE * AUDIO_CHANNELS;
+}
 
 int audio_init(struct gb_state *s) {
-    s->emu_state->audio_sndbuf = malloc(AUDIO_SNDBUF_SIZE * AUDIO_CHANNELS);
-    if (!s->emu_state->audio_sndbuf)
-        return 0;
-    memset(s->emu_state->audio_sndbuf, 0, AUDIO_SNDBUF_SIZE * AUDIO_CHANNELS);
+    s->emu_audio_state = state_arena_alloc(s, audio_arena_size());
+    if (!s->emu_audio_state)
+        return 1;
+    s->emu_state->audio_sndbuf = s->emu_audio_state->sndbuf;
     return 0;
 }
 
 void audio_update(struct gb_state *s) {
+    PROF_ZONE("audio_update");
     const double sample_freq = 1. * AUDIO_SAMPLE_RATE / AUDIO_SNDBUF_SIZE;
 
+    struct emu_audio_state *as = s->emu_audio_state;
     u8 *sndbuf = s->emu_state->audio_sndbuf;
 
     if (s->io_sound_channel2_freq_hi & (1<<7)) {
@@ -40,11 +60,6 @@ void audio_update(struct gb_state *s) {
     memset(sndbuf, 0, AUDIO_SNDBUF_SIZE * AUDIO_CHANNELS);
 
     if (ch2_enable) {
-        static int env_step_cur = 0;
-        static int env_step_start = 0;
-        static int env_step_cyc_left = 0;
-        static int env_running = 0;
-        static int env_vol = 0;
         /*u8 ch2_len = s->io_sound_channel2_length_pattern & 0x3f;*/
         u8 ch2_duty = s->io_sound_channel2_length_pattern >> 6;
         u8 ch2_use_len = s->io_sound_channel2_freq_hi & (1<<6) ? 1 : 0;
@@ -58,28 +73,30 @@ void audio_update(struct gb_state *s) {
         u32 osc_len = AUDIO_SNDBUF_SIZE / oscs_in_buf;
         u32 osc_high = osc_len * GB_SND_DUTY_PERC[ch2_duty];
 
-        if (ch2_env_step && (!env_running || env_step_start != ch2_env_step)) {
-            env_running = 1;
-            env_step_cur = ch2_env_step;
-            env_step_start = ch2_env_step;
-            env_step_cyc_left = GB_SND_ENVSTEP_CYC * ch2_env_step;
-            env_vol = ch2_vol;
-        } else if (env_running) {
+        if (ch2_env_step &&
+                (!as->env_running || as->env_step_start != ch2_env_step)) {
+            as->env_running = 1;
+            as->env_step_cur = ch2_env_step;
+            as->env_step_start = ch2_env_step;
+            as->env_step_cyc_left = GB_SND_ENVSTEP_CYC * ch2_env_step;
+            as->env_vol = ch2_vol;
+        } else if (as->env_running) {
             /* TODO assumes we do this ones per frame */
-            env_step_cyc_left -= GB_FREQ/60.;
-            if (env_step_cyc_left <= 0) {
-                env_step_cur--;
-                env_vol += ch2_env_inc ? +1 : -1;
-                env_vol &= 0xf;
-                if (env_step_cur == 0) {
-                    env_running = 0;
+            as->env_step_cyc_left -= GB_FREQ/60.;
+            if (as->env_step_cyc_left <= 0) {
+                as->env_step_cur--;
+                as->env_vol += ch2_env_inc ? +1 : -1;
+                as->env_vol &= 0xf;
+                if (as->env_step_cur == 0) {
+                    as->env_running = 0;
                 } else {
-                    env_step_cyc_left = GB_SND_ENVSTEP_CYC * env_step_cur;
+                    as->env_step_cyc_left =
+                        GB_SND_ENVSTEP_CYC * as->env_step_cur;
                 }
             }
         }
 
-        u8 vol = env_running ? env_vol : ch2_vol;
+        u8 vol = as->env_running ? as->env_vol : ch2_vol;
         vol = 255 * vol / 16; /* Normalize to 0-255 */
 
         /* TODO: envelope, length, restart */
@@ -0,0 +1,30 @@
+#ifndef BLOCKCACHE_NATIVE_H
+#define BLOCKCACHE_NATIVE_H
+
+/*
+ * Native code backend of the block cache (see blockcache.c). Only built for
+ * hosts there is a code generator for, elsewhere blocks always run through the
+ * interpreter's handlers.
+ */
+
+#include "types.h"
+#include "cpu.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define BLOCKCACHE_NATIVE 1 /* blockcache-x86_64.c */
+#else
+#define BLOCKCACHE_NATIVE 0
+#endif
+
+typedef void (*blockcache_native_fn)(struct gb_state *s);
+
+struct blockcache_native;
+
+struct blockcache_native *blockcache_native_new(u32 *cycles_run);
+void blockcache_native_free(struct blockcache_native *n);
+void blockcache_native_flush(struct blockcache_native *n);
+blockcache_native_fn blockcache_native_translate(struct blockcache_native *n,
+        struct gb_state *s, u16 pc, const struct cpu_insn *insns,
+        int num_insns);
+
+#endif
@@ -0,0 +1,439 @@
+/*
+ * x86-64 backend of the block cache: translates a decoded block into native
+ * code. Within a block the SM83 registers live in host registers (A in r8b,
+ * B-L in r9b-r14b, F in r15b, the gb_state in rbx), and are only written back
+ * to the gb_state where needed. Register-only instructions (loads, 8-bit ALU,
+ * INC/DEC) are translated; their flags come from the host's own (x86 AF is
+ * the same half carry as H). Everything else, including anything that accesses
+ * memory, is a call to the interpreter's handler, with the registers, PC and
+ * the cycles run so far (for blockcache_sync) in the gb_state as it expects.
+ *
+ * Code is emitted into a fixed buffer. When that is full everything is thrown
+ * away and translated again as the blocks get hot again.
+ */
+
+#include "blockcache-native.h"
+
+#if BLOCKCACHE_NATIVE
+
+#include <cpuid.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "mmu.h"
+
+#define NATIVE_CODE_SIZE (1 << 20)
+#define NATIVE_BLOCK_MAX 4096 /* Upper bound of the code of a single block */
+
+struct blockcache_native {
+    /* Z, H and C flags for the flags LAHF loads into AH. Addressed by the
+     * generated code through rbp. */
+    u8 lahf_flags[256];
+    u32 *cycles_run;
+    u8 *code;
+    size_t code_used;
+};
+
+/* SM83 registers in the order of the host registers they are kept in. */
+enum { G_A, G_B, G_C, G_D, G_E, G_H, G_L, G_F, G_NUM };
+#define HOST_REG(g) (8 + (g)) /* r8-r15 */
+
+static const u8 guest_offsets[G_NUM] = {
+    offsetof(struct gb_state, reg8.A), offsetof(struct gb_state, reg8.B),
+    offsetof(struct gb_state, reg8.C), offsetof(struct gb_state, reg8.D),
+    offsetof(struct gb_state, reg8.E), offsetof(struct gb_state, reg8.H),
+    offsetof(struct gb_state, reg8.L), offsetof(struct gb_state, reg8.F),
+};
+
+/* Register index as encoded in instructions, -1 for (HL). */
+static const s8 guest_reg8[8] = { G_B, G_C, G_D, G_E, G_H, G_L, -1, G_A };
+
+_Static_assert(offsetof(struct gb_state, pc) < 128,
+        "registers must be addressable with an 8-bit displacement");
+
+struct native_emitter {
+    u8 *p;
+    u8 loaded; /* Registers held in host registers... */
+    u8 dirty; /* ...and those of them that were modified. */
+    u32 cycles_run; /* Value of *cycles_run at this point. */
+};
+
+static void emit8(struct native_emitter *e, u8 b) {
+    *e->p++ = b;
+}
+
+static void emit16(struct native_emitter *e, u16 v) {
+    memcpy(e->p, &v, 2);
+    e->p += 2;
+}
+
+static void emit32(struct native_emitter *e, u32 v) {
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+
+static void emit64(struct native_emitter *e, u64 v) {
+    memcpy(e->p, &v, 8);
+    e->p += 8;
+}
+
+/* <op> r8b-r15b, r8b-r15b (MOV/ALU r/m8, r8) */
+static void emit_rr(struct native_emitter *e, u8 opcode, int dst, int src) {
+    emit8(e, 0x45);
+    emit8(e, opcode);
+    emit8(e, 0xc0 | (HOST_REG(src) & 7) << 3 | (HOST_REG(dst) & 7));
+}
+
+/* <op> r8b-r15b, imm8 (group 1, /digit) */
+static void emit_ri(struct native_emitter *e, u8 digit, int dst, u8 imm) {
+    emit8(e, 0x41);
+    emit8(e, 0x80);
+    emit8(e, 0xc0 | digit << 3 | (HOST_REG(dst) & 7));
+    emit8(e, imm);
+}
+
+static void emit_mov_ri(struct native_emitter *e, int dst, u8 imm) {
+    emit8(e, 0x41);
+    emit8(e, 0xb0 | (HOST_REG(dst) & 7));
+    emit8(e, imm);
+}
+
+/* Makes sure g is in its host register before it is read. */
+static void native_use(struct native_emitter *e, int g) {
+    if (e->loaded & (1 << g))
+        return;
+    emit8(e, 0x44); /* movzx r32, byte [rbx + disp8] */
+    emit8(e, 0x0f);
+    emit8(e, 0xb6);
+    emit8(e, 0x43 | (HOST_REG(g) & 7) << 3);
+    emit8(e, guest_offsets[g]);
+    e->loaded |= 1 << g;
+}
+
+static void native_def(struct native_emitter *e, int g) {
+    e->loaded |= 1 << g;
+    e->dirty |= 1 << g;
+}
+
+static void native_spill(struct native_emitter *e) {
+    for (int g = 0; g < G_NUM; g++) {
+        if (!(e->dirty & (1 << g)))
+            continue;
+        emit8(e, 0x44); /* mov [rbx + disp8], r8b-r15b */
+        emit8(e, 0x88);
+        emit8(e, 0x43 | (HOST_REG(g) & 7) << 3);
+        emit8(e, guest_offsets[g]);
+    }
+    e->dirty = 0;
+}
+
+static void native_store_pc(struct native_emitter *e, u16 pc) {
+    emit8(e, 0x66); /* mov word [rbx + disp8], imm16 */
+    emit8(e, 0xc7);
+    emit8(e, 0x43);
+    emit8(e, offsetof(struct gb_state, pc));
+    emit16(e, pc);
+}
+
+/*
+ * Converts the host flags of the last instruction to Z, H and C in al:
+ * lahf; movzx eax, ah; movzx eax, byte [rbp + rax]
+ */
+static void native_lahf_flags(struct native_emitter *e) {
+    static const u8 code[] = { 0x9f, 0x0f, 0xb6, 0xc4,
+                               0x0f, 0xb6, 0x44, 0x05, 0x00 };
+    memcpy(e->p, code, sizeof(code));
+    e->p += sizeof(code);
+}
+
+/* Z in al: setz al; shl al, 7 */
+static void native_setz_flags(struct native_emitter *e) {
+    static const u8 code[] = { 0x0f, 0x94, 0xc0, 0xc0, 0xe0, 0x07 };
+    memcpy(e->p, code, sizeof(code));
+    e->p += sizeof(code);
+}
+
+/* F = (F & keep) | al */
+static void native_merge_flags(struct native_emitter *e, u8 keep) {
+    emit8(e, 0x41); /* and r15b, imm8 */
+    emit8(e, 0x80);
+    emit8(e, 0xe7);
+    emit8(e, keep);
+    emit8(e, 0x41); /* or r15b, al */
+    emit8(e, 0x08);
+    emit8(e, 0xc7);
+}
+
+/* ADD, ADC, SUB, SBC, AND, XOR, OR, CP of A and g, or imm if g is -1. */
+static void native_alu(struct native_emitter *e, int kind, int g, u8 imm) {
+    static const u8 opcodes_rr[8] =
+        { 0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38 };
+    static const u8 digits_ri[8] = { 0, 2, 5, 3, 4, 6, 1, 7 };
+
+    native_use(e, G_A);
+    if (g >= 0)
+        native_use(e, g);
+    if (kind != 5 && kind != 6) /* XOR and OR overwrite all of F. */
+        native_use(e, G_F);
+    if (kind == 1 || kind == 3) {
+        emit8(e, 0x41); /* bt r15d, 4: carry in */
+        emit8(e, 0x0f);
+        emit8(e, 0xba);
+        emit8(e, 0xe7);
+        emit8(e, 0x04);
+    }
+
+    if (g >= 0)
+        emit_rr(e, opcodes_rr[kind], G_A, g);
+    else
+        emit_ri(e, digits_ri[kind], G_A, imm);
+
+    switch (kind) {
+    case 4: /* AND */
+        native_setz_flags(e);
+        emit8(e, 0x0c); /* or al, FLAG_H */
+        emit8(e, FLAG_H);
+        native_merge_flags(e, 0x0f);
+        break;
+    case 5: /* XOR */
+    case 6: /* OR */
+        native_setz_flags(e);
+        emit8(e, 0x41); /* mov r15b, al */
+        emit8(e, 0x88);
+        emit8(e, 0xc7);
+        break;
+    default:
+        native_lahf_flags(e);
+        if (kind == 2 || kind == 3 || kind == 7) {
+            emit8(e, 0x0c); /* or al, FLAG_N */
+            emit8(e, FLAG_N);
+        }
+        native_merge_flags(e, 0x0f);
+        break;
+    }
+
+    if (kind != 7)
+        native_def(e, G_A);
+    native_def(e, G_F);
+}
+
+/* INC or DEC of an 8-bit register, C is kept. */
+static void native_incdec8(struct native_emitter *e, int g, int dec) {
+    native_use(e, g);
+    native_use(e, G_F);
+    emit8(e, 0x41); /* inc/dec r8b-r15b */
+    emit8(e, 0xfe);
+    emit8(e, 0xc0 | dec << 3 | (HOST_REG(g) & 7));
+    native_lahf_flags(e);
+    emit8(e, 0x24); /* and al, FLAG_Z | FLAG_H */
+    emit8(e, FLAG_Z | FLAG_H);
+    if (dec) {
+        emit8(e, 0x0c); /* or al, FLAG_N */
+        emit8(e, FLAG_N);
+    }
+    native_merge_flags(e, FLAG_C | 0x0f);
+    native_def(e, g);
+    native_def(e, G_F);
+}
+
+/* INC or DEC of BC, DE, HL or SP, no flags. */
+static void native_incdec16(struct native_emitter *e, int pair, int dec) {
+    if (pair == 3) {
+        emit8(e, 0x66); /* inc/dec word [rbx + disp8] */
+        emit8(e, 0xff);
+        emit8(e, dec ? 0x4b : 0x43);
+        emit8(e, offsetof(struct gb_state, sp));
+        return;
+    }
+    int hi = guest_reg8[pair * 2], lo = guest_reg8[pair * 2 + 1];
+    native_use(e, hi);
+    native_use(e, lo);
+    emit_ri(e, dec ? 5 : 0, lo, 1); /* sub/add lo, 1 */
+    emit_ri(e, dec ? 3 : 2, hi, 0); /* sbb/adc hi, 0 */
+    native_def(e, hi);
+    native_def(e, lo);
+}
+
+static void native_ld16(struct native_emitter *e, int pair, u16 imm) {
+    if (pair == 3) {
+        emit8(e, 0x66); /* mov word [rbx + disp8], imm16 */
+        emit8(e, 0xc7);
+        emit8(e, 0x43);
+        emit8(e, offsetof(struct gb_state, sp));
+        emit16(e, imm);
+        return;
+    }
+    int hi = guest_reg8[pair * 2], lo = guest_reg8[pair * 2 + 1];
+    emit_mov_ri(e, hi, imm >> 8);
+    emit_mov_ri(e, lo, imm & 0xff);
+    native_def(e, hi);
+    native_def(e, lo);
+}
+
+/* Calls the interpreter's handler for the instruction at pc. */
+static void native_call(struct native_emitter *e, struct blockcache_native *n,
+        const struct cpu_insn *insn, u16 pc, u32 cycles_run) {
+    native_spill(e);
+    if (cycles_run != e->cycles_run) {
+        emit8(e, 0x48); /* mov rax, imm64 */
+        emit8(e, 0xb8);
+        emit64(e, (u64)(uintptr_t)n->cycles_run);
+        emit8(e, 0xc7); /* mov dword [rax], imm32 */
+        emit8(e, 0x00);
+        emit32(e, cycles_run);
+        e->cycles_run = cycles_run;
+    }
+    native_store_pc(e, pc + 1);
+    emit8(e, 0x48); /* mov rdi, rbx */
+    emit8(e, 0x89);
+    emit8(e, 0xdf);
+    emit8(e, 0xbe); /* mov esi, imm32 */
+    emit32(e, insn->op);
+    emit8(e, 0x48); /* mov rax, imm64 */
+    emit8(e, 0xb8);
+    emit64(e, (u64)(uintptr_t)insn->fn);
+    emit8(e, 0xff); /* call rax */
+    emit8(e, 0xd0);
+    e->loaded = 0; /* The handler may have changed any register. */
+}
+
+/* Emits native code for the instruction, returns 0 if it has to be called. */
+static int native_insn(struct native_emitter *e, struct gb_state *s, u16 pc,
+        u8 op) {
+    int dst = guest_reg8[(op >> 3) & 7], src = guest_reg8[op & 7];
+
+    if (op == 0x00) /* NOP */
+        return 1;
+    if ((op & 0xc0) == 0x40 && op != 0x76 && dst >= 0 && src >= 0) {
+        if (dst != src) { /* LD reg8, reg8 */
+            native_use(e, src);
+            emit_rr(e, 0x88, dst, src);
+            native_def(e, dst);
+        }
+        return 1;
+    }
+    if ((op & 0xc7) == 0x06 && dst >= 0) { /* LD reg8, imm8 */
+        emit_mov_ri(e, dst, mmu_read(s, pc + 1));
+        native_def(e, dst);
+        return 1;
+    }
+    if ((op & 0xc6) == 0x04 && dst >= 0) { /* INC/DEC reg8 */
+        native_incdec8(e, dst, op & 1);
+        return 1;
+    }
+    if ((op & 0xc0) == 0x80 && src >= 0) { /* ALU A, reg8 */
+        native_alu(e, (op >> 3) & 7, src, 0);
+        return 1;
+    }
+    if ((op & 0xc7) == 0xc6) { /* ALU A, imm8 */
+        native_alu(e, (op >> 3) & 7, -1, mmu_read(s, pc + 1));
+        return 1;
+    }
+    if ((op & 0xcf) == 0x01) { /* LD reg16, imm16 */
+        native_ld16(e, (op >> 4) & 3,
+                mmu_read(s, pc + 1) | mmu_read(s, pc + 2) << 8);
+        return 1;
+    }
+    if ((op & 0xc7) == 0x03) { /* INC/DEC reg16 */
+        native_incdec16(e, (op >> 4) & 3, (op >> 3) & 1);
+        return 1;
+    }
+    return 0;
+}
+
+struct blockcache_native *blockcache_native_new(u32 *cycles_run) {
+    unsigned eax, ebx, ecx, edx;
+
+    /* LAHF isn't available in 64-bit mode on some early CPUs. */
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) ||
+            !(ecx & bit_LAHF_LM))
+        return NULL;
+
+    struct blockcache_native *n = calloc(1, sizeof(struct blockcache_native));
+    if (!n)
+        return NULL;
+
+    n->code = mmap(NULL, NATIVE_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (n->code == MAP_FAILED) {
+        free(n);
+        return NULL;
+    }
+
+    /* AH after LAHF: SF ZF 0 AF 0 PF 1 CF */
+    for (int ah = 0; ah < 256; ah++)
+        n->lahf_flags[ah] = (ah & 0x40 ? FLAG_Z : 0) |
+                            (ah & 0x10 ? FLAG_H : 0) |
+                            (ah & 0x01 ? FLAG_C : 0);
+    n->cycles_run = cycles_run;
+    return n;
+}
+
+void blockcache_native_free(struct blockcache_native *n) {
+    if (!n)
+        return;
+    munmap(n->code, NATIVE_CODE_SIZE);
+    free(n);
+}
+
+void blockcache_native_flush(struct blockcache_native *n) {
+    n->code_used = 0;
+}
+
+/*
+ * Translates the block of instructions at pc. Returns NULL if the code buffer
+ * is full, in which case it has to be flushed first.
+ */
+blockcache_native_fn blockcache_native_translate(struct blockcache_native *n,
+        struct gb_state *s, u16 pc, const struct cpu_insn *insns,
+        int num_insns) {
+    static const u8 prologue[] = {
+        0x53, 0x55, 0x41, 0x54, 0x41, 0x55, /* push rbx, rbp, r12-r15 */
+        0x41, 0x56, 0x41, 0x57,
+        0x48, 0x83, 0xec, 0x08,             /* sub rsp, 8 (alignment) */
+        0x48, 0x89, 0xfb,                   /* mov rbx, rdi */
+    };
+    static const u8 epilogue[] = {
+        0x48, 0x83, 0xc4, 0x08,             /* add rsp, 8 */
+        0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, /* pop r15-r12, rbp, rbx */
+        0x41, 0x5c, 0x5d, 0x5b,
+        0xc3,                               /* ret */
+    };
+    struct native_emitter e = { 0 };
+    u32 cycles_run = 0;
+    int pc_stale = 0; /* PC in the gb_state is behind */
+
+    if (NATIVE_CODE_SIZE - n->code_used < NATIVE_BLOCK_MAX)
+        return NULL;
+
+    u8 *start = n->code + n->code_used;
+    e.p = start;
+    memcpy(e.p, prologue, sizeof(prologue));
+    e.p += sizeof(prologue);
+    emit8(&e, 0x48); /* mov rbp, imm64 */
+    emit8(&e, 0xbd);
+    emit64(&e, (u64)(uintptr_t)n->lahf_flags);
+
+    for (int i = 0; i < num_insns; i++) {
+        if (native_insn(&e, s, pc, insns[i].op)) {
+            pc_stale = 1;
+        } else {
+            native_call(&e, n, &insns[i], pc, cycles_run);
+            pc_stale = 0;
+        }
+        cycles_run += insns[i].cycles;
+        pc += insns[i].len;
+    }
+
+    native_spill(&e);
+    if (pc_stale)
+        native_store_pc(&e, pc);
+    memcpy(e.p, epilogue, sizeof(epilogue));
+    e.p += sizeof(epilogue);
+
+    n->code_used += e.p - start;
+    return (blockcache_native_fn)(void *)start;
+}
+
+#endif
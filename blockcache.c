@@ -0,0 +1,229 @@
+/*
+ * Block cache for the CPU: hot basic blocks of ROM code are decoded once into
+ * a list of instruction handlers, and from then on executed as a whole without
+ * the per-instruction fetch and decode of the interpreter. The cycles of all
+ * instructions in a block are accumulated and reported as a single step to the
+ * rest of the emulator. Where there is a native code backend for the host
+ * (blockcache-native.h), hot blocks are further translated into machine code,
+ * which still calls the interpreter's handlers for most instructions.
+ *
+ * Blocks are keyed on the ROM offset the PC maps to at that time, and end at
+ * the first instruction that jumps, writes to memory (which could switch banks
+ * or modify code) or changes interrupt state.
+ *
+ * The result must be exactly that of the interpreter, which steps the LCD,
+ * timers and DMA after every instruction. A block therefore only runs when no
+ * peripheral event (LCD mode switch, timer tick, queued input, ...) can happen
+ * before its last instruction, so no interrupt can come in between. Accesses
+ * to anything the peripherals depend on (I/O, OAM, VRAM writes) go through the
+ * slow path of the MMU, which first catches the peripherals up with the
+ * instructions of the block run so far (blockcache_sync).
+ *
+ * Code outside of ROM (WRAM, HRAM) can be self-modifying and is never cached,
+ * neither are cold blocks: these are left to the interpreter.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "blockcache.h"
+#include "blockcache-native.h"
+#include "cpu.h"
+#include "emu.h"
+
+#define BLOCKCACHE_NUM_BLOCKS    2048 /* Entries in the (direct-mapped) cache */
+#define BLOCKCACHE_MAX_INSNS     16
+#define BLOCKCACHE_HOT_THRESHOLD 16   /* Executions before a block is decoded */
+
+struct blockcache_block {
+    u32 key; /* Offset in ROM of the PC */
+    u16 hits;
+    u8 num_insns; /* 0 while not decoded (yet). */
+    u16 cycles;
+    u16 lead_cycles; /* Of all instructions but the last one */
+    struct cpu_insn insns[BLOCKCACHE_MAX_INSNS];
+    blockcache_native_fn native; /* NULL if not translated (yet). */
+};
+
+struct emu_blockcache_state {
+    /* Cycles of the block being executed that ran so far, and that the
+     * peripherals were stepped over. Both 0 outside of blocks. */
+    u32 cycles_run;
+    u32 cycles_synced;
+    struct blockcache_native *native; /* NULL without native backend. */
+    struct blockcache_block blocks[BLOCKCACHE_NUM_BLOCKS];
+};
+
+
+/* Decodes the block starting at `pc`, returns 0 on success. */
+static int blockcache_decode(struct gb_state *s, struct blockcache_block *block,
+        u16 pc) {
+    u16 region_end = pc < 0x4000 ? 0x4000 : 0x8000;
+    u32 cycles = 0;
+    int n = 0;
+
+    while (n < BLOCKCACHE_MAX_INSNS) {
+        struct cpu_insn *insn = &block->insns[n];
+        cpu_decode(s, pc, insn);
+        if (pc + insn->len > region_end) /* Would straddle a bank boundary */
+            break;
+
+        /* Register forms of instructions that can also store to (HL). */
+        u8 op = insn->op;
+        if (((op & 0xc0) == 0x40 || (op & 0xc6) == 0x04 ||
+                    (op & 0xc7) == 0x06) && ((op >> 3) & 7) != 6)
+            insn->flags &= ~CPU_OP_WRITE;
+
+        cycles += insn->cycles;
+        pc += insn->len;
+        n++;
+
+        if (insn->flags & (CPU_OP_JUMP | CPU_OP_WRITE | CPU_OP_INTR))
+            break;
+    }
+
+    if (n == 0)
+        return 1;
+
+    block->num_insns = n;
+    block->cycles = cycles;
+    block->lead_cycles = cycles - block->insns[n - 1].cycles;
+    return 0;
+}
+
+static void blockcache_execute(struct gb_state *s,
+        struct blockcache_block *block) {
+    struct emu_blockcache_state *bs = s->emu_blockcache_state;
+
+    for (int i = 0; i < block->num_insns; i++) {
+        s->pc++; /* Opcode byte, immediates are fetched by the handlers. */
+        block->insns[i].fn(s, block->insns[i].op);
+        bs->cycles_run += block->insns[i].cycles;
+    }
+}
+
+/* Translates the block into native code, if the host has a backend. */
+static void blockcache_translate(struct gb_state *s,
+        struct blockcache_block *block, u16 pc) {
+#if BLOCKCACHE_NATIVE
+    struct emu_blockcache_state *bs = s->emu_blockcache_state;
+
+    if (!bs->native)
+        return;
+    block->native = blockcache_native_translate(bs->native, s, pc,
+            block->insns, block->num_insns);
+    if (!block->native) { /* Out of space: start over. */
+        blockcache_native_flush(bs->native);
+        for (int i = 0; i < BLOCKCACHE_NUM_BLOCKS; i++)
+            bs->blocks[i].native = NULL;
+        block->native = blockcache_native_translate(bs->native, s, pc,
+                block->insns, block->num_insns);
+    }
+#else
+    (void)s, (void)block, (void)pc;
+#endif
+}
+
+/*
+ * Without `native`, or if there is no backend for the host, blocks are run
+ * through the interpreter's handlers.
+ */
+int blockcache_init(struct gb_state *s, int native) {
+    struct emu_blockcache_state *bs;
+
+    bs = s->emu_blockcache_state = calloc(1, sizeof(*bs));
+    if (!bs)
+        return 1;
+#if BLOCKCACHE_NATIVE
+    if (native)
+        bs->native = blockcache_native_new(&bs->cycles_run);
+#else
+    (void)native;
+#endif
+    return 0;
+}
+
+void blockcache_free(struct gb_state *s) {
+#if BLOCKCACHE_NATIVE
+    if (s->emu_blockcache_state)
+        blockcache_native_free(s->emu_blockcache_state->native);
+#endif
+    free(s->emu_blockcache_state);
+    s->emu_blockcache_state = NULL;
+}
+
+/*
+ * Executes the block at the current PC if it is hot. Returns 0 if nothing was
+ * executed, in which case the interpreter should handle the instruction.
+ */
+int blockcache_run_block(struct gb_state *s) {
+    struct emu_blockcache_state *bs = s->emu_blockcache_state;
+    struct emu_state *es = s->emu_state;
+    u16 pc = s->pc;
+
+    if (pc >= 0x8000 || s->in_bios)
+        return 0;
+
+    /* Let the debugger see every single instruction. */
+    if (es->dbg_break_next || es->dbg_print_disas ||
+            es->dbg_breakpoint != 0xffff)
+        return 0;
+
+    u32 key = (u32)(s->mem_map_read[pc >> 12] - s->mem_ROM) + (pc & 0xfff);
+    struct blockcache_block *block =
+        &bs->blocks[(pc ^ (key >> 14 << 6)) & (BLOCKCACHE_NUM_BLOCKS - 1)];
+
+    if (block->key != key) { /* Evict whatever was here */
+        block->key = key;
+        block->hits = 0;
+        block->num_insns = 0;
+        block->native = NULL;
+    }
+
+    if (!block->num_insns) {
+        if (++block->hits < BLOCKCACHE_HOT_THRESHOLD)
+            return 0;
+        if (blockcache_decode(s, block, pc)) {
+            block->hits = 0;
+            return 0;
+        }
+        blockcache_translate(s, block, pc);
+    }
+
+    /* Only if nothing happens outside of the CPU before the last
+     * instruction, see the top of this file. */
+    u32 first_cycles = s->last_op_cycles;
+    s->last_op_cycles = block->lead_cycles;
+    if (block->lead_cycles && cpu_cycles_until_event(s) <= 0) {
+        s->last_op_cycles = first_cycles;
+        return 0;
+    }
+
+    s->last_op_cycles = block->cycles;
+    if (block->native)
+        block->native(s);
+    else
+        blockcache_execute(s, block);
+    bs->cycles_run = bs->cycles_synced = 0;
+    return 1;
+}
+
+/*
+ * Called by the MMU before it accesses I/O, OAM or anything else outside of
+ * plain memory: steps the peripherals over the instructions of the current
+ * block that ran so far, so the access sees the same state as it would with
+ * the interpreter. What is left of last_op_cycles is stepped after the block.
+ */
+void blockcache_sync(struct gb_state *s) {
+    struct emu_blockcache_state *bs = s->emu_blockcache_state;
+    u32 cycles = bs->cycles_run - bs->cycles_synced;
+
+    if (!cycles)
+        return;
+    bs->cycles_synced = bs->cycles_run;
+
+    u32 left = s->last_op_cycles - cycles;
+    s->last_op_cycles = cycles;
+    emu_step_devices(s);
+    s->last_op_cycles = left;
+}
@@ -0,0 +1,11 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "types.h"
+
+int blockcache_init(struct gb_state *s, int native);
+void blockcache_free(struct gb_state *s);
+int blockcache_run_block(struct gb_state *s);
+void blockcache_sync(struct gb_state *s);
+
+#endif
@@ -1,5 +1,5 @@
 mkdir -p build
 cd build
-cmake ..
+cmake -DCMAKE_TOOLCHAIN_FILE=../cmake/arm-linux-gnueabi.cmake ..
 make -j $(nproc)
 cd ..
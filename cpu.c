@@ -13,6 +13,10 @@
 
 #include "cpu.h"
 #include "mmu.h"
+#include "blockcache.h"
+#include "mbc.h"
+#include "state.h"
+#include "prof.h"
 #include "hwdefs.h"
 #include "debugger.h"
 
@@ -22,6 +26,8 @@
         dbg_run_debugger(s); \
     } while (0)
 
+#define IDLE_LOOP_MAX_LEN 16 /* Max size in bytes of a loop considered idle */
+
 static const u8 flagmasks[] = { FLAG_Z, FLAG_Z, FLAG_C, FLAG_C };
 
 static int cycles_per_instruction[] = {
@@ -69,10 +75,21 @@ struct emu_cpu_state {
     u8 *reg8_lut[9];
     u16 *reg16_lut[4];
     u16 *reg16s_lut[4];
+
+    /* Decoded instruction for each opcode (see `opcodes` table). */
+    const struct cpu_opcode *opcode_lut[256];
 };
 
+static void cpu_init_opcode_lut(struct gb_state *s);
+
+/* Bytes cpu_init_emu_cpu_state takes from the state arena. */
+size_t cpu_arena_size(void) {
+    return sizeof(struct emu_cpu_state);
+}
+
 void cpu_init_emu_cpu_state(struct gb_state *s) {
-    s->emu_cpu_state = calloc(1, sizeof(struct emu_cpu_state));
+    s->emu_cpu_state = state_arena_alloc(s, sizeof(struct emu_cpu_state));
+    cpu_init_opcode_lut(s);
     s->emu_cpu_state->reg8_lut[0] = &s->reg8.B;
     s->emu_cpu_state->reg8_lut[1] = &s->reg8.C;
     s->emu_cpu_state->reg8_lut[2] = &s->reg8.D;
@@ -109,6 +126,8 @@ void cpu_reset_state(struct gb_state *s) {
     }
 
     s->halt_for_interrupts = 0;
+    s->double_speed = 0;
+    s->speed_switch_prepare = 0;
     s->interrupts_master_enabled = 1;
     s->interrupts_enable  = 0x0;
     s->interrupts_request = 0x0;
@@ -139,6 +158,7 @@ void cpu_reset_state(struct gb_state *s) {
 
     s->io_serial_data    = 0x00;
     s->io_serial_control = 0x00;
+    s->serial_next_cycles = UINT64_MAX;
 
     s->io_infrared = 0x00;
 
@@ -174,24 +194,15 @@ void cpu_reset_state(struct gb_state *s) {
     s->io_sound_channel4_consec_initial = 0xbf;
 
 
-    s->mem_bank_rom = 1;
     s->mem_bank_wram = 1;
-    s->mem_bank_extram = 0;
     s->mem_bank_vram = 0;
-
-    s->mem_mbc1_extrambank = 0;
-    s->mem_mbc1_rombankupper = 0;
-    s->mem_mbc1_romram_select = 0;
-    s->mem_mbc3_extram_rtc_select = 0;
+    mbc_reset(s);
 
     memset(s->mem_WRAM, 0, s->mem_num_banks_wram * WRAM_BANKSIZE);
     memset(s->mem_EXTRAM, 0, s->mem_num_banks_extram * EXTRAM_BANKSIZE);
     memset(s->mem_VRAM, 0, s->mem_num_banks_vram * VRAM_BANKSIZE);
     memset(s->mem_OAM, 0, 0xa0);
     memset(s->mem_HRAM, 0, 0x7f);
-
-    s->mem_latch_rtc = 0x01;
-    memset(s->mem_RTC, 0, 0x05);
 }
 
 static void cpu_handle_interrupts(struct gb_state *s) {
@@ -217,20 +228,17 @@ static void cpu_handle_interrupts(struct gb_state *s) {
 }
 
 void cpu_timers_step(struct gb_state *s) {
-    u32 freq = s->double_speed ? GB_FREQ : 2 * GB_FREQ;
-    u32 div_cycles_per_tick = freq / GB_DIV_FREQ;
-    s->io_timer_DIV_cycles += s->emu_state->last_op_cycles;
-    if (s->io_timer_DIV_cycles >= div_cycles_per_tick) {
-        s->io_timer_DIV_cycles %= div_cycles_per_tick;
-        s->io_timer_DIV++;
-    }
+    /* The timers are in the CPU clock domain, so no scaling for speed. */
+    s->io_timer_DIV_cycles += s->last_op_cycles;
+    s->io_timer_DIV += s->io_timer_DIV_cycles >> GB_DIV_SHIFT;
+    s->io_timer_DIV_cycles &= (1 << GB_DIV_SHIFT) - 1;
 
     if (s->io_timer_TAC & (1<<2)) { /* Timer enable */
-        s->io_timer_TIMA_cycles += s->emu_state->last_op_cycles;
-        u32 timer_hz = GB_TIMA_FREQS[s->io_timer_TAC & 0x3];
-        u32 timer_cycles_per_tick = freq / timer_hz;
-        if (s->io_timer_TIMA_cycles >= timer_cycles_per_tick) {
-            s->io_timer_TIMA_cycles %= timer_cycles_per_tick;
+        int shift = GB_TIMA_SHIFTS[s->io_timer_TAC & 0x3];
+        s->io_timer_TIMA_cycles += s->last_op_cycles;
+        u32 ticks = s->io_timer_TIMA_cycles >> shift;
+        s->io_timer_TIMA_cycles &= (1 << shift) - 1;
+        while (ticks--) {
             s->io_timer_TIMA++;
             if (s->io_timer_TIMA == 0) {
                 s->io_timer_TIMA = s->io_timer_TMA;
@@ -240,6 +248,89 @@ void cpu_timers_step(struct gb_state *s) {
     }
 }
 
+/*
+ * Returns the number of cycles (after the current instruction) during which
+ * nothing outside of the CPU changes: no LCD mode switch and no timer tick,
+ * and thus also no new interrupts.
+ */
+s32 cpu_cycles_until_event(struct gb_state *s) {
+    s32 horizon = s->io_lcd_mode_cycles_left << s->double_speed;
+
+    s32 div_left = (1 << GB_DIV_SHIFT) - 1 - s->io_timer_DIV_cycles;
+    if (div_left < horizon)
+        horizon = div_left;
+
+    if (s->io_timer_TAC & (1<<2)) {
+        int shift = GB_TIMA_SHIFTS[s->io_timer_TAC & 0x3];
+        s32 tima_left = (1 << shift) - 1 - s->io_timer_TIMA_cycles;
+        if (tima_left < horizon)
+            horizon = tima_left;
+    }
+
+    /* Queued input could change what is being polled, and the serial port
+     * could complete a transfer. */
+    u64 now = s->time_cycles;
+    u64 next = s->emu_state->input_next_cycles;
+    if (s->serial_next_cycles < next)
+        next = s->serial_next_cycles;
+    if (next != UINT64_MAX) {
+        u64 next_left = next > now ? (next - now) << s->double_speed : 0;
+        if (horizon > 0 && next_left < (u64)horizon)
+            horizon = next_left;
+    }
+
+    return horizon - (s32)s->last_op_cycles;
+}
+
+/*
+ * Idle loop detection, called after a backward jump has been taken.
+ *
+ * Instead of HALTing, many games busy-wait on LY or some flag in HRAM in a short
+ * loop such as: LD A, (FF44) / CP 90 / JR NZ, -6. When an iteration of such a
+ * loop did not change any register and the loop does not write to memory, all
+ * next iterations will be identical until the LCD or timers change the value
+ * being polled. We then skip over as many iterations as fit before that.
+ */
+static void cpu_check_idle_loop(struct gb_state *s, u16 branch_pc) {
+    struct emu_state *es = s->emu_state;
+    u16 target = s->pc;
+    u16 regs[5] = { s->reg16.AF, s->reg16.BC, s->reg16.DE, s->reg16.HL,
+                    s->sp };
+
+    if (target > branch_pc || branch_pc - target > IDLE_LOOP_MAX_LEN)
+        return;
+    if (es->dbg_break_next || es->dbg_print_disas ||
+            es->dbg_breakpoint != 0xffff)
+        return;
+
+    if (es->idle_loop_target != target ||
+            memcmp(es->idle_loop_regs, regs, sizeof(regs))) {
+        es->idle_loop_target = target;
+        memcpy(es->idle_loop_regs, regs, sizeof(regs));
+        return;
+    }
+
+    u32 loop_cycles = 0;
+    u16 pc = target;
+    while (1) {
+        struct cpu_insn insn;
+        cpu_decode(s, pc, &insn);
+        if (insn.flags & (CPU_OP_WRITE | CPU_OP_INTR))
+            return;
+        loop_cycles += insn.cycles;
+        if (pc == branch_pc)
+            break;
+        pc += insn.len;
+        if (pc > branch_pc)
+            return;
+    }
+
+    s32 horizon = cpu_cycles_until_event(s);
+    if (horizon <= 0 || loop_cycles == 0)
+        return;
+    s->last_op_cycles += horizon / loop_cycles * loop_cycles;
+}
+
 #define CF s->flags.CF
 #define HF s->flags.HF
 #define NF s->flags.NF
@@ -362,385 +453,776 @@ static void cpu_do_cb_instruction(struct gb_state *s) {
     }
 }
 
-static void cpu_do_instruction(struct gb_state *s) {
-    u8 op = mmu_read(s, s->pc++);
-    if (M(op, 0x00, 0xff)) { /* NOP */
-    } else if (M(op, 0x01, 0xcf)) { /* LD reg16, u16 */
-        u16 *dst = REG16(4);
-        *dst = IMM16;
-        s->pc += 2;
-    } else if (M(op, 0x02, 0xff)) { /* LD (BC), A */
-        mmu_write(s, BC, A);
-    } else if (M(op, 0x03, 0xcf)) { /* INC reg16 */
-        u16 *reg = REG16(4);
-        *reg += 1;
-    } else if (M(op, 0x04, 0xc7)) { /* INC reg8 */
-        u8* reg = REG8(3);
-        u8 val = reg ? *reg : mem(HL);
-        u8 res = val + 1;
-        ZF = res == 0;
-        NF = 0;
-        HF = (val & 0xf) == 0xf;
-        if (reg)
-            *reg = res;
-        else
-            mmu_write(s, HL, res);
-    } else if (M(op, 0x05, 0xc7)) { /* DEC reg8 */
-        u8* reg = REG8(3);
-        u8 val = reg ? *reg : mem(HL);
-        val--;
-        NF = 1;
-        ZF = val == 0;
-        HF = (val & 0x0F) == 0x0F;
-        if (reg)
-            *reg = val;
-        else
-            mmu_write(s, HL, val);
-    } else if (M(op, 0x06, 0xc7)) { /* LD reg8, imm8 */
-        u8* dst = REG8(3);
-        u8 src = IMM8;
-        s->pc++;
-        if (dst)
-            *dst = src;
-        else
-            mmu_write(s, HL, src);
-    } else if (M(op, 0x07, 0xff)) { /* RLCA */
-        u8 res = (A << 1) | (A >> 7);
-        F = (A >> 7) ? FLAG_C : 0;
-        A = res;
-
-    } else if (M(op, 0x08, 0xff)) { /* LD (imm16), SP */
-        mmu_write16(s, IMM16, s->sp);
-        s->pc += 2;
+/* NOP */
+static void cpu_op_nop(struct gb_state *s, u8 op) {
+    (void)s, (void)op;
+}
 
-    } else if (M(op, 0x09, 0xcf)) { /* ADD HL, reg16 */
-        u16 *src = REG16(4);
-        u32 tmp = HL + *src;
-        NF = 0;
-        HF = (((HL & 0xfff) + (*src & 0xfff)) & 0x1000) ? 1 : 0;
-        CF = tmp > 0xffff;
-        HL = tmp;
-    } else if (M(op, 0x0a, 0xff)) { /* LD A, (BC) */
-        A = mem(BC);
-    } else if (M(op, 0x0b, 0xcf)) { /* DEC reg16 */
-        u16 *reg = REG16(4);
-        *reg -= 1;
-    } else if (M(op, 0x0f, 0xff)) { /* RRCA */
-        F = (A & 1) ? FLAG_C : 0;
-        A = (A >> 1) | ((A & 1) << 7);
-    } else if (M(op, 0x10, 0xff)) { /* STOP */
-        //s->halt_for_interrupts = 1;
-    } else if (M(op, 0x12, 0xff)) { /* LD (DE), A */
-        mmu_write(s, DE, A);
-    } else if (M(op, 0x17, 0xff)) { /* RLA */
-        u8 res = A << 1 | (CF ? 1 : 0);
-        F = (A & (1 << 7)) ? FLAG_C : 0;
-        A = res;
-    } else if (M(op, 0x18, 0xff)) { /* JR off8 */
+/* LD reg16, u16 */
+static void cpu_op_ld_r16_imm16(struct gb_state *s, u8 op) {
+    u16 *dst = REG16(4);
+    *dst = IMM16;
+    s->pc += 2;
+}
+
+/* LD (BC), A */
+static void cpu_op_ld_mbc_a(struct gb_state *s, u8 op) {
+    (void)op;
+    mmu_write(s, BC, A);
+}
+
+/* INC reg16 */
+static void cpu_op_inc_r16(struct gb_state *s, u8 op) {
+    u16 *reg = REG16(4);
+    *reg += 1;
+}
+
+/* INC reg8 */
+static void cpu_op_inc_r8(struct gb_state *s, u8 op) {
+    u8* reg = REG8(3);
+    u8 val = reg ? *reg : mem(HL);
+    u8 res = val + 1;
+    ZF = res == 0;
+    NF = 0;
+    HF = (val & 0xf) == 0xf;
+    if (reg)
+        *reg = res;
+    else
+        mmu_write(s, HL, res);
+}
+
+/* DEC reg8 */
+static void cpu_op_dec_r8(struct gb_state *s, u8 op) {
+    u8* reg = REG8(3);
+    u8 val = reg ? *reg : mem(HL);
+    val--;
+    NF = 1;
+    ZF = val == 0;
+    HF = (val & 0x0F) == 0x0F;
+    if (reg)
+        *reg = val;
+    else
+        mmu_write(s, HL, val);
+}
+
+/* LD reg8, imm8 */
+static void cpu_op_ld_r8_imm8(struct gb_state *s, u8 op) {
+    u8* dst = REG8(3);
+    u8 src = IMM8;
+    s->pc++;
+    if (dst)
+        *dst = src;
+    else
+        mmu_write(s, HL, src);
+}
+
+/* RLCA */
+static void cpu_op_rlca(struct gb_state *s, u8 op) {
+    (void)op;
+    u8 res = (A << 1) | (A >> 7);
+    F = (A >> 7) ? FLAG_C : 0;
+    A = res;
+}
+
+/* LD (imm16), SP */
+static void cpu_op_ld_mimm16_sp(struct gb_state *s, u8 op) {
+    (void)op;
+    mmu_write16(s, IMM16, s->sp);
+    s->pc += 2;
+}
+
+/* ADD HL, reg16 */
+static void cpu_op_add_hl_r16(struct gb_state *s, u8 op) {
+    u16 *src = REG16(4);
+    u32 tmp = HL + *src;
+    NF = 0;
+    HF = (((HL & 0xfff) + (*src & 0xfff)) & 0x1000) ? 1 : 0;
+    CF = tmp > 0xffff;
+    HL = tmp;
+}
+
+/* LD A, (BC) */
+static void cpu_op_ld_a_mbc(struct gb_state *s, u8 op) {
+    (void)op;
+    A = mem(BC);
+}
+
+/* DEC reg16 */
+static void cpu_op_dec_r16(struct gb_state *s, u8 op) {
+    u16 *reg = REG16(4);
+    *reg -= 1;
+}
+
+/* RRCA */
+static void cpu_op_rrca(struct gb_state *s, u8 op) {
+    (void)op;
+    F = (A & 1) ? FLAG_C : 0;
+    A = (A >> 1) | ((A & 1) << 7);
+}
+
+/* STOP */
+static void cpu_op_stop(struct gb_state *s, u8 op) {
+    (void)op;
+    s->pc++; /* Second byte (0x00) is ignored. */
+    s->io_timer_DIV = 0;
+    s->io_timer_DIV_cycles = 0;
+
+    /* On CGB this switches speed when prepared through KEY1. Otherwise it
+     * enters a low power mode until a button is pressed, which we don't model
+     * as there is nothing to save. */
+    if (s->gb_type == GB_TYPE_CGB && s->speed_switch_prepare) {
+        s->double_speed = !s->double_speed;
+        s->speed_switch_prepare = 0;
+        s->last_op_cycles += GB_SPEED_SWITCH_CLKS;
+    }
+}
+
+/* LD (DE), A */
+static void cpu_op_ld_mde_a(struct gb_state *s, u8 op) {
+    (void)op;
+    mmu_write(s, DE, A);
+}
+
+/* RLA */
+static void cpu_op_rla(struct gb_state *s, u8 op) {
+    (void)op;
+    u8 res = A << 1 | (CF ? 1 : 0);
+    F = (A & (1 << 7)) ? FLAG_C : 0;
+    A = res;
+}
+
+/* JR off8 */
+static void cpu_op_jr(struct gb_state *s, u8 op) {
+    (void)op;
+    u16 branch_pc = s->pc - 1;
+    s->pc += (s8)IMM8 + 1;
+    cpu_check_idle_loop(s, branch_pc);
+}
+
+/* LD A, (DE) */
+static void cpu_op_ld_a_mde(struct gb_state *s, u8 op) {
+    (void)op;
+    A = mem(DE);
+}
+
+/* RRA */
+static void cpu_op_rra(struct gb_state *s, u8 op) {
+    (void)op;
+    u8 res = (A >> 1) | (CF << 7);
+    ZF = 0;
+    NF = 0;
+    HF = 0;
+    CF = A & 0x1;
+    A = res;
+}
+
+/* JR cond, off8 */
+static void cpu_op_jr_cond(struct gb_state *s, u8 op) {
+    u8 flag = (op >> 3) & 3;
+    if (((F & flagmasks[flag]) ? 1 : 0) == (flag & 1)) {
+        u16 branch_pc = s->pc - 1;
         s->pc += (s8)IMM8 + 1;
-    } else if (M(op, 0x1a, 0xff)) { /* LD A, (DE) */
-        A = mem(DE);
-    } else if (M(op, 0x1f, 0xff)) { /* RRA */
-        u8 res = (A >> 1) | (CF << 7);
-        ZF = 0;
-        NF = 0;
-        HF = 0;
-        CF = A & 0x1;
-        A = res;
-    } else if (M(op, 0x20, 0xe7)) { /* JR cond, off8 */
-        u8 flag = (op >> 3) & 3;
-        if (((F & flagmasks[flag]) ? 1 : 0) == (flag & 1))
-            s->pc += (s8)IMM8;
+        cpu_check_idle_loop(s, branch_pc);
+    } else
         s->pc++;
-    } else if (M(op, 0x22, 0xff)) { /* LDI (HL), A */
-        mmu_write(s, HL, A);
-        HL++;
-    } else if (M(op, 0x27, 0xff)) { /* DAA */
-        /* When adding/subtracting two numbers in BCD form, this instructions
-         * brings the results back to BCD form too. In BCD form the decimals 0-9
-         * are encoded in a fixed number of bits (4). E.g., 0x93 actually means
-         * 93 decimal. Adding/subtracting such numbers takes them out of this
-         * form since they can results in values where each digit is >9.
-         * E.g., 0x9 + 0x1 = 0xA, but should be 0x10. The important thing to
-         * note here is that per 4 bits we 'skip' 6 values (0xA-0xF), and thus
-         * by adding 0x6 we get: 0xA + 0x6 = 0x10, the correct answer. The same
-         * works for the upper byte (add 0x60).
-         * So: If the lower byte is >9, we need to add 0x6.
-         * If the upper byte is >9, we need to add 0x60.
-         * Furthermore, if we carried the lower part (HF, 0x9+0x9=0x12) we
-         * should also add 0x6 (0x12+0x6=0x18).
-         * Similarly for the upper byte (CF, 0x90+0x90=0x120, +0x60=0x180).
-         *
-         * For subtractions (we know it was a subtraction by looking at the NF
-         * flag) we simiarly need to *subtract* 0x06/0x60/0x66 to again skip the
-         * unused 6 values in each byte. The GB does this by only looking at the
-         * NF and CF flags then.
-         */
-        s8 add = 0;
-        if ((!NF && (A & 0xf) > 0x9) || HF)
-            add |= 0x6;
-        if ((!NF && A > 0x99) || CF) {
-            add |= 0x60;
-            CF = 1;
-        }
-        A += NF ? -add : add;
-        ZF = A == 0;
-        HF = 0;
-    } else if (M(op, 0x2a, 0xff)) { /* LDI A, (HL) */
-        A = mmu_read(s, HL);
-        HL++;
-    } else if (M(op, 0x2f, 0xff)) { /* CPL */
-        A = ~A;
-        NF = 1;
-        HF = 1;
-    } else if (M(op, 0x32, 0xff)) { /* LDD (HL), A */
-        mmu_write(s, HL, A);
-        HL--;
-    } else if (M(op, 0x37, 0xff)) { /* SCF */
-        NF = 0;
-        HF = 0;
+}
+
+/* LDI (HL), A */
+static void cpu_op_ldi_mhl_a(struct gb_state *s, u8 op) {
+    (void)op;
+    mmu_write(s, HL, A);
+    HL++;
+}
+
+/* DAA */
+static void cpu_op_daa(struct gb_state *s, u8 op) {
+    (void)op;
+    /* When adding/subtracting two numbers in BCD form, this instructions
+     * brings the results back to BCD form too. In BCD form the decimals 0-9
+     * are encoded in a fixed number of bits (4). E.g., 0x93 actually means
+     * 93 decimal. Adding/subtracting such numbers takes them out of this
+     * form since they can results in values where each digit is >9.
+     * E.g., 0x9 + 0x1 = 0xA, but should be 0x10. The important thing to
+     * note here is that per 4 bits we 'skip' 6 values (0xA-0xF), and thus
+     * by adding 0x6 we get: 0xA + 0x6 = 0x10, the correct answer. The same
+     * works for the upper byte (add 0x60).
+     * So: If the lower byte is >9, we need to add 0x6.
+     * If the upper byte is >9, we need to add 0x60.
+     * Furthermore, if we carried the lower part (HF, 0x9+0x9=0x12) we
+     * should also add 0x6 (0x12+0x6=0x18).
+     * Similarly for the upper byte (CF, 0x90+0x90=0x120, +0x60=0x180).
+     *
+     * For subtractions (we know it was a subtraction by looking at the NF
+     * flag) we simiarly need to *subtract* 0x06/0x60/0x66 to again skip the
+     * unused 6 values in each byte. The GB does this by only looking at the
+     * NF and CF flags then.
+     */
+    s8 add = 0;
+    if ((!NF && (A & 0xf) > 0x9) || HF)
+        add |= 0x6;
+    if ((!NF && A > 0x99) || CF) {
+        add |= 0x60;
         CF = 1;
-    } else if (M(op, 0x3a, 0xff)) { /* LDD A, (HL) */
-        A = mmu_read(s, HL);
-        HL--;
-    } else if (M(op, 0x3f, 0xff)) { /* CCF */
-        CF = CF ? 0 : 1;
-        NF = 0;
-        HF = 0;
-    } else if (M(op, 0x76, 0xff)) { /* HALT */
-        s->halt_for_interrupts = 1;
-    } else if (M(op, 0x40, 0xc0)) { /* LD reg8, reg8 */
-        u8* src = REG8(0);
-        u8* dst = REG8(3);
-        u8 srcval = src ? *src : mem(HL);
-        if (dst)
-            *dst = srcval;
-        else
-            mmu_write(s, HL, srcval);
-    } else if (M(op, 0x80, 0xf8)) { /* ADD A, reg8 */
-        u8* src = REG8(0);
-        u8 srcval = src ? *src : mem(HL);
-        u16 res = A + srcval;
-        ZF = (u8)res == 0;
-        NF = 0;
-        HF = (A ^ srcval ^ res) & 0x10 ? 1 : 0;
-        CF = res & 0x100 ? 1 : 0;
-        A = (u8)res;
-    } else if (M(op, 0x88, 0xf8)) { /* ADC A, reg8 */
-        u8* src = REG8(0);
-        u8 srcval = src ? *src : mem(HL);
-        u16 res = A + srcval + CF;
-        ZF = (u8)res == 0;
-        NF = 0;
-        HF = (A ^ srcval ^ res) & 0x10 ? 1 : 0;
-        CF = res & 0x100 ? 1 : 0;
-        A = (u8)res;
+    }
+    A += NF ? -add : add;
+    ZF = A == 0;
+    HF = 0;
+}
 
-    } else if (M(op, 0x90, 0xf8)) { /* SUB reg8 */
-        u8 *reg = REG8(0);
-        u8 val = reg ? *reg : mem(HL);
-        u8 res = A - val;
-        ZF = res == 0;
-        NF = 1;
-        HF = ((s32)A & 0xf) - (val & 0xf) < 0;
-        CF = A < val;
-        A = res;
-    } else if (M(op, 0x98, 0xf8)) { /* SBC A, reg8 */
-        u8 *reg = REG8(0);
-        u8 regval = reg ? *reg : mem(HL);
-        u8 res = A - regval - CF;
-        ZF = res == 0;
-        NF = 1;
-        HF = ((s32)A & 0xf) - (regval & 0xf) - CF < 0;
-        CF = A < regval + CF;
-        A = res;
-    } else if (M(op, 0xa0, 0xf8)) { /* AND reg8 */
-        u8 *reg = REG8(0);
-        u8 val = reg ? *reg : mem(HL);
-        A = A & val;
-        ZF = A == 0;
-        NF = 0;
-        HF = 1;
-        CF = 0;
-    } else if (M(op, 0xa8, 0xf8)) { /* XOR reg8 */
-        u8* src = REG8(0);
-        u8 srcval = src ? *src : mem(HL);
-        A ^= srcval;
-        F = A ? 0 : FLAG_Z;
-    } else if (M(op, 0xb0, 0xf8)) { /* OR reg8 */
-        u8* src = REG8(0);
-        u8 srcval = src ? *src : mem(HL);
-        A |= srcval;
-        F = A ? 0 : FLAG_Z;
-    } else if (M(op, 0xb8, 0xf8)) { /* CP reg8 */
-        u8 *reg = REG8(0);
-        u8 regval = reg ? *reg : mem(HL);
-        ZF = A == regval;
-        NF = 1;
-        HF = (A & 0xf) < (regval & 0xf);
-        CF = A < regval;
-    } else if (M(op, 0xc0, 0xe7)) { /* RET cond */
-        /* TODO cyclecount depends on taken or not */
-
-        u8 flag = (op >> 3) & 3;
-        if (((F & flagmasks[flag]) ? 1 : 0) == (flag & 1))
-            s->pc = mmu_pop16(s);
-
-    } else if (M(op, 0xc1, 0xcf)) { /* POP reg16 */
-        u16 *dst = REG16S(4);
-        *dst = mmu_pop16(s);
-        F = F & 0xf0;
-    } else if (M(op, 0xc2, 0xe7)) { /* JP cond, imm16 */
-        u8 flag = (op >> 3) & 3;
-        if (((F & flagmasks[flag]) ? 1 : 0) == (flag & 1))
-            s->pc = IMM16;
-        else
-            s->pc += 2;
-    } else if (M(op, 0xc3, 0xff)) { /* JP imm16 */
+/* LDI A, (HL) */
+static void cpu_op_ldi_a_mhl(struct gb_state *s, u8 op) {
+    (void)op;
+    A = mmu_read(s, HL);
+    HL++;
+}
+
+/* CPL */
+static void cpu_op_cpl(struct gb_state *s, u8 op) {
+    (void)op;
+    A = ~A;
+    NF = 1;
+    HF = 1;
+}
+
+/* LDD (HL), A */
+static void cpu_op_ldd_mhl_a(struct gb_state *s, u8 op) {
+    (void)op;
+    mmu_write(s, HL, A);
+    HL--;
+}
+
+/* SCF */
+static void cpu_op_scf(struct gb_state *s, u8 op) {
+    (void)op;
+    NF = 0;
+    HF = 0;
+    CF = 1;
+}
+
+/* LDD A, (HL) */
+static void cpu_op_ldd_a_mhl(struct gb_state *s, u8 op) {
+    (void)op;
+    A = mmu_read(s, HL);
+    HL--;
+}
+
+/* CCF */
+static void cpu_op_ccf(struct gb_state *s, u8 op) {
+    (void)op;
+    CF = CF ? 0 : 1;
+    NF = 0;
+    HF = 0;
+}
+
+/* HALT */
+static void cpu_op_halt(struct gb_state *s, u8 op) {
+    (void)op;
+    s->halt_for_interrupts = 1;
+}
+
+/* LD reg8, reg8 */
+static void cpu_op_ld_r8_r8(struct gb_state *s, u8 op) {
+    u8* src = REG8(0);
+    u8* dst = REG8(3);
+    u8 srcval = src ? *src : mem(HL);
+    if (dst)
+        *dst = srcval;
+    else
+        mmu_write(s, HL, srcval);
+}
+
+/* ADD A, reg8 */
+static void cpu_op_add_a_r8(struct gb_state *s, u8 op) {
+    u8* src = REG8(0);
+    u8 srcval = src ? *src : mem(HL);
+    u16 res = A + srcval;
+    ZF = (u8)res == 0;
+    NF = 0;
+    HF = (A ^ srcval ^ res) & 0x10 ? 1 : 0;
+    CF = res & 0x100 ? 1 : 0;
+    A = (u8)res;
+}
+
+/* ADC A, reg8 */
+static void cpu_op_adc_a_r8(struct gb_state *s, u8 op) {
+    u8* src = REG8(0);
+    u8 srcval = src ? *src : mem(HL);
+    u16 res = A + srcval + CF;
+    ZF = (u8)res == 0;
+    NF = 0;
+    HF = (A ^ srcval ^ res) & 0x10 ? 1 : 0;
+    CF = res & 0x100 ? 1 : 0;
+    A = (u8)res;
+}
+
+/* SUB reg8 */
+static void cpu_op_sub_r8(struct gb_state *s, u8 op) {
+    u8 *reg = REG8(0);
+    u8 val = reg ? *reg : mem(HL);
+    u8 res = A - val;
+    ZF = res == 0;
+    NF = 1;
+    HF = ((s32)A & 0xf) - (val & 0xf) < 0;
+    CF = A < val;
+    A = res;
+}
+
+/* SBC A, reg8 */
+static void cpu_op_sbc_a_r8(struct gb_state *s, u8 op) {
+    u8 *reg = REG8(0);
+    u8 regval = reg ? *reg : mem(HL);
+    u8 res = A - regval - CF;
+    ZF = res == 0;
+    NF = 1;
+    HF = ((s32)A & 0xf) - (regval & 0xf) - CF < 0;
+    CF = A < regval + CF;
+    A = res;
+}
+
+/* AND reg8 */
+static void cpu_op_and_r8(struct gb_state *s, u8 op) {
+    u8 *reg = REG8(0);
+    u8 val = reg ? *reg : mem(HL);
+    A = A & val;
+    ZF = A == 0;
+    NF = 0;
+    HF = 1;
+    CF = 0;
+}
+
+/* XOR reg8 */
+static void cpu_op_xor_r8(struct gb_state *s, u8 op) {
+    u8* src = REG8(0);
+    u8 srcval = src ? *src : mem(HL);
+    A ^= srcval;
+    F = A ? 0 : FLAG_Z;
+}
+
+/* OR reg8 */
+static void cpu_op_or_r8(struct gb_state *s, u8 op) {
+    u8* src = REG8(0);
+    u8 srcval = src ? *src : mem(HL);
+    A |= srcval;
+    F = A ? 0 : FLAG_Z;
+}
+
+/* CP reg8 */
+static void cpu_op_cp_r8(struct gb_state *s, u8 op) {
+    u8 *reg = REG8(0);
+    u8 regval = reg ? *reg : mem(HL);
+    ZF = A == regval;
+    NF = 1;
+    HF = (A & 0xf) < (regval & 0xf);
+    CF = A < regval;
+}
+
+/* RET cond */
+static void cpu_op_ret_cond(struct gb_state *s, u8 op) {
+    /* TODO cyclecount depends on taken or not */
+
+    u8 flag = (op >> 3) & 3;
+    if (((F & flagmasks[flag]) ? 1 : 0) == (flag & 1))
+        s->pc = mmu_pop16(s);
+}
+
+/* POP reg16 */
+static void cpu_op_pop_r16(struct gb_state *s, u8 op) {
+    u16 *dst = REG16S(4);
+    *dst = mmu_pop16(s);
+    F = F & 0xf0;
+}
+
+/* JP cond, imm16 */
+static void cpu_op_jp_cond(struct gb_state *s, u8 op) {
+    u8 flag = (op >> 3) & 3;
+    if (((F & flagmasks[flag]) ? 1 : 0) == (flag & 1)) {
+        u16 branch_pc = s->pc - 1;
         s->pc = IMM16;
-    } else if (M(op, 0xc4, 0xe7)) { /* CALL cond, imm16 */
-        u16 dst = IMM16;
+        cpu_check_idle_loop(s, branch_pc);
+    } else
         s->pc += 2;
-        u8 flag = (op >> 3) & 3;
-        if (((F & flagmasks[flag]) ? 1 : 0) == (flag & 1)) {
-            mmu_push16(s, s->pc);
-            s->pc = dst;
-        }
-    } else if (M(op, 0xc5, 0xcf)) { /* PUSH reg16 */
-        u16 *src = REG16S(4);
-        mmu_push16(s,*src);
-    } else if (M(op, 0xc6, 0xff)) { /* ADD A, imm8 */
-        u16 res = A + IMM8;
-        ZF = (u8)res == 0;
-        NF = 0;
-        HF = (A ^ IMM8 ^ res) & 0x10 ? 1 : 0;
-        CF = res & 0x100 ? 1 : 0;
-        A = (u8)res;
-        s->pc++;
-    } else if (M(op, 0xc7, 0xc7)) { /* RST imm8 */
+}
+
+/* JP imm16 */
+static void cpu_op_jp(struct gb_state *s, u8 op) {
+    (void)op;
+    u16 branch_pc = s->pc - 1;
+    s->pc = IMM16;
+    cpu_check_idle_loop(s, branch_pc);
+}
+
+/* CALL cond, imm16 */
+static void cpu_op_call_cond(struct gb_state *s, u8 op) {
+    u16 dst = IMM16;
+    s->pc += 2;
+    u8 flag = (op >> 3) & 3;
+    if (((F & flagmasks[flag]) ? 1 : 0) == (flag & 1)) {
         mmu_push16(s, s->pc);
-        s->pc = ((op >> 3) & 7) * 8;
-    } else if (M(op, 0xc9, 0xff)) { /* RET */
-        s->pc = mmu_pop16(s);
-    } else if (M(op, 0xcd, 0xff)) { /* CALL imm16 */
-        u16 dst = IMM16;
-        mmu_push16(s, s->pc + 2);
         s->pc = dst;
-    } else if (M(op, 0xce, 0xff)) { /* ADC imm8 */
-        u16 res = A + IMM8 + CF;
-        ZF = (u8)res == 0;
-        NF = 0;
-        HF = (A ^ IMM8 ^ res) & 0x10 ? 1 : 0;
-        CF = res & 0x100 ? 1 : 0;
-        A = (u8)res;
-        s->pc++;
-    } else if (M(op, 0xd6, 0xff)) { /* SUB imm8 */
-        u8 res = A - IMM8;
-        ZF = res == 0;
-        NF = 1;
-        HF = ((s32)A & 0xf) - (IMM8 & 0xf) < 0;
-        CF = A < IMM8;
-        A = res;
-        s->pc++;
-    } else if (M(op, 0xd9, 0xff)) { /* RETI */
-        s->pc = mmu_pop16(s);
-        s->interrupts_master_enabled = 1;
-    } else if (M(op, 0xde, 0xff)) { /* SBC imm8 */
-        u8 res = A - IMM8 - CF;
-        ZF = res == 0;
-        NF = 1;
-        HF = ((s32)A & 0xf) - (IMM8 & 0xf) - CF < 0;
-        CF = A < IMM8 + CF;
-        A = res;
-        s->pc++;
-    } else if (M(op, 0xe0, 0xff)) { /* LD (0xff00 + imm8), A */
-        mmu_write(s, 0xff00 + IMM8, A);
-        s->pc++;
-    } else if (M(op, 0xe2, 0xff)) { /* LD (0xff00 + C), A */
-        mmu_write(s, 0xff00 + C, A);
-    } else if (M(op, 0xe6, 0xff)) { /* AND imm8 */
-        A = A & IMM8;
-        s->pc++;
-        ZF = A == 0;
-        NF = 0;
-        HF = 1;
-        CF = 0;
-    } else if (M(op, 0xe8, 0xff)) { /* ADD SP, imm8s */
-        s8 off = (s8)IMM8;
-        u32 res = s->sp + off;
-        ZF = 0;
-        NF = 0;
-        HF = (s->sp & 0xf) + (IMM8 & 0xf) > 0xf;
-        CF = (s->sp & 0xff) + (IMM8 & 0xff) > 0xff;
-        s->sp = res;
-        s->pc++;
-    } else if (M(op, 0xe9, 0xff)) { /* LD PC, HL (or JP (HL) ) */
-        s->pc = HL;
-    } else if (M(op, 0xea, 0xff)) { /* LD (imm16), A */
-        mmu_write(s, IMM16, A);
-        s->pc += 2;
-    } else if (M(op, 0xcb, 0xff)) { /* CB-prefixed extended instructions */
-        return cpu_do_cb_instruction(s);
-    } else if (M(op, 0xee, 0xff)) { /* XOR imm8 */
-        A ^= IMM8;
-        s->pc++;
-        F = A ? 0 : FLAG_Z;
-    } else if (M(op, 0xf0, 0xff)) { /* LD A, (0xff00 + imm8) */
-        A = mmu_read(s, 0xff00 + IMM8);
-        s->pc++;
-    } else if (M(op, 0xf2, 0xff)) { /* LD A, (0xff00 + C) */
-        A = mmu_read(s, 0xff00 + C);
-    } else if (M(op, 0xf3, 0xff)) { /* DI */
-        s->interrupts_master_enabled = 0;
-    } else if (M(op, 0xf6, 0xff)) { /* OR imm8 */
-        A |= IMM8;
-        F = A ? 0 : FLAG_Z;
-        s->pc++;
-    } else if (M(op, 0xf8, 0xff)) { /* LD HL, SP + imm8 */
-        u32 res = (u32)s->sp + (s8)IMM8;
-        ZF = 0;
-        NF = 0;
-        HF = (s->sp & 0xf) + (IMM8 & 0xf) > 0xf;
-        CF = (s->sp & 0xff) + (IMM8 & 0xff) > 0xff;
-        HL = (u16)res;
-        s->pc++;
-    } else if (M(op, 0xf9, 0xff)) { /* LD SP, HL */
-        s->sp = HL;
-    } else if (M(op, 0xfa, 0xff)) { /* LD A, (imm16) */
-        A = mmu_read(s, IMM16);
-        s->pc += 2;
-    } else if (M(op, 0xfb, 0xff)) { /* EI */
-        s->interrupts_master_enabled = 1;
-    } else if (M(op, 0xfe, 0xff)) { /* CP imm8 */
-        u8 n = IMM8;
-        ZF = A == n;
-        NF = 1;
-        HF = (A & 0xf) < (n & 0xf);
-        CF = A < n;
-        s->pc++;
-    } else {
-        s->pc--;
-        cpu_error("Unknown instruction");
     }
 }
 
+/* PUSH reg16 */
+static void cpu_op_push_r16(struct gb_state *s, u8 op) {
+    u16 *src = REG16S(4);
+    mmu_push16(s,*src);
+}
+
+/* ADD A, imm8 */
+static void cpu_op_add_a_imm8(struct gb_state *s, u8 op) {
+    (void)op;
+    u16 res = A + IMM8;
+    ZF = (u8)res == 0;
+    NF = 0;
+    HF = (A ^ IMM8 ^ res) & 0x10 ? 1 : 0;
+    CF = res & 0x100 ? 1 : 0;
+    A = (u8)res;
+    s->pc++;
+}
+
+/* RST imm8 */
+static void cpu_op_rst(struct gb_state *s, u8 op) {
+    mmu_push16(s, s->pc);
+    s->pc = ((op >> 3) & 7) * 8;
+}
+
+/* RET */
+static void cpu_op_ret(struct gb_state *s, u8 op) {
+    (void)op;
+    s->pc = mmu_pop16(s);
+}
+
+/* CALL imm16 */
+static void cpu_op_call(struct gb_state *s, u8 op) {
+    (void)op;
+    u16 dst = IMM16;
+    mmu_push16(s, s->pc + 2);
+    s->pc = dst;
+}
+
+/* ADC imm8 */
+static void cpu_op_adc_imm8(struct gb_state *s, u8 op) {
+    (void)op;
+    u16 res = A + IMM8 + CF;
+    ZF = (u8)res == 0;
+    NF = 0;
+    HF = (A ^ IMM8 ^ res) & 0x10 ? 1 : 0;
+    CF = res & 0x100 ? 1 : 0;
+    A = (u8)res;
+    s->pc++;
+}
+
+/* SUB imm8 */
+static void cpu_op_sub_imm8(struct gb_state *s, u8 op) {
+    (void)op;
+    u8 res = A - IMM8;
+    ZF = res == 0;
+    NF = 1;
+    HF = ((s32)A & 0xf) - (IMM8 & 0xf) < 0;
+    CF = A < IMM8;
+    A = res;
+    s->pc++;
+}
+
+/* RETI */
+static void cpu_op_reti(struct gb_state *s, u8 op) {
+    (void)op;
+    s->pc = mmu_pop16(s);
+    s->interrupts_master_enabled = 1;
+}
+
+/* SBC imm8 */
+static void cpu_op_sbc_imm8(struct gb_state *s, u8 op) {
+    (void)op;
+    u8 res = A - IMM8 - CF;
+    ZF = res == 0;
+    NF = 1;
+    HF = ((s32)A & 0xf) - (IMM8 & 0xf) - CF < 0;
+    CF = A < IMM8 + CF;
+    A = res;
+    s->pc++;
+}
+
+/* LD (0xff00 + imm8), A */
+static void cpu_op_ldh_mimm8_a(struct gb_state *s, u8 op) {
+    (void)op;
+    mmu_write(s, 0xff00 + IMM8, A);
+    s->pc++;
+}
+
+/* LD (0xff00 + C), A */
+static void cpu_op_ldh_mc_a(struct gb_state *s, u8 op) {
+    (void)op;
+    mmu_write(s, 0xff00 + C, A);
+}
+
+/* AND imm8 */
+static void cpu_op_and_imm8(struct gb_state *s, u8 op) {
+    (void)op;
+    A = A & IMM8;
+    s->pc++;
+    ZF = A == 0;
+    NF = 0;
+    HF = 1;
+    CF = 0;
+}
+
+/* ADD SP, imm8s */
+static void cpu_op_add_sp_imm8(struct gb_state *s, u8 op) {
+    (void)op;
+    s8 off = (s8)IMM8;
+    u32 res = s->sp + off;
+    ZF = 0;
+    NF = 0;
+    HF = (s->sp & 0xf) + (IMM8 & 0xf) > 0xf;
+    CF = (s->sp & 0xff) + (IMM8 & 0xff) > 0xff;
+    s->sp = res;
+    s->pc++;
+}
+
+/* LD PC, HL (or JP (HL) ) */
+static void cpu_op_jp_hl(struct gb_state *s, u8 op) {
+    (void)op;
+    s->pc = HL;
+}
+
+/* LD (imm16), A */
+static void cpu_op_ld_mimm16_a(struct gb_state *s, u8 op) {
+    (void)op;
+    mmu_write(s, IMM16, A);
+    s->pc += 2;
+}
+
+/* CB-prefixed extended instructions */
+static void cpu_op_cb(struct gb_state *s, u8 op) {
+    (void)op;
+    cpu_do_cb_instruction(s);
+}
+
+/* XOR imm8 */
+static void cpu_op_xor_imm8(struct gb_state *s, u8 op) {
+    (void)op;
+    A ^= IMM8;
+    s->pc++;
+    F = A ? 0 : FLAG_Z;
+}
+
+/* LD A, (0xff00 + imm8) */
+static void cpu_op_ldh_a_mimm8(struct gb_state *s, u8 op) {
+    (void)op;
+    A = mmu_read(s, 0xff00 + IMM8);
+    s->pc++;
+}
+
+/* LD A, (0xff00 + C) */
+static void cpu_op_ldh_a_mc(struct gb_state *s, u8 op) {
+    (void)op;
+    A = mmu_read(s, 0xff00 + C);
+}
+
+/* DI */
+static void cpu_op_di(struct gb_state *s, u8 op) {
+    (void)op;
+    s->interrupts_master_enabled = 0;
+}
+
+/* OR imm8 */
+static void cpu_op_or_imm8(struct gb_state *s, u8 op) {
+    (void)op;
+    A |= IMM8;
+    F = A ? 0 : FLAG_Z;
+    s->pc++;
+}
+
+/* LD HL, SP + imm8 */
+static void cpu_op_ld_hl_sp_imm8(struct gb_state *s, u8 op) {
+    (void)op;
+    u32 res = (u32)s->sp + (s8)IMM8;
+    ZF = 0;
+    NF = 0;
+    HF = (s->sp & 0xf) + (IMM8 & 0xf) > 0xf;
+    CF = (s->sp & 0xff) + (IMM8 & 0xff) > 0xff;
+    HL = (u16)res;
+    s->pc++;
+}
+
+/* LD SP, HL */
+static void cpu_op_ld_sp_hl(struct gb_state *s, u8 op) {
+    (void)op;
+    s->sp = HL;
+}
+
+/* LD A, (imm16) */
+static void cpu_op_ld_a_mimm16(struct gb_state *s, u8 op) {
+    (void)op;
+    A = mmu_read(s, IMM16);
+    s->pc += 2;
+}
+
+/* EI */
+static void cpu_op_ei(struct gb_state *s, u8 op) {
+    (void)op;
+    s->interrupts_master_enabled = 1;
+}
+
+/* CP imm8 */
+static void cpu_op_cp_imm8(struct gb_state *s, u8 op) {
+    (void)op;
+    u8 n = IMM8;
+    ZF = A == n;
+    NF = 1;
+    HF = (A & 0xf) < (n & 0xf);
+    CF = A < n;
+    s->pc++;
+}
+
+static void cpu_op_unknown(struct gb_state *s, u8 op) {
+    (void)op;
+    s->pc--;
+    cpu_error("Unknown instruction");
+}
+
+/*
+ * All (non-CB) instructions, matched in order against the opcode: the first
+ * entry for which (op & mask) == value is used. Besides the handler we keep the
+ * length of the instruction and some properties the block cache needs to
+ * determine where basic blocks end.
+ */
+static const struct cpu_opcode opcodes[] = {
+    { 0xff, 0x00, 1, 0, cpu_op_nop },
+    { 0xcf, 0x01, 3, 0, cpu_op_ld_r16_imm16 },
+    { 0xff, 0x02, 1, CPU_OP_WRITE, cpu_op_ld_mbc_a },
+    { 0xcf, 0x03, 1, 0, cpu_op_inc_r16 },
+    { 0xc7, 0x04, 1, CPU_OP_WRITE, cpu_op_inc_r8 },
+    { 0xc7, 0x05, 1, CPU_OP_WRITE, cpu_op_dec_r8 },
+    { 0xc7, 0x06, 2, CPU_OP_WRITE, cpu_op_ld_r8_imm8 },
+    { 0xff, 0x07, 1, 0, cpu_op_rlca },
+    { 0xff, 0x08, 3, CPU_OP_WRITE, cpu_op_ld_mimm16_sp },
+    { 0xcf, 0x09, 1, 0, cpu_op_add_hl_r16 },
+    { 0xff, 0x0a, 1, 0, cpu_op_ld_a_mbc },
+    { 0xcf, 0x0b, 1, 0, cpu_op_dec_r16 },
+    { 0xff, 0x0f, 1, 0, cpu_op_rrca },
+    { 0xff, 0x10, 2, CPU_OP_INTR, cpu_op_stop },
+    { 0xff, 0x12, 1, CPU_OP_WRITE, cpu_op_ld_mde_a },
+    { 0xff, 0x17, 1, 0, cpu_op_rla },
+    { 0xff, 0x18, 2, CPU_OP_JUMP, cpu_op_jr },
+    { 0xff, 0x1a, 1, 0, cpu_op_ld_a_mde },
+    { 0xff, 0x1f, 1, 0, cpu_op_rra },
+    { 0xe7, 0x20, 2, CPU_OP_JUMP, cpu_op_jr_cond },
+    { 0xff, 0x22, 1, CPU_OP_WRITE, cpu_op_ldi_mhl_a },
+    { 0xff, 0x27, 1, 0, cpu_op_daa },
+    { 0xff, 0x2a, 1, 0, cpu_op_ldi_a_mhl },
+    { 0xff, 0x2f, 1, 0, cpu_op_cpl },
+    { 0xff, 0x32, 1, CPU_OP_WRITE, cpu_op_ldd_mhl_a },
+    { 0xff, 0x37, 1, 0, cpu_op_scf },
+    { 0xff, 0x3a, 1, 0, cpu_op_ldd_a_mhl },
+    { 0xff, 0x3f, 1, 0, cpu_op_ccf },
+    { 0xff, 0x76, 1, CPU_OP_INTR, cpu_op_halt },
+    { 0xc0, 0x40, 1, CPU_OP_WRITE, cpu_op_ld_r8_r8 },
+    { 0xf8, 0x80, 1, 0, cpu_op_add_a_r8 },
+    { 0xf8, 0x88, 1, 0, cpu_op_adc_a_r8 },
+    { 0xf8, 0x90, 1, 0, cpu_op_sub_r8 },
+    { 0xf8, 0x98, 1, 0, cpu_op_sbc_a_r8 },
+    { 0xf8, 0xa0, 1, 0, cpu_op_and_r8 },
+    { 0xf8, 0xa8, 1, 0, cpu_op_xor_r8 },
+    { 0xf8, 0xb0, 1, 0, cpu_op_or_r8 },
+    { 0xf8, 0xb8, 1, 0, cpu_op_cp_r8 },
+    { 0xe7, 0xc0, 1, CPU_OP_JUMP, cpu_op_ret_cond },
+    { 0xcf, 0xc1, 1, 0, cpu_op_pop_r16 },
+    { 0xe7, 0xc2, 3, CPU_OP_JUMP, cpu_op_jp_cond },
+    { 0xff, 0xc3, 3, CPU_OP_JUMP, cpu_op_jp },
+    { 0xe7, 0xc4, 3, CPU_OP_JUMP | CPU_OP_WRITE, cpu_op_call_cond },
+    { 0xcf, 0xc5, 1, CPU_OP_WRITE, cpu_op_push_r16 },
+    { 0xff, 0xc6, 2, 0, cpu_op_add_a_imm8 },
+    { 0xc7, 0xc7, 1, CPU_OP_JUMP | CPU_OP_WRITE, cpu_op_rst },
+    { 0xff, 0xc9, 1, CPU_OP_JUMP, cpu_op_ret },
+    { 0xff, 0xcd, 3, CPU_OP_JUMP | CPU_OP_WRITE, cpu_op_call },
+    { 0xff, 0xce, 2, 0, cpu_op_adc_imm8 },
+    { 0xff, 0xd6, 2, 0, cpu_op_sub_imm8 },
+    { 0xff, 0xd9, 1, CPU_OP_JUMP | CPU_OP_INTR, cpu_op_reti },
+    { 0xff, 0xde, 2, 0, cpu_op_sbc_imm8 },
+    { 0xff, 0xe0, 2, CPU_OP_WRITE, cpu_op_ldh_mimm8_a },
+    { 0xff, 0xe2, 1, CPU_OP_WRITE, cpu_op_ldh_mc_a },
+    { 0xff, 0xe6, 2, 0, cpu_op_and_imm8 },
+    { 0xff, 0xe8, 2, 0, cpu_op_add_sp_imm8 },
+    { 0xff, 0xe9, 1, CPU_OP_JUMP, cpu_op_jp_hl },
+    { 0xff, 0xea, 3, CPU_OP_WRITE, cpu_op_ld_mimm16_a },
+    { 0xff, 0xcb, 2, 0, cpu_op_cb },
+    { 0xff, 0xee, 2, 0, cpu_op_xor_imm8 },
+    { 0xff, 0xf0, 2, 0, cpu_op_ldh_a_mimm8 },
+    { 0xff, 0xf2, 1, 0, cpu_op_ldh_a_mc },
+    { 0xff, 0xf3, 1, CPU_OP_INTR, cpu_op_di },
+    { 0xff, 0xf6, 2, 0, cpu_op_or_imm8 },
+    { 0xff, 0xf8, 2, 0, cpu_op_ld_hl_sp_imm8 },
+    { 0xff, 0xf9, 1, 0, cpu_op_ld_sp_hl },
+    { 0xff, 0xfa, 3, 0, cpu_op_ld_a_mimm16 },
+    { 0xff, 0xfb, 1, CPU_OP_INTR, cpu_op_ei },
+    { 0xff, 0xfe, 2, 0, cpu_op_cp_imm8 },
+};
+
+static const struct cpu_opcode opcode_unknown =
+    { 0x00, 0x00, 1, CPU_OP_JUMP, cpu_op_unknown };
+
+static void cpu_init_opcode_lut(struct gb_state *s) {
+    const size_t num_opcodes = sizeof(opcodes) / sizeof(opcodes[0]);
+    for (unsigned op = 0; op < 256; op++) {
+        s->emu_cpu_state->opcode_lut[op] = &opcode_unknown;
+        for (size_t i = 0; i < num_opcodes; i++)
+            if (M(op, opcodes[i].value, opcodes[i].mask)) {
+                s->emu_cpu_state->opcode_lut[op] = &opcodes[i];
+                break;
+            }
+    }
+}
+
+/*
+ * Decodes the instruction at `pc` without executing it. Used by the block cache
+ * to decode basic blocks. CB-prefixed instructions that modify (HL) are flagged
+ * as writes, just like their non-prefixed counterparts.
+ */
+void cpu_decode(struct gb_state *s, u16 pc, struct cpu_insn *ret) {
+    u8 op = mmu_read(s, pc);
+    const struct cpu_opcode *opcode = s->emu_cpu_state->opcode_lut[op];
+
+    ret->fn = opcode->fn;
+    ret->op = op;
+    ret->len = opcode->len;
+    ret->flags = opcode->flags;
+    ret->cycles = cycles_per_instruction[op];
+    if (op == 0xcb) {
+        u8 cb_op = mmu_read(s, pc + 1);
+        ret->cycles = cycles_per_instruction_cb[cb_op];
+        if ((cb_op & 7) == 6 && !M(cb_op, 0x40, 0xc0)) /* (HL), not BIT */
+            ret->flags |= CPU_OP_WRITE;
+    }
+}
+
+static void cpu_do_instruction(struct gb_state *s) {
+    u8 op = mmu_read(s, s->pc++);
+    s->emu_cpu_state->opcode_lut[op]->fn(s, op);
+}
+
 void cpu_step(struct gb_state *s) {
+    PROF_ZONE("cpu_step");
     u8 op;
 
-    s->emu_state->last_op_cycles = 0;
+    s->last_op_cycles = 0;
 
     cpu_handle_interrupts(s);
 
     op = mmu_read(s, s->pc);
-    s->emu_state->last_op_cycles = cycles_per_instruction[op];
+    s->last_op_cycles = cycles_per_instruction[op];
     if (op == 0xcb) {
         op = mmu_read(s, s->pc + 1);
-        s->emu_state->last_op_cycles = cycles_per_instruction_cb[op];
+        s->last_op_cycles = cycles_per_instruction_cb[op];
     }
 
-    if (!s->halt_for_interrupts)
-        cpu_do_instruction(s);
-    else
+    if (!s->halt_for_interrupts) {
+        /* Hot code might have been decoded into a block, which executes
+         * several instructions at once and accounts their cycles itself. */
+        if (!s->emu_blockcache_state || !blockcache_run_block(s))
+            cpu_do_instruction(s);
+    } else
         if (!s->interrupts_enable)
             cpu_error("Waiting for interrupts while disabled, deadlock.\n");
 
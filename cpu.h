@@ -3,9 +3,37 @@
 
 #include "types.h"
 
+/* Properties of instructions, used to find the end of basic blocks. */
+#define CPU_OP_JUMP  (1 << 0) /* Might change PC to something non-sequential. */
+#define CPU_OP_WRITE (1 << 1) /* Might write to memory (incl. MBC, I/O). */
+#define CPU_OP_INTR  (1 << 2) /* Changes interrupt or halt state. */
+
+typedef void (*cpu_op_fn)(struct gb_state *s, u8 op);
+
+struct cpu_opcode {
+    u8 mask;
+    u8 value;
+    u8 len;
+    u8 flags;
+    cpu_op_fn fn;
+};
+
+/* A single decoded instruction. The handler expects PC to point right after
+ * the opcode byte, and will consume any immediates itself. */
+struct cpu_insn {
+    cpu_op_fn fn;
+    u8 op;
+    u8 len;
+    u8 flags;
+    u8 cycles;
+};
+
+size_t cpu_arena_size(void);
 void cpu_init_emu_cpu_state(struct gb_state *s);
 void cpu_reset_state(struct gb_state *s);
+void cpu_decode(struct gb_state *s, u16 pc, struct cpu_insn *ret);
 void cpu_step(struct gb_state *s);
 void cpu_timers_step(struct gb_state *s);
+s32 cpu_cycles_until_event(struct gb_state *s);
 
 #endif
@@ -130,7 +130,7 @@ int disassemble_pc(struct gb_state* s, u16 pc) {
     s8 stemp;
 
     if (oldpc >= 0x4000 && oldpc < 0x8000)
-        printf("(%x:%.4x)  ", s->mem_bank_rom, oldpc); /* TODO: MBC1 upper bits */
+        printf("(%x:%.4x)  ", mmu_rom_bank(s), oldpc);
     else
         printf("(%.4x)  ", oldpc);
 
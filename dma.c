@@ -0,0 +1,146 @@
+/*
+ * DMA transfers: OAM DMA (FF46) and the CGB general purpose (GDMA) and H-Blank
+ * (HDMA) VRAM transfers (FF51-FF55).
+ *
+ * Transfers copy directly from the memory backing the source address when it
+ * is in the memory map (ROM, VRAM, WRAM, cartridge RAM), in chunks that don't
+ * cross a 4K page (the smallest bank size). Other sources (RTC and other MBC
+ * registers, I/O) go through mmu_read byte by byte.
+ *
+ * The OAM DMA copy itself is done at once, but OAM stays inaccessible to the
+ * CPU for the 640 clks the transfer takes on hardware. GDMA and HDMA halt the
+ * CPU while copying, so their time is added to the current step.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "dma.h"
+#include "mmu.h"
+#include "lcd.h"
+#include "hwdefs.h"
+#include "debugger.h"
+
+#define dma_assert(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("DMA Assertion failed at %s:%d: " #cond "\n", __FILE__, __LINE__); \
+            dbg_run_debugger(s); \
+        } \
+    } while (0)
+
+#define DMA_PAGE_SIZE 0x1000
+
+/* Host memory backing the given address, or NULL if it needs mmu_read. Only
+ * valid up to the end of the 4K page. */
+static u8 *dma_src_ptr(struct gb_state *s, u16 addr) {
+    u8 *page = s->mem_map_read[addr >> 12];
+    return page ? page + (addr & (DMA_PAGE_SIZE - 1)) : NULL;
+}
+
+static void dma_copy(struct gb_state *s, u8 *dst, u16 src, u16 len) {
+    while (len) {
+        u16 chunk = DMA_PAGE_SIZE - (src & (DMA_PAGE_SIZE - 1));
+        if (chunk > len)
+            chunk = len;
+
+        u8 *p = dma_src_ptr(s, src);
+        if (p)
+            memcpy(dst, p, chunk);
+        else
+            for (u16 i = 0; i < chunk; i++)
+                dst[i] = mmu_read(s, src + i);
+
+        dst += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+}
+
+static void dma_to_vram(struct gb_state *s, u16 dst, u16 src, u16 len) {
+    lcd_catch_up(s);
+    dma_copy(s, &s->mem_VRAM[s->mem_bank_vram * VRAM_BANKSIZE + dst - 0x8000],
+            src, len);
+}
+
+static u32 dma_hdma_clks(struct gb_state *s, u16 blocks) {
+    /* Same time regardless of speed, so twice the CPU clks in double speed. */
+    return (blocks * GB_HDMA_BLOCK_CLKS) << s->double_speed;
+}
+
+static void dma_hdma_do(struct gb_state *s) {
+    /* DMA one block (0x10 byte), should be called at start of H-Blank. */
+    dma_assert(s->io_hdma_running);
+    dma_assert((s->io_hdma_status & (1<<7)) == 0);
+    dma_assert((s->io_lcd_STAT & 3) == 0);
+
+    dma_to_vram(s, s->io_hdma_next_dst, s->io_hdma_next_src, 0x10);
+    s->io_hdma_next_src += 0x10;
+    s->io_hdma_next_dst += 0x10;
+
+    s->last_op_cycles += dma_hdma_clks(s, 1);
+
+    s->io_hdma_status--;
+    if (s->io_hdma_status == 0xff) {
+        /* Underflow meant we copied the last block and are done. */
+        s->io_hdma_running = 0;
+    }
+}
+
+void dma_hdma_start(struct gb_state *s, u8 lenmode) {
+    u16 blocks = (lenmode & ~(1<<7)) + 1;
+    u16 len = blocks * 0x10;
+    u8 mode_hblank = (lenmode & (1<<7)) ? 1 : 0;
+    u16 src = ((s->io_hdma_src_high << 8) | s->io_hdma_src_low) & ~0xf;
+    u16 dst = ((s->io_hdma_dst_high << 8) | s->io_hdma_dst_low) & ~0xf;
+    dst = (dst & 0x1fff) | 0x8000; /* Ignore upper 3 bits (always in VRAM) */
+
+    printf("HDMA @%.2x:%.4x %.4x -> %.4x, blocks=%.2x mode_hblank=%d\n",
+            s->mem_bank_rom, s->pc,  src, dst, blocks, mode_hblank);
+
+    if (s->io_hdma_running && !mode_hblank) {
+        /* Cancel ongoing H-Blank HDMA transfer */
+        s->io_hdma_running = 0;
+        s->io_hdma_status = 0xff; /* done */
+        return;
+    }
+
+    dma_assert(blocks > 0 && blocks <= 0x80);
+    dma_assert(src + len <= 0x8000 || /* ROM */
+            (src >= 0xa000 && src + len <= 0xe000)); /* EXT_RAM */
+    dma_assert(dst >= 0x8000 && dst + len <= 0xa000); /* VRAM */
+
+    if (!mode_hblank) {
+        dma_to_vram(s, dst, src, len);
+        s->io_hdma_status = 0xff; /* done */
+        s->last_op_cycles += dma_hdma_clks(s, blocks);
+    } else {
+        s->io_hdma_running = 1;
+        s->io_hdma_next_src = src;
+        s->io_hdma_next_dst = dst;
+        s->io_hdma_status = blocks - 1;
+
+        if ((s->io_lcd_STAT & 3) == 0) /* H-Blank */
+            dma_hdma_do(s);
+    }
+}
+
+void dma_oam_start(struct gb_state *s, u8 src_high) {
+    lcd_catch_up(s);
+    s->io_dma_oam_src = src_high;
+    dma_copy(s, s->mem_OAM, src_high << 8, OAM_SIZE);
+    s->emu_state->lcd_oam_dirty = 1;
+    s->io_dma_oam_cycles_left = GB_OAM_DMA_CLKS;
+}
+
+void dma_step(struct gb_state *s) {
+    if (s->io_dma_oam_cycles_left) {
+        if (s->io_dma_oam_cycles_left > s->last_op_cycles)
+            s->io_dma_oam_cycles_left -= s->last_op_cycles;
+        else
+            s->io_dma_oam_cycles_left = 0;
+    }
+
+    if (s->emu_state->lcd_entered_hblank && s->io_hdma_running)
+        dma_hdma_do(s);
+}
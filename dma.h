@@ -0,0 +1,10 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include "types.h"
+
+void dma_step(struct gb_state *s);
+void dma_oam_start(struct gb_state *s, u8 src_high);
+void dma_hdma_start(struct gb_state *s, u8 lenmode);
+
+#endif
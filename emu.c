@@ -7,13 +7,18 @@
 #include "emu.h"
 #include "state.h"
 #include "cpu.h"
+#include "blockcache.h"
 #include "mmu.h"
+#include "mbc.h"
+#include "dma.h"
 #include "lcd.h"
 #include "audio.h"
+#include "serial.h"
 #include "disassembler.h"
 #include "debugger.h"
 #include "gui.h"
 #include "fileio.h"
+#include "prof.h"
 
 #define emu_error(fmt, ...) \
     do { \
@@ -21,19 +26,25 @@
         return 1; \
     } while (0)
 
+static void emu_apply_queued_inputs(struct gb_state *s);
+
+/* Saves Ext RAM or the state to out_filename, NULL if saving is off. */
 void emu_save(struct gb_state *s, char extram, char *out_filename) {
     u8 *state_buf;
     size_t state_buf_size;
 
-    if (extram && !s->has_extram)
+    if (!out_filename)
+        return;
+    if (extram && !s->has_extram && !s->has_rtc)
         return;
 
     if (extram)
         state_save_extram(s, &state_buf, &state_buf_size);
-    else
-        state_save(s, &state_buf, &state_buf_size);
+    else if (state_save(s, &state_buf, &state_buf_size))
+        return;
 
     save_file(out_filename, state_buf, state_buf_size);
+    free(state_buf);
 
     printf("%s saved to \"%s\".\n", extram ? "Ext RAM" : "State", out_filename);
 }
@@ -44,9 +55,6 @@ int emu_init(struct gb_state *s, struct emu_args *args) {
 
     if (!args->rom_filename)
         emu_error("Must specify ROM filename");
-    if (strlen(args->rom_filename) >
-            sizeof(s->emu_state->state_filename_out) - 6)
-        emu_error("ROM filename too long (%s)", args->rom_filename);
 
     if (args->state_filename) {
         printf("Loading savestate from \"%s\" ...\n", args->state_filename);
@@ -58,6 +66,7 @@ int emu_init(struct gb_state *s, struct emu_args *args) {
 
         if (state_load(s, state_buf, state_buf_size))
             emu_error("Error during loading of state, aborting.\n");
+        free(state_buf);
 
         print_rom_header_info(s->mem_ROM);
 
@@ -74,6 +83,7 @@ int emu_init(struct gb_state *s, struct emu_args *args) {
         if (state_new_from_rom(s, rom, rom_size))
             emu_error("Error loading ROM \"%s\", aborting.\n",
                     args->rom_filename);
+        free(rom);
 
         cpu_reset_state(s);
 
@@ -82,6 +92,7 @@ int emu_init(struct gb_state *s, struct emu_args *args) {
             size_t bios_size;
             read_file(args->bios_filename, &bios, &bios_size);
             state_add_bios(s, bios, bios_size);
+            free(bios);
         }
 
         if (args->save_filename) {
@@ -93,25 +104,46 @@ int emu_init(struct gb_state *s, struct emu_args *args) {
 
             if (state_load_extram(s, state_buf, state_buf_size))
                 emu_error("Error during loading of save, aborting.\n");
-        } else {
+            free(state_buf);
+        } else if (!args->no_save_files) {
             char savname[1024];
             snprintf(savname, sizeof(savname), "%ssav", args->rom_filename);
             u8 *state_buf;
             size_t state_buf_size;
-            if (read_file(savname, &state_buf, &state_buf_size) == 0)
+            if (read_file(savname, &state_buf, &state_buf_size) == 0) {
                 if (state_load_extram(s, state_buf, state_buf_size))
                     emu_error("Error during loading of save.\n");
+                free(state_buf);
+            }
         }
     }
+
+    if (mbc_init(s))
+        emu_error("Error setting up the cartridge MBC, aborting.\n");
+    mmu_update_map(s);
+
     init_emu_state(s);
     cpu_init_emu_cpu_state(s);
 
-    snprintf(s->emu_state->save_filename_out,
-            sizeof(s->emu_state->save_filename_out), "%ssav",
-            args->rom_filename);
-    snprintf(s->emu_state->state_filename_out,
-            sizeof(s->emu_state->state_filename_out), "%sstate",
-            args->rom_filename);
+    s->emu_blockcache_state = NULL;
+    if (args->blockcache_enable) {
+        if (blockcache_init(s, !args->blockcache_no_native))
+            emu_error("Couldn't initialize block cache");
+    }
+
+    /* Without them nothing is saved (see emu_save). */
+    if (!args->no_save_files) {
+        size_t filename_len = strlen(args->rom_filename) + sizeof("state");
+        s->emu_state->save_filename_out = malloc(filename_len);
+        s->emu_state->state_filename_out = malloc(filename_len);
+        if (!s->emu_state->save_filename_out ||
+                !s->emu_state->state_filename_out)
+            emu_error("Couldn't allocate output filenames");
+        snprintf(s->emu_state->save_filename_out, filename_len, "%ssav",
+                args->rom_filename);
+        snprintf(s->emu_state->state_filename_out, filename_len, "%sstate",
+                args->rom_filename);
+    }
 
     if (lcd_init(s))
         emu_error("Couldn't initialize LCD");
@@ -121,6 +153,12 @@ int emu_init(struct gb_state *s, struct emu_args *args) {
             emu_error("Couldn't initialize audio");
     }
 
+    if (emu_set_runahead(s, args->runahead_frames))
+        emu_error("Couldn't allocate run-ahead snapshot");
+
+    if (args->link_path && serial_link_unix(s, args->link_path))
+        emu_error("Couldn't set up link cable");
+
     if (args->break_at_start)
         s->emu_state->dbg_break_next = 1;
     if (args->print_disas)
@@ -132,28 +170,52 @@ int emu_init(struct gb_state *s, struct emu_args *args) {
     return 0;
 }
 
-void emu_step(struct gb_state *s) {
-    if (s->emu_state->dbg_print_disas)
-        disassemble(s);
-
-    if (s->emu_state->dbg_break_next ||
-        s->pc == s->emu_state->dbg_breakpoint)
-        if (dbg_run_debugger(s)) {
-            s->emu_state->quit = 1;
-            return;
-        }
+/* Frees all memory of the instance, it can't be used afterwards. */
+void emu_free(struct gb_state *s) {
+    state_snapshot_free(s->emu_state->runahead_snap);
+    free(s->emu_state->save_filename_out);
+    free(s->emu_state->state_filename_out);
+    serial_free(s);
+    blockcache_free(s);
+    state_free(s);
+}
 
-    cpu_step(s);
+/* Steps everything but the CPU over the last_op_cycles the CPU just ran. */
+void emu_step_devices(struct gb_state *s) {
     lcd_step(s);
-    mmu_step(s);
+    dma_step(s);
     cpu_timers_step(s);
 
-    s->emu_state->time_cycles += s->emu_state->last_op_cycles;
-    if (s->emu_state->time_cycles >= GB_FREQ) {
-        s->emu_state->time_cycles %= GB_FREQ;
-        s->emu_state->time_seconds++;
+    s->time_cycles += s->last_op_cycles >> s->double_speed;
+}
+
+void emu_step(struct gb_state *s) {
+    /* Frames run ahead are rolled back and run again, the debugger only sees
+     * the real ones. */
+    if (!s->emu_state->runahead_active) {
+        if (s->emu_state->dbg_print_disas)
+            disassemble(s);
+
+        if (s->emu_state->dbg_break_next ||
+            s->pc == s->emu_state->dbg_breakpoint)
+            if (dbg_run_debugger(s)) {
+                s->emu_state->quit = 1;
+                return;
+            }
     }
 
+    cpu_step(s);
+    emu_step_devices(s);
+
+    if (s->time_cycles >= s->emu_state->input_next_cycles)
+        emu_apply_queued_inputs(s);
+
+    if (s->time_cycles >= s->serial_next_cycles)
+        serial_step(s);
+
+    /* Frames run ahead are rolled back, only save the real ones. */
+    if (s->emu_state->runahead_active)
+        return;
 
     if (s->emu_state->make_savestate) {
         s->emu_state->make_savestate = 0;
@@ -168,17 +230,75 @@ void emu_step(struct gb_state *s) {
     }
 }
 
+static void emu_run_frames(struct gb_state *s, int frames, bool draw_last) {
+    for (int i = frames; i > 0; i--) {
+        s->emu_state->lcd_skip_render = i > 1 || !draw_last;
+        do {
+            emu_step(s);
+        } while (!s->emu_state->lcd_entered_vblank);
+    }
+}
+
 void emu_step_frame(struct gb_state *s) {
-    do {
-        emu_step(s);
-    } while (!s->emu_state->lcd_entered_vblank);
+    PROF_ZONE("emu_step_frame");
+    struct emu_state *es = s->emu_state;
+
+    /* In turbo mode only the last of the frames is drawn. With run-ahead that
+     * is the last frame run ahead, the state then goes back to the real one. */
+    if (es->runahead_frames) {
+        emu_run_frames(s, es->turbo_frames, 0);
+        state_snapshot_take(s, es->runahead_snap);
+        es->runahead_active = 1;
+        emu_run_frames(s, es->runahead_frames, 1);
+        bool quit = es->quit; /* E.g. a queued input, don't roll that back */
+        state_snapshot_restore(s, es->runahead_snap);
+        es->quit |= quit;
+    } else
+        emu_run_frames(s, es->turbo_frames, 1);
 
     /* Save periodically (once per frame) if dirty. */
-    s->emu_state->flush_extram = 1;
+    es->flush_extram = 1;
+
+}
+
+/* Runs the given number of frames per emu_step_frame, 1 to turn turbo off.
+ * Frontends should skip pacing and mute audio while it's on. */
+void emu_set_turbo(struct gb_state *s, int frames) {
+    s->emu_state->turbo_frames = frames > 1 ? frames : 1;
+}
 
+/*
+ * Shows the state the given number of frames ahead of the emulation, 0 to turn
+ * it off. Every frame then costs 1 + frames frames of emulation. The snapshot
+ * is allocated here, so emu_step_frame doesn't allocate. Returns non-zero if
+ * that fails.
+ */
+int emu_set_runahead(struct gb_state *s, int frames) {
+    struct emu_state *es = s->emu_state;
+
+    if (frames > 0 && !es->runahead_snap) {
+        es->runahead_snap = state_snapshot_new(s);
+        if (!es->runahead_snap)
+            return 1;
+    }
+    es->runahead_frames = frames > 0 ? frames : 0;
+    return 0;
+}
+
+/* The P10-P13 lines of the joypad register, low when a button is pressed in
+ * one of the selected groups. */
+static u8 emu_joypad_lines(struct gb_state *s) {
+    u8 lines = 0x0f;
+    if (!(s->io_buttons & (1 << 4)))
+        lines &= s->io_buttons_dirs;
+    if (!(s->io_buttons & (1 << 5)))
+        lines &= s->io_buttons_buttons;
+    return lines & 0x0f;
 }
 
 void emu_process_inputs(struct gb_state *s, struct player_input *input) {
+    u8 old_lines = emu_joypad_lines(s);
+
     if (input->special_quit)
         s->emu_state->quit = 1;
 
@@ -188,6 +308,9 @@ void emu_process_inputs(struct gb_state *s, struct player_input *input) {
     if (input->special_savestate)
         s->emu_state->make_savestate = 1;
 
+    if (input->special_turbo)
+        emu_set_turbo(s, s->emu_state->turbo_frames > 1 ? 1 : EMU_TURBO_FRAMES);
+
 #define BTN(type, button, bit) \
     do { \
         if (input->button_ ## button) \
@@ -206,4 +329,50 @@ void emu_process_inputs(struct gb_state *s, struct player_input *input) {
     BTN(dirs,     right,   0);
 
 #undef BTN
+
+    /* Joypad interrupt on any line going low. */
+    if (old_lines & ~emu_joypad_lines(s))
+        s->interrupts_request |= 1 << 4;
+}
+
+/*
+ * Queues input to apply at the given emulated time (gb_state->time_cycles),
+ * so frontends can deliver inputs at the point within a frame they happened at
+ * instead of only between frames. Inputs in the past are applied right away.
+ */
+void emu_queue_input(struct gb_state *s, struct player_input *input,
+        u64 time_cycles) {
+    struct emu_state *es = s->emu_state;
+
+    if (time_cycles <= s->time_cycles) {
+        emu_process_inputs(s, input);
+        return;
+    }
+    if (es->input_queue_len == EMU_INPUT_QUEUE_LEN) { /* Full, drop oldest */
+        emu_process_inputs(s, &es->input_queue[0].input);
+        memmove(&es->input_queue[0], &es->input_queue[1],
+                --es->input_queue_len * sizeof(struct emu_input_event));
+    }
+
+    int i = es->input_queue_len++;
+    for (; i > 0 && es->input_queue[i - 1].time_cycles > time_cycles; i--)
+        es->input_queue[i] = es->input_queue[i - 1];
+    es->input_queue[i].time_cycles = time_cycles;
+    es->input_queue[i].input = *input;
+    es->input_next_cycles = es->input_queue[0].time_cycles;
+}
+
+static void emu_apply_queued_inputs(struct gb_state *s) {
+    struct emu_state *es = s->emu_state;
+    int n = 0;
+
+    while (n < es->input_queue_len &&
+            es->input_queue[n].time_cycles <= s->time_cycles)
+        emu_process_inputs(s, &es->input_queue[n++].input);
+
+    es->input_queue_len -= n;
+    memmove(&es->input_queue[0], &es->input_queue[n],
+            es->input_queue_len * sizeof(struct emu_input_event));
+    es->input_next_cycles = es->input_queue_len ?
+        es->input_queue[0].time_cycles : UINT64_MAX;
 }
@@ -4,21 +4,36 @@
 #include "types.h"
 #include "player_input.h"
 
+/* Frames run for every shown frame in turbo mode. */
+static const int EMU_TURBO_FRAMES = 8;
+
 struct emu_args {
     char *rom_filename;
     char *bios_filename;
     char *state_filename;
     char *save_filename;
+    char *link_path; /* UNIX socket of the link cable, or NULL. */
     char break_at_start;
     char print_disas;
     char print_mmu;
     char audio_enable;
+    char blockcache_enable;
+    char blockcache_no_native; /* Don't translate blocks to machine code. */
+    char runahead_frames;
+    char no_save_files; /* Don't load or write the save next to the ROM, nor
+                           write states, so runs are repeatable. */
 };
 
 int emu_init(struct gb_state *s, struct emu_args *args);
+void emu_step_devices(struct gb_state *s);
 void emu_step(struct gb_state *s);
 void emu_step_frame(struct gb_state *s);
+void emu_set_turbo(struct gb_state *s, int frames);
+int emu_set_runahead(struct gb_state *s, int frames);
 void emu_process_inputs(struct gb_state *s, struct player_input *input_state);
+void emu_queue_input(struct gb_state *s, struct player_input *input_state,
+        u64 time_cycles);
 void emu_save(struct gb_state *s, char extram, char *out_filename);
+void emu_free(struct gb_state *s);
 
 #endif
@@ -7,9 +7,13 @@ int gui_audio_init(int sample_rate, int channels, size_t sndbuf_size,
         uint8_t *sndbuf);
 
 int gui_lcd_init(int width, int height, int zoom, char *wintitle);
-void gui_lcd_render_frame(char use_colors, uint16_t *pixbuf);
+/* lines_changed has a flag per LCD line, or is NULL to draw all lines. */
+void gui_lcd_render_frame(char use_colors, uint16_t *pixbuf,
+        const uint8_t *lines_changed);
+uint16_t gui_lcd_color(uint8_t r, uint8_t g, uint8_t b);
 
 
 int gui_input_poll(struct player_input *input);
+int gui_input_poll2(struct player_input *input, struct player_input *input2);
 
 #endif
@@ -0,0 +1,248 @@
+/*
+ * Headless frontend: runs ROMs as fast as possible without video, audio or
+ * input, and reports the emulation speed and the hash of the last frame. Used
+ * for benchmarking, profiling, as the training run of PGO builds and as the
+ * runner of the test suite (see tests/CMakeLists.txt). Save files next to the
+ * ROMs are neither read nor written, so runs are repeatable.
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "types.h"
+#include "hwdefs.h"
+#include "emu.h"
+#include "lcd.h"
+#include "serial.h"
+#include "prof.h"
+
+#define SERIAL_CAPTURE_SIZE 4096
+
+struct headless_args {
+    int frames;
+    char blockcache_enable;
+    char blockcache_no_native;
+    int runahead_frames;
+    int turbo_frames;
+    char test;
+    char expect_hash_set;
+    u64 expect_hash;
+    double min_speed;
+};
+
+enum test_result {
+    TEST_RUNNING,
+    TEST_PASSED,
+    TEST_FAILED,
+};
+
+static void print_usage(char *progname) {
+    printf("Usage: %s [option]... rom...\n\n", progname);
+    printf("Runs each ROM for a number of frames without any output.\n\n");
+    printf("Options:\n");
+    printf(" -f, --frames=N      Number of frames to run (default 3600).\n");
+    printf(" -c, --block-cache   Cache decoded blocks of hot ROM code.\n");
+    printf(" -N, --no-native     With -c, don't translate blocks to machine "
+            "code.\n");
+    printf(" -r, --runahead=N    Run N frames ahead.\n");
+    printf(" -t, --turbo=N       Run N frames per shown frame.\n");
+    printf(" -T, --test          Stop at the result of a test ROM (Blargg or "
+            "mooneye),\n");
+    printf("                     fail if there is none within the frames.\n");
+    printf(" -H, --hash=HASH     Pass if the last frame has this hash.\n");
+    printf(" -s, --min-speed=PCT Fail if slower than PCT%% of real time.\n");
+    printf(" -h, --help          Print this help and exit.\n");
+    printf("\nExits with 1 if any ROM fails.\n");
+}
+
+static int parse_args(int argc, char **argv, struct headless_args *args) {
+    static struct option long_options[] = {
+        {"frames",   required_argument, NULL, 'f'},
+        {"block-cache", no_argument,    NULL, 'c'},
+        {"no-native", no_argument,      NULL, 'N'},
+        {"runahead", required_argument, NULL, 'r'},
+        {"turbo",    required_argument, NULL, 't'},
+        {"test",     no_argument,       NULL, 'T'},
+        {"hash",     required_argument, NULL, 'H'},
+        {"min-speed", required_argument, NULL, 's'},
+        {"help",     no_argument,       NULL, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    args->frames = 3600;
+    args->blockcache_enable = 0;
+    args->blockcache_no_native = 0;
+    args->runahead_frames = 0;
+    args->turbo_frames = 1;
+    args->test = 0;
+    args->expect_hash_set = 0;
+    args->min_speed = 0;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:cNr:t:TH:s:h", long_options,
+                    NULL)) != -1) {
+        switch (opt) {
+        case 'f': args->frames = atoi(optarg); break;
+        case 'c': args->blockcache_enable = 1; break;
+        case 'N': args->blockcache_no_native = 1; break;
+        case 'r': args->runahead_frames = atoi(optarg); break;
+        case 't': args->turbo_frames = atoi(optarg); break;
+        case 'T': args->test = 1; break;
+        case 'H':
+            args->expect_hash_set = 1;
+            args->expect_hash = strtoull(optarg, NULL, 16);
+            break;
+        case 's': args->min_speed = atof(optarg); break;
+        case 'h':
+            print_usage(argv[0]);
+            exit(0);
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    return 0;
+}
+
+static double now_secs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool serial_contains(struct emu_state *es, const char *str,
+        size_t len) {
+    for (size_t i = 0; i + len <= es->serial_out_len; i++)
+        if (memcmp(es->serial_out + i, str, len) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * Blargg's tests print "Passed" or "Failed" over the serial port. Mooneye's
+ * load the Fibonacci numbers 3, 5, 8, 13, 21, 34 into B-L on success (and send
+ * them over serial), and 0x42 six times on failure.
+ */
+static enum test_result test_result(struct gb_state *s) {
+    struct emu_state *es = s->emu_state;
+
+    if (serial_contains(es, "Passed", 6) ||
+            serial_contains(es, "\x03\x05\x08\x0d\x15\x22", 6))
+        return TEST_PASSED;
+    if (serial_contains(es, "Failed", 6) ||
+            serial_contains(es, "\x42\x42\x42\x42\x42\x42", 6))
+        return TEST_FAILED;
+
+    if (s->reg16.BC == 0x0305 && s->reg16.DE == 0x080d &&
+            s->reg16.HL == 0x1522)
+        return TEST_PASSED;
+    return TEST_RUNNING;
+}
+
+static void print_serial(struct emu_state *es) {
+    if (!es->serial_out_len)
+        return;
+    printf("Serial output:\n");
+    for (size_t i = 0; i < es->serial_out_len; i++) {
+        u8 c = es->serial_out[i];
+        if (c == '\n' || (c >= 0x20 && c < 0x7f))
+            putchar(c);
+        else
+            printf("\\x%02x", c);
+    }
+    printf("\n");
+}
+
+/* Returns 1 if the ROM failed: the emulation stopped, or with -T, -H or -s if
+ * the test didn't pass. */
+static int run_rom(char *rom_filename, struct headless_args *args) {
+    static struct gb_state gb_state;
+
+    struct emu_args emu_args = {
+        .rom_filename = rom_filename,
+        .blockcache_enable = args->blockcache_enable,
+        .blockcache_no_native = args->blockcache_no_native,
+        .runahead_frames = args->runahead_frames,
+        .no_save_files = 1, /* Runs must be repeatable */
+    };
+
+    if (emu_init(&gb_state, &emu_args)) {
+        fprintf(stderr, "Initialization of \"%s\" failed\n", rom_filename);
+        return 1;
+    }
+    emu_set_turbo(&gb_state, args->turbo_frames);
+    if (args->test && serial_capture(&gb_state, SERIAL_CAPTURE_SIZE)) {
+        fprintf(stderr, "Couldn't allocate serial capture buffer\n");
+        emu_free(&gb_state);
+        return 1;
+    }
+
+    enum test_result result = TEST_RUNNING;
+    double start = now_secs();
+    int frame;
+    for (frame = 0; frame < args->frames && !gb_state.emu_state->quit;
+            frame++) {
+        emu_step_frame(&gb_state);
+
+        if (args->test && (result = test_result(&gb_state)) != TEST_RUNNING) {
+            frame++;
+            break;
+        }
+    }
+    double secs = now_secs() - start;
+    double emulated_secs = gb_state.time_cycles / (double)GB_FREQ;
+    double speed = emulated_secs / secs * 100;
+    u64 hash = lcd_frame_hash(&gb_state);
+
+    printf("%s: %d frames, %.3f sec emulated in %.3f sec (%.0f%%, "
+            "%.2f Mcycles/s), frame hash %016llx\n", rom_filename, frame,
+            emulated_secs, secs, speed, gb_state.time_cycles / secs / 1e6,
+            (unsigned long long)hash);
+
+    int failed = gb_state.emu_state->quit;
+    if (args->test) {
+        print_serial(gb_state.emu_state);
+        if (result == TEST_RUNNING && !args->expect_hash_set) {
+            printf("%s: no test result after %d frames\n", rom_filename,
+                    frame);
+            failed = 1;
+        } else if (result == TEST_FAILED)
+            failed = 1;
+    }
+    if (args->expect_hash_set && result != TEST_PASSED &&
+            hash != args->expect_hash) {
+        printf("%s: frame hash differs, expected %016llx\n", rom_filename,
+                (unsigned long long)args->expect_hash);
+        failed = 1;
+    }
+    if (speed < args->min_speed) {
+        printf("%s: speed below %.0f%% of real time\n", rom_filename,
+                args->min_speed);
+        failed = 1;
+    }
+    if (args->test || args->expect_hash_set)
+        printf("%s: %s\n", rom_filename, failed ? "FAILED" : "PASSED");
+
+    emu_free(&gb_state);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    struct headless_args args;
+    if (parse_args(argc, argv, &args))
+        return 1;
+
+    int ret = 0;
+    for (int i = optind; i < argc; i++)
+        ret |= run_rom(argv[i], &args);
+    prof_print(stdout);
+    return ret;
+}
@@ -1,6 +1,12 @@
 #ifndef HWDEFS_H
 #define HWDEFS_H
 
+/*
+ * There are two clock domains. The CPU, and the timers clocked by it, run at
+ * GB_FREQ, or twice that in CGB double speed mode. All cycle counts of
+ * instructions (and last_op_cycles) are in CPU clks. The LCD, HDMA and sound
+ * always run at GB_FREQ: their clks are CPU clks >> double_speed.
+ */
 #define GB_FREQ 4194304 /* Hz */
 
 static const int GB_LCD_WIDTH  = 160; /* px */
@@ -8,7 +14,8 @@ static const int GB_LCD_HEIGHT = 144; /* px */
 
 static const int GB_LCD_LY_MAX = 153;
 
-static const int GB_HDMA_BLOCK_CLKS = 8;    /* Per block of 0x10 bytes */
+static const int GB_HDMA_BLOCK_CLKS = 32;   /* Per block of 0x10 bytes (LCD clks) */
+static const int GB_OAM_DMA_CLKS    = 640;  /* 0xa0 bytes, 1 per 4 clks */
 
 static const int GB_LCD_MODE_0_CLKS = 204;  /* H-Blank */
 static const int GB_LCD_MODE_1_CLKS = 4560; /* V-Blank */
@@ -16,8 +23,15 @@ static const int GB_LCD_MODE_2_CLKS = 80;   /* OAM read */
 static const int GB_LCD_MODE_3_CLKS = 172;  /* Line rendering */
 static const int GB_LCD_FRAME_CLKS  = 70224; /* Total cycles per frame */
 
-static const int GB_DIV_FREQ = 16384;  /* Hz */
-static const int GB_TIMA_FREQS[] = { 4096, 262144, 65536, 16384 };  /* Hz */
+/* Timer periods in CPU clks, as shifts (all are powers of two). */
+static const int GB_DIV_SHIFT = 8;  /* 16384 Hz */
+static const int GB_TIMA_SHIFTS[] = { 10, 4, 6, 8 };  /* 4096, 262144, 65536, 16384 Hz */
+
+/* Serial transfer clock with the internal clock, per bit, in CPU clks. */
+static const int GB_SERIAL_BIT_CLKS      = 512; /* 8192 Hz */
+static const int GB_SERIAL_FAST_BIT_CLKS = 16;  /* CGB: 262144 Hz */
+
+static const int GB_SPEED_SWITCH_CLKS = 8200; /* CPU is stopped while switching */
 
 static const double GB_SND_DUTY_PERC[] = { .125, .25, .50, .75 };
 static const int GB_SND_ENVSTEP_CYC = GB_FREQ/64; /* n*(1/64)th seconds */
@@ -27,6 +41,7 @@ static const unsigned ROMHDR_CGBFLAG    = 0x143;
 static const unsigned ROMHDR_CARTTYPE   = 0x147;
 static const unsigned ROMHDR_ROMSIZE    = 0x148;
 static const unsigned ROMHDR_EXTRAMSIZE = 0x149;
+static const unsigned ROMHDR_CHECKSUM   = 0x14d;
 
 static const unsigned ROM_BANKSIZE      = 0x4000; /* 16K */
 static const unsigned WRAM_BANKSIZE     = 0x1000; /* 4K */
@@ -3,16 +3,77 @@
 
 #include "lcd.h"
 #include "hwdefs.h"
+#include "state.h"
+#include "prof.h"
+
+/* As constant expressions, for array sizes. */
+#define GB_LCD_WIDTH_PX  160
+#define GB_LCD_HEIGHT_PX 144
+
+#define LCD_MAX_OBJS_PER_LINE 10
+
+struct emu_lcd_state {
+    /* Index of the objects (sprites) visible on each line, sorted from highest
+     * to lowest priority. Rebuilt whenever OAM or the object size changes. */
+    u8 line_objs[GB_LCD_HEIGHT_PX][LCD_MAX_OBJS_PER_LINE];
+    u8 line_num_objs[GB_LCD_HEIGHT_PX];
+    u8 obj_8x16;
+
+    /* Colors of all palettes, already in the output format: 8 palettes of 4
+     * colors on CGB. On DMG only the first (BGP) or first two (OBP0/1) are
+     * used, and contain the shades the palette registers map to. Updated only
+     * when palette registers are written. */
+    u16 bg_colors[32];
+    u16 obj_colors[32];
+    u16 blank_color; /* BG disabled (shade 0) */
+
+    /* Conversion from RGB to the output format, NULL for raw colors (15-bit
+     * BGR on CGB, 2-bit shade on DMG). */
+    lcd_pixfmt_fn to_pixfmt;
+
+    /* Progress of the current line: pixels before render_x were already drawn
+     * because something they depend on was written during mode 3. The color
+     * indices and object coverage of those pixels are kept for the rest. */
+    int render_x;
+    u8 bg_colidx[GB_LCD_WIDTH_PX];
+    u8 obj_drawn[GB_LCD_WIDTH_PX];
+
+    /* Hashes of the lines drawn so far, and of the last complete frame. Lines
+     * are hashed right after being drawn, while still in cache. */
+    u64 line_hash[GB_LCD_HEIGHT_PX];
+    u64 frame_line_hash[GB_LCD_HEIGHT_PX];
+    u64 frame_hash;
+
+    /* Changes of the last complete frame against the one before it. Only lines
+     * with a different hash are compared with the copy of the previous frame
+     * to find the columns that changed. */
+    u8 line_changed[GB_LCD_HEIGHT_PX];
+    struct lcd_rect damage;
+    u16 prev_frame[GB_LCD_WIDTH_PX * GB_LCD_HEIGHT_PX];
+
+    u16 pixbuf[GB_LCD_WIDTH_PX * GB_LCD_HEIGHT_PX]; /* emu_state->lcd_pixbuf */
+};
+
+/* RGB values of the 4 DMG shades (white to black). */
+static const u8 dmg_shades[4] = { 0xff, 0xaa, 0x66, 0x11 };
 
-static void lcd_render_current_line(struct gb_state *gb_state);
+static void lcd_render_span(struct gb_state *gb_state, int x0, int x1);
+static void lcd_end_frame(struct gb_state *s);
+static u64 lcd_hash(const void *data, int words);
+
+/* Bytes lcd_init takes from the state arena. */
+size_t lcd_arena_size(void) {
+    return sizeof(struct emu_lcd_state);
+}
 
 int lcd_init(struct gb_state *s) {
-    s->emu_state->lcd_pixbuf =
-        malloc(GB_LCD_WIDTH * GB_LCD_HEIGHT * sizeof(u16));
-    if (!s->emu_state->lcd_pixbuf)
+    s->emu_lcd_state = state_arena_alloc(s, sizeof(struct emu_lcd_state));
+    if (!s->emu_lcd_state)
         return 1;
-    memset(s->emu_state->lcd_pixbuf, 0,
-            GB_LCD_WIDTH * GB_LCD_HEIGHT * sizeof(u16));
+    s->emu_state->lcd_oam_dirty = 1;
+    lcd_update_palettes(s);
+
+    s->emu_state->lcd_pixbuf = s->emu_lcd_state->pixbuf;
     return 0;
 }
 
@@ -33,7 +94,7 @@ void lcd_step(struct gb_state *s) {
     s->emu_state->lcd_entered_hblank = 0;
     s->emu_state->lcd_entered_vblank = 0;
 
-    s->io_lcd_mode_cycles_left -= s->emu_state->last_op_cycles;
+    s->io_lcd_mode_cycles_left -= s->last_op_cycles >> s->double_speed;
 
     if (s->io_lcd_mode_cycles_left < 0) {
         switch (s->io_lcd_STAT & 3) {
@@ -48,7 +109,7 @@ void lcd_step(struct gb_state *s) {
                 s->io_lcd_mode_cycles_left = GB_LCD_MODE_2_CLKS;
             }
             s->io_lcd_LY = (s->io_lcd_LY + 1) % (GB_LCD_LY_MAX + 1);
-            s->io_lcd_STAT = (s->io_lcd_STAT & 0xfb) | (s->io_lcd_LY == s->io_lcd_LYC);
+            s->io_lcd_STAT = (s->io_lcd_STAT & 0xfb) | ((s->io_lcd_LY == s->io_lcd_LYC) << 2);
 
             /* We incremented line, check LY=LYC and set interrupt if needed. */
             if (s->io_lcd_STAT & (1 << 6) && s->io_lcd_LY == s->io_lcd_LYC)
@@ -79,8 +140,133 @@ void lcd_step(struct gb_state *s) {
             s->interrupts_request |= 1 << 1;
     }
 
-    if (s->emu_state->lcd_entered_hblank)
-        lcd_render_current_line(s);
+    if (s->emu_state->lcd_entered_hblank && !s->emu_state->lcd_skip_render) {
+        struct emu_lcd_state *ls = s->emu_lcd_state;
+        u8 y = s->io_lcd_LY;
+
+        /* Usually the whole line at once. */
+        lcd_render_span(s, ls->render_x, GB_LCD_WIDTH);
+        ls->render_x = 0;
+
+        if (y < GB_LCD_HEIGHT)
+            ls->line_hash[y] = lcd_hash(
+                    &s->emu_state->lcd_pixbuf[y * GB_LCD_WIDTH],
+                    GB_LCD_WIDTH * sizeof(u16) / sizeof(u64));
+    }
+
+    if (s->emu_state->lcd_entered_vblank && !s->emu_state->lcd_skip_render)
+        lcd_end_frame(s);
+}
+
+/*
+ * Called before a write to anything the renderer reads (LCD registers, VRAM,
+ * OAM, palettes). During mode 3 this draws the current line up to the pixel
+ * the LCD is at, so the write only affects the pixels after it.
+ */
+void lcd_catch_up(struct gb_state *s) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+    if ((s->io_lcd_STAT & 3) != 3 || s->emu_state->lcd_skip_render)
+        return;
+
+    int x = (GB_LCD_MODE_3_CLKS - s->io_lcd_mode_cycles_left) * GB_LCD_WIDTH
+        / GB_LCD_MODE_3_CLKS;
+    if (x > GB_LCD_WIDTH)
+        x = GB_LCD_WIDTH;
+    if (x <= ls->render_x)
+        return;
+    lcd_render_span(s, ls->render_x, x);
+    ls->render_x = x;
+}
+
+
+#define LCD_HASH_P1 0x9e3779b185ebca87ULL
+#define LCD_HASH_P2 0xc2b2ae3d27d4eb4fULL
+#define LCD_HASH_P3 0x165667b19e3779f9ULL
+
+static inline u64 lcd_hash_rotl(u64 x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/* 64-bit hash in the style of xxHash64: 4 independent lanes over 8 byte words,
+ * merged and avalanched at the end. The number of words must be a multiple of
+ * 4, which holds for a line (40) and the line hashes of a frame (144). */
+static u64 lcd_hash(const void *data, int words) {
+    const u8 *p = data;
+    u64 acc[4] = { LCD_HASH_P1 + LCD_HASH_P2, LCD_HASH_P2, 0, -LCD_HASH_P1 };
+
+    for (int i = 0; i < words; i += 4, p += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            u64 v;
+            memcpy(&v, p + lane * 8, sizeof(v));
+            acc[lane] += v * LCD_HASH_P2;
+            acc[lane] = lcd_hash_rotl(acc[lane], 31) * LCD_HASH_P1;
+        }
+    }
+
+    u64 h = lcd_hash_rotl(acc[0], 1) + lcd_hash_rotl(acc[1], 7) +
+        lcd_hash_rotl(acc[2], 12) + lcd_hash_rotl(acc[3], 18);
+    h += (u64)words * 8;
+    h ^= h >> 33;
+    h *= LCD_HASH_P2;
+    h ^= h >> 29;
+    h *= LCD_HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Called at the start of VBlank, when all lines of a frame are drawn. */
+static void lcd_end_frame(struct gb_state *s) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+    u16 *pixbuf = s->emu_state->lcd_pixbuf;
+    int x0 = GB_LCD_WIDTH, x1 = 0, y0 = GB_LCD_HEIGHT, y1 = 0;
+
+    for (int y = 0; y < GB_LCD_HEIGHT; y++) {
+        ls->line_changed[y] = ls->line_hash[y] != ls->frame_line_hash[y];
+        if (!ls->line_changed[y])
+            continue;
+        ls->frame_line_hash[y] = ls->line_hash[y];
+
+        u16 *line = &pixbuf[y * GB_LCD_WIDTH];
+        u16 *prev = &ls->prev_frame[y * GB_LCD_WIDTH];
+        int first = 0, last = GB_LCD_WIDTH - 1;
+        while (first < last && line[first] == prev[first])
+            first++;
+        while (last > first && line[last] == prev[last])
+            last--;
+        if (line[first] == prev[first]) { /* Same pixels after all */
+            ls->line_changed[y] = 0;
+            continue;
+        }
+        memcpy(prev, line, GB_LCD_WIDTH * sizeof(u16));
+
+        if (first < x0) x0 = first;
+        if (last > x1) x1 = last;
+        if (y < y0) y0 = y;
+        y1 = y;
+    }
+
+    ls->frame_hash = lcd_hash(ls->frame_line_hash, GB_LCD_HEIGHT);
+    if (y0 < GB_LCD_HEIGHT)
+        ls->damage = (struct lcd_rect){ x0, y0, x1 - x0 + 1, y1 - y0 + 1 };
+    else
+        ls->damage = (struct lcd_rect){ 0, 0, 0, 0 };
+}
+
+u64 lcd_frame_hash(struct gb_state *s) {
+    return s->emu_lcd_state->frame_hash;
+}
+
+u64 lcd_line_hash(struct gb_state *s, int y) {
+    return s->emu_lcd_state->frame_line_hash[y];
+}
+
+int lcd_line_changed(struct gb_state *s, int y) {
+    return s->emu_lcd_state->line_changed[y];
+}
+
+int lcd_frame_damage(struct gb_state *s, struct lcd_rect *rect) {
+    *rect = s->emu_lcd_state->damage;
+    return rect->h > 0;
 }
 
 
@@ -91,16 +277,107 @@ struct __attribute__((__packed__)) OAMentry {
     u8 flags;
 };
 
-u16 palette_get_col(u8 *palettedata, u8 palidx, u8 colidx) {
-    u8 idx = palidx * 8 + colidx * 2;
-    return palettedata[idx] | (palettedata[idx + 1] << 8);
+/*
+ * Rebuilds the per-line object index from OAM. Like the hardware, only the first
+ * 10 objects (in OAM order) on a line are considered. On DMG the object with
+ * the lower X coordinate has priority, with ties going to the lower OAM index.
+ * On CGB only the OAM index counts.
+ */
+static void lcd_build_oam_index(struct gb_state *s) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+    struct OAMentry *OAM = (struct OAMentry*)&s->mem_OAM[0];
+    u8 obj_8x16 = (s->io_lcd_LCDC & (1<<2)) ? 1 : 0;
+    int obj_tile_height = obj_8x16 ? 16 : 8;
+
+    memset(ls->line_num_objs, 0, sizeof(ls->line_num_objs));
+    for (int i = 0; i < 40; i++) {
+        int obj_y = OAM[i].y - 16;
+        for (int y = obj_y; y < obj_y + obj_tile_height; y++) {
+            if (y < 0 || y >= GB_LCD_HEIGHT)
+                continue;
+            if (ls->line_num_objs[y] < LCD_MAX_OBJS_PER_LINE)
+                ls->line_objs[y][ls->line_num_objs[y]++] = i;
+        }
+    }
+
+    if (s->gb_type != GB_TYPE_CGB) {
+        /* Insertion sort on X; objects were added in OAM order so it's stable. */
+        for (int y = 0; y < GB_LCD_HEIGHT; y++) {
+            u8 *objs = ls->line_objs[y];
+            for (int i = 1; i < ls->line_num_objs[y]; i++) {
+                u8 obj = objs[i];
+                int j = i - 1;
+                for (; j >= 0 && OAM[objs[j]].x > OAM[obj].x; j--)
+                    objs[j + 1] = objs[j];
+                objs[j + 1] = obj;
+            }
+        }
+    }
+
+    ls->obj_8x16 = obj_8x16;
+    s->emu_state->lcd_oam_dirty = 0;
+}
+
+static u16 lcd_shade_color(struct gb_state *s, u8 shade) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+    if (!ls->to_pixfmt)
+        return shade;
+    u8 v = dmg_shades[shade];
+    return ls->to_pixfmt(v, v, v);
+}
+
+/* Updates the cached output color for one CGB color (two bytes in BGPD/OBPD). */
+void lcd_update_cgb_color(struct gb_state *s, int obj, u8 idx) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+    u8 *palettedata = obj ? s->io_lcd_OBPD : s->io_lcd_BGPD;
+    u16 *colors = obj ? ls->obj_colors : ls->bg_colors;
+
+    /* Stored as two bytes each, 5 bits per component: -bbbbbgg gggrrrrr. */
+    idx &= 0x3e;
+    u16 rawcol = palettedata[idx] | (palettedata[idx + 1] << 8);
+    if (ls->to_pixfmt) {
+        u8 r = (rawcol >>  0) & 0x1f;
+        u8 g = (rawcol >>  5) & 0x1f;
+        u8 b = (rawcol >> 10) & 0x1f;
+        colors[idx / 2] = ls->to_pixfmt((r << 3) | (r >> 2), (g << 3) | (g >> 2),
+                (b << 3) | (b >> 2));
+    } else
+        colors[idx / 2] = rawcol;
+}
+
+/* Updates the cached output colors for the DMG palette registers (BGP, OBP0,
+ * OBP1), or all CGB colors. */
+void lcd_update_palettes(struct gb_state *s) {
+    struct emu_lcd_state *ls = s->emu_lcd_state;
+
+    if (s->gb_type == GB_TYPE_CGB) {
+        for (int i = 0; i < 0x40; i += 2) {
+            lcd_update_cgb_color(s, 0, i);
+            lcd_update_cgb_color(s, 1, i);
+        }
+    } else {
+        for (int colidx = 0; colidx < 4; colidx++) {
+            int shift = colidx << 1;
+            ls->bg_colors[colidx] =
+                lcd_shade_color(s, (s->io_lcd_BGP >> shift) & 3);
+            ls->obj_colors[colidx] =
+                lcd_shade_color(s, (s->io_lcd_OBP0 >> shift) & 3);
+            ls->obj_colors[4 + colidx] =
+                lcd_shade_color(s, (s->io_lcd_OBP1 >> shift) & 3);
+        }
+    }
+    ls->blank_color = lcd_shade_color(s, 0);
 }
 
-u8 palette_get_gray(u8 palette, u8 colidx) {
-    return (palette >> (colidx << 1)) & 0x3;
+/* Sets the format of the colors in the pixel buffer. */
+void lcd_set_pixfmt(struct gb_state *s, lcd_pixfmt_fn to_pixfmt) {
+    s->emu_lcd_state->to_pixfmt = to_pixfmt;
+    lcd_update_palettes(s);
 }
 
-static void lcd_render_current_line(struct gb_state *gb_state) {
+/* Draws pixels x0 up to (excluding) x1 of the current line. */
+static void lcd_render_span(struct gb_state *gb_state, int x0, int x1) {
+    PROF_ZONE("lcd_render_span");
     /*
      * Tile Data @ 8000-8FFF or 8800-97FF defines the pixels per Tile, which can
      * be used for the BG, window or sprite/object. 192 tiles max, 8x8px, 4
@@ -125,7 +402,7 @@ static void lcd_render_current_line(struct gb_state *gb_state) {
     int y = gb_state->io_lcd_LY;
     u16 *pixbuf = gb_state->emu_state->lcd_pixbuf;
 
-    if (y >= GB_LCD_HEIGHT) /* VBlank */
+    if (y >= GB_LCD_HEIGHT || x0 >= x1) /* VBlank */
         return;
 
     u8 use_col = gb_state->gb_type == GB_TYPE_CGB;
@@ -158,29 +435,23 @@ static void lcd_render_current_line(struct gb_state *gb_state) {
     u8 win_pos_x = gb_state->io_lcd_WX;
     u8 win_pos_y = gb_state->io_lcd_WY;
 
-    u8 bgwin_palette = gb_state->io_lcd_BGP;
-    u8 obj_palette1 = gb_state->io_lcd_OBP0;
-    u8 obj_palette2 = gb_state->io_lcd_OBP1;
 
     u8 obj_tile_height = obj_8x16 ? 16 : 8;
 
-    /* OAM scan - gather (max 10) objects on this line in cache */
-    /* TODO: sort the objs so those with smaller x coord have higher prio */
+    /* Objects on this line, sorted from highest to lowest priority. */
+    struct emu_lcd_state *ls = gb_state->emu_lcd_state;
+    if (gb_state->emu_state->lcd_oam_dirty || ls->obj_8x16 != obj_8x16)
+        lcd_build_oam_index(gb_state);
     struct OAMentry *OAM = (struct OAMentry*)&gb_state->mem_OAM[0];
-    struct OAMentry objs[10];
-    int num_objs = 0;
-    if (obj_enable)
-        for (int i = 0; i < 40; i++) {
-            if (y >= OAM[i].y - 16 && y < OAM[i].y - 16 + obj_tile_height)
-                objs[num_objs++] = OAM[i];
-            if (num_objs == 10)
-                break;
-        }
+    int num_objs = obj_enable ? ls->line_num_objs[y] : 0;
+    u8 *objs = ls->line_objs[y];
 
+    /* Color index (before palette) of the BG/window, for OBJ-to-BG prio. */
+    u8 *bg_colidx = ls->bg_colidx;
 
     /* Draw all background pixels of this line. */
     if (bg_enable) {
-        for (int x = 0; x < GB_LCD_WIDTH; x++) {
+        for (int x = x0; x < x1; x++) {
             int bg_x = (x + bg_scroll_x) % 256,
                 bg_y = (y + bg_scroll_y) % 256;
             int bg_tile_x = bg_x / 8,
@@ -215,23 +486,21 @@ static void lcd_render_current_line(struct gb_state *gb_state) {
             u8 colidx = ((b1 >> shift) & 1) |
                     (((b2 >> shift) & 1) << 1);
 
-            u16 col = 0;
-            if (use_col) {
-                u8 palidx = attr & 7;
-                col = palette_get_col(gb_state->io_lcd_BGPD, palidx, colidx);
-            } else
-                col = palette_get_gray(bgwin_palette, colidx);
-            pixbuf[x + y * GB_LCD_WIDTH] = col;
+            u8 palidx = attr & 7;
+            pixbuf[x + y * GB_LCD_WIDTH] = ls->bg_colors[palidx * 4 + colidx];
+            bg_colidx[x] = colidx;
         }
     } else {
         /* Background disabled - set all pixels to 0 */
-        for (int x = 0; x < GB_LCD_WIDTH; x++)
-            pixbuf[x + y * GB_LCD_WIDTH] = 0;
+        for (int x = x0; x < x1; x++) {
+            pixbuf[x + y * GB_LCD_WIDTH] = ls->blank_color;
+            bg_colidx[x] = 0;
+        }
     }
 
     /* Draw the window for this line. */
     if (win_enable) {
-        for (int x = 0; x < GB_LCD_WIDTH; x++) {
+        for (int x = x0; x < x1; x++) {
             int win_x = x - win_pos_x + 7,
                 win_y = y - win_pos_y;
             int tile_x = win_x / 8,
@@ -259,53 +528,51 @@ static void lcd_render_current_line(struct gb_state *gb_state) {
             u8 colidx = ((b1 >> shift) & 1) |
                        (((b2 >> shift) & 1) << 1);
 
-            u16 col = 0;
-            if (use_col)
-                col = palette_get_col(gb_state->io_lcd_BGPD, 0, colidx);
-            else
-                col = palette_get_gray(bgwin_palette, colidx);
-            pixbuf[x + y * GB_LCD_WIDTH] = col;
+            pixbuf[x + y * GB_LCD_WIDTH] = ls->bg_colors[colidx];
+            bg_colidx[x] = colidx;
         }
     }
 
-    /* Draw any sprites (objects) on this line. */
-    for (int x = 0; x < GB_LCD_WIDTH; x++) {
-        for (int i = 0; i < num_objs; i++) {
-            int obj_tileoff_x = x - (objs[i].x - 8),
-                obj_tileoff_y = y - (objs[i].y - 16);
-
-            if (obj_tileoff_x < 0 || obj_tileoff_x >= 8)
+    /* Draw any sprites (objects) on this line. The first opaque pixel of the
+     * highest priority object wins, even if it is then hidden behind the BG. */
+    u8 *obj_drawn = ls->obj_drawn;
+    if (x0 == 0)
+        memset(obj_drawn, 0, sizeof(ls->obj_drawn));
+    for (int i = 0; i < num_objs; i++) {
+        struct OAMentry *obj = &OAM[objs[i]];
+        int obj_x = obj->x - 8;
+        if (obj_x + 8 <= x0 || obj_x >= x1)
+            continue;
+        int obj_tileoff_y = y - (obj->y - 16);
+
+        if (obj->flags & (1<<6)) /* Flip y */
+            obj_tileoff_y = obj_tile_height - 1 - obj_tileoff_y;
+
+        u8 tile = obj_8x16 ? obj->tile & 0xfe : obj->tile;
+        int tiledata_off = tile * 16 + obj_tileoff_y * 2;
+        if (use_col && obj->flags & (1<<3))
+            tiledata_off += VRAM_BANKSIZE;
+        u8 b1 = obj_tiledata[tiledata_off];
+        u8 b2 = obj_tiledata[tiledata_off + 1];
+        u8 palidx = use_col ? obj->flags & 7 : (obj->flags >> 4) & 1;
+
+        for (int px = 0; px < 8; px++) {
+            int x = obj_x + px;
+            if (x < x0 || x >= x1 || obj_drawn[x])
                 continue;
 
-            if (objs[i].flags & (1<<5)) /* Flip x */
-                obj_tileoff_x = 7 - obj_tileoff_x;
-            if (objs[i].flags & (1<<6)) /* Flip y */
-                obj_tileoff_y = obj_tile_height - 1 - obj_tileoff_y;
-
-            int obj_tileoff = obj_tileoff_x + obj_tileoff_y * 8;
-            int shift = 7 - obj_tileoff % 8;
-            int tiledata_off = objs[i].tile * 16 + obj_tileoff/8*2;
-            if (use_col && objs[i].flags & (1<<3))
-                tiledata_off += VRAM_BANKSIZE;
-            u8 b1 = obj_tiledata[tiledata_off];
-            u8 b2 = obj_tiledata[tiledata_off + 1];
+            int shift = (obj->flags & (1<<5)) ? px : 7 - px; /* Flip x */
             u8 colidx = ((b1 >> shift) & 1) |
                        (((b2 >> shift) & 1) << 1);
+            if (colidx == 0) /* Transparent */
+                continue;
 
-            if (colidx != 0) {
-                if (objs[i].flags & (1<<7)) /* OBJ-to-BG prio */
-                    if (pixbuf[x + y * GB_LCD_WIDTH] > 0)
-                        continue;
-                u16 col = 0;
-                if (use_col) {
-                    u8 palidx = objs[i].flags & 7;
-                    col = palette_get_col(gb_state->io_lcd_OBPD, palidx, colidx);
-                } else {
-                    u8 pal = objs[i].flags & (1<<4) ? obj_palette2 : obj_palette1;
-                    col = palette_get_gray(pal, colidx);
-                }
-                pixbuf[x + y * GB_LCD_WIDTH] = col;
-            }
+            obj_drawn[x] = 1;
+            if (obj->flags & (1<<7)) /* OBJ-to-BG prio */
+                if (bg_colidx[x] != 0)
+                    continue;
+
+            pixbuf[x + y * GB_LCD_WIDTH] = ls->obj_colors[palidx * 4 + colidx];
         }
     }
 }
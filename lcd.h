@@ -3,7 +3,31 @@
 
 #include "types.h"
 
+/* Converts 8-bit RGB components to the format stored in lcd_pixbuf. */
+typedef u16 (*lcd_pixfmt_fn)(u8 r, u8 g, u8 b);
+
+size_t lcd_arena_size(void);
 int lcd_init(struct gb_state *s);
 void lcd_step(struct gb_state *s);
+void lcd_catch_up(struct gb_state *s);
+void lcd_set_pixfmt(struct gb_state *s, lcd_pixfmt_fn to_pixfmt);
+void lcd_update_palettes(struct gb_state *s);
+void lcd_update_cgb_color(struct gb_state *s, int obj, u8 idx);
+
+/* Part of the screen that changed between two frames, in pixels. */
+struct lcd_rect {
+    int x, y, w, h;
+};
+
+/*
+ * Hashes and changes of the last complete frame in lcd_pixbuf, updated at the
+ * start of every VBlank (so when emu_step_frame returns). The hashes identify
+ * screen contents in tests without comparing pixels, the damage lets frontends
+ * skip redrawing unchanged parts.
+ */
+u64 lcd_frame_hash(struct gb_state *s);
+u64 lcd_line_hash(struct gb_state *s, int y);
+int lcd_line_changed(struct gb_state *s, int y);
+int lcd_frame_damage(struct gb_state *s, struct lcd_rect *rect);
 
 #endif
@@ -16,6 +16,7 @@
 #include "hwdefs.h"
 #include "types.h"
 #include "emu.h"
+#include "lcd.h"
 
 struct gb_state gb_state;
 struct player_input input;
@@ -63,19 +64,10 @@ void retro_set_input_state(retro_input_state_t cb) {
     input_state_cb = cb;
 }
 
-typedef uint16_t pixel_t;
-static pixel_t *framebuf;
-static size_t framebuf_size;
-
 /* Library global initialization/deinitialization. */
 void retro_init(void) {
-    framebuf_size = GB_LCD_WIDTH * GB_LCD_HEIGHT * sizeof(pixel_t);
-    framebuf = malloc(framebuf_size);
-    memset(framebuf, 0, framebuf_size);
 }
 void retro_deinit(void) {
-    free(framebuf);
-    framebuf = NULL;
 }
 
 /* Must return RETRO_API_VERSION. Used to validate ABI compatibility when the
@@ -137,30 +129,15 @@ void update_inputs(void) {
     emu_process_inputs(&gb_state, &input);
 }
 
+/* Converts colors to 0RGB1555 while the palettes are updated, so the pixel
+ * buffer can be passed to the frontend as is. */
+static u16 pixfmt_0rgb1555(u8 r, u8 g, u8 b) {
+    return ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+}
+
 void render_frame(void) {
-    if (gb_state.gb_type == GB_TYPE_CGB) {
-        /* The gameboy uses a BGR555 format, so swap around colors. */
-        for (int y = 0; y < GB_LCD_HEIGHT; y++)
-            for (int x = 0; x < GB_LCD_WIDTH; x++) {
-                int idx = x + y * GB_LCD_WIDTH;
-                uint16_t rawcol = gb_state.emu_state->lcd_pixbuf[idx];
-                uint32_t r = ((rawcol >>  0) & 0x1f) << 0;
-                uint32_t g = ((rawcol >>  5) & 0x1f) << 0;
-                uint32_t b = ((rawcol >> 10) & 0x1f) << 0;
-                uint16_t col = (r << 10) | (g << 5) | (b << 0);
-                framebuf[idx] = col;
-            }
-    } else {
-        /* The colors stored in pixbuf already went through the palette
-         * translation, but are still 2 bit monochrome. */
-        uint32_t palette[] = { 0x6318, 0x4a52, 0x318c, 0x18c6 };
-        for (int y = 0; y < GB_LCD_HEIGHT; y++)
-            for (int x = 0; x < GB_LCD_WIDTH; x++) {
-                int idx = x + y * GB_LCD_WIDTH;
-                framebuf[idx] = palette[gb_state.emu_state->lcd_pixbuf[idx]];
-            }
-    }
-    video_cb(framebuf, GB_LCD_WIDTH, GB_LCD_HEIGHT, GB_LCD_WIDTH * sizeof(pixel_t));
+    video_cb(gb_state.emu_state->lcd_pixbuf, GB_LCD_WIDTH, GB_LCD_HEIGHT,
+            GB_LCD_WIDTH * sizeof(u16));
 }
 
 /* Runs the game for one video frame. */
@@ -206,6 +183,7 @@ bool retro_load_game(const struct retro_game_info *info) {
         fprintf(stderr, "Initialization failed\n");
         return false;
     }
+    lcd_set_pixfmt(&gb_state, pixfmt_0rgb1555);
 
     return true;
 }
@@ -220,6 +198,7 @@ bool retro_load_game_special(unsigned game_type,
 /* Unloads a currently loaded game. */
 void retro_unload_game(void) {
     /* TODO: save extram */
+    emu_free(&gb_state);
 }
 
 /* Gets region (i.e., country) of game. */
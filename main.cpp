@@ -1,12 +1,16 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <cstdio>
 #include <cassert>
 #include <cstring>
 #include <filesystem>
 #include <getopt.h>
+#include <mutex>
 #include <string>
 #include <sys/time.h>
+#include <thread>
 #include <vector>
 
 extern "C" {
@@ -22,6 +26,8 @@ extern "C" {
 #include "debugger.h"
 #include "gui.h"
 #include "fileio.h"
+#include "tribuf.h"
+#include "pacer.h"
 }
 
 #include "pax/fb.h"
@@ -38,6 +44,8 @@ extern "C" {
 #define GUI_ZOOM      4
 
 #define AUDIO_ENABLE  1
+#define BLOCKCACHE_ENABLE 1
+#define RUNAHEAD_FRAMES 1
 
 PAXFramebuffer fb;
 PAXKeypad kp;
@@ -73,59 +81,162 @@ int gui_lcd_init(int width, int height, int zoom, const char *wintitle) {
 }
 
 
-void gui_lcd_render_frame(char use_colors, uint16_t *pixbuf) {
-    if (use_colors) {
-        /* The colors stored in pixbuf are two byte each, 5 bits per rgb
-         * component: -bbbbbgg gggrrrrr. We need to extract these, scale these
-         * values from 0-1f to 0-ff and put them in RGBA format. For the scaling
-         * we'd have to multiply by 0xff/0x1f, which is 8.23, approx 8, which is
-         * a shift by 3. */
-        for (int y_scr = 0; y_scr < 216; y_scr++) {
-            for (int x_scr = 0;x_scr < 240;x_scr++) {
-                int y = y_scr * 144 / 216;
-                int x = x_scr * 160 / 240;
-                int idx = x + y * GB_LCD_WIDTH;
-                uint16_t rawcol = pixbuf[idx];
-                uint32_t r = ((rawcol >>  0) & 0x1f) << 3;
-                uint32_t g = ((rawcol >>  5) & 0x1f) << 3;
-                uint32_t b = ((rawcol >> 10) & 0x1f) << 3;
-                fb.pixel(x_scr, 268 - y_scr) = rgb16(r, g, b);
-            }
+uint16_t gui_lcd_color(uint8_t r, uint8_t g, uint8_t b) {
+    return rgb16(r, g, b);
+}
+
+void gui_lcd_render_frame(char use_colors, uint16_t *pixbuf,
+        const uint8_t *lines_changed) {
+    /* Colors in pixbuf are already in the framebuffer format, just scale. The
+     * framebuffer isn't double buffered, so lines that didn't change since the
+     * last frame are still on screen and can be skipped. */
+    int y_off = use_colors ? 268 : 268 + 52;
+    for (int y_scr = 0; y_scr < 216; y_scr++) {
+        int y = y_scr * 144 / 216;
+        if (lines_changed && !lines_changed[y])
+            continue;
+        uint16_t *line = &pixbuf[y * GB_LCD_WIDTH];
+        for (int x_scr = 0;x_scr < 240;x_scr++)
+            fb.pixel(x_scr, y_off - y_scr) = line[x_scr * 160 / 240];
+    }
+}
+
+/* A frame handed from the emulation to the presentation thread. */
+struct pax_frame {
+    char use_colors;
+    uint64_t input_ns; /* When the input this frame reflects was polled */
+    uint64_t line_hash[GB_LCD_HEIGHT];
+    uint16_t pixels[GB_LCD_WIDTH * GB_LCD_HEIGHT];
+};
+
+/* Presentation thread: draws the newest frame, but only the lines that differ
+ * from the frame drawn before it (frames may have been skipped in between). */
+static void pax_present(struct tribuf *frames, struct pacer *pacer) {
+    uint64_t drawn_hash[GB_LCD_HEIGHT];
+    uint8_t lines_changed[GB_LCD_HEIGHT];
+    int full_redraw = 1; /* The ROM menu is still on screen. */
+    struct pax_frame *frame;
+
+    while ((frame = (struct pax_frame *)tribuf_wait(frames))) {
+        for (int y = 0; y < GB_LCD_HEIGHT; y++) {
+            lines_changed[y] = frame->line_hash[y] != drawn_hash[y];
+            drawn_hash[y] = frame->line_hash[y];
+        }
+        gui_lcd_render_frame(frame->use_colors, frame->pixels,
+                full_redraw ? NULL : lines_changed);
+        full_redraw = 0;
+        pacer_presented(pacer, frame->input_ns);
+    }
+}
+
+/*
+ * The keypad is read on its own thread. The driver only reports presses
+ * (repeated while a key is held), so a button counts as held until it hasn't
+ * been reported for PAX_KEY_HOLD_NS. This allows holding several buttons at
+ * once. The emulation thread reads the state without locking.
+ */
+#define PAX_KEY_HOLD_NS 150000000ull
+
+enum pax_button {
+    PAX_BTN_LEFT, PAX_BTN_RIGHT, PAX_BTN_UP, PAX_BTN_DOWN,
+    PAX_BTN_A, PAX_BTN_B, PAX_BTN_START, PAX_BTN_SELECT,
+    PAX_NUM_BUTTONS
+};
+
+#define PAX_SPECIAL_QUIT  (1 << 0)
+#define PAX_SPECIAL_TURBO (1 << 1)
+
+#define PAX_MAX_PRESSES 16
+
+struct pax_press {
+    uint64_t ns;
+    int btn;
+};
+
+static std::atomic<uint64_t> pax_button_seen[PAX_NUM_BUTTONS]; /* ns */
+static std::atomic<uint32_t> pax_specials; /* Presses not yet polled */
+
+/* New presses (not repeats) since they were last taken, in order. */
+static std::mutex pax_presses_lock;
+static struct pax_press pax_presses[PAX_MAX_PRESSES];
+static int pax_num_presses;
+
+static void pax_input_thread() {
+    uint64_t turbo_seen = 0;
+
+    for (;;) {
+        KeyCode key = kp.getKey();
+        uint64_t now = pacer_now_ns();
+        int btn = -1;
+
+        switch (key) {
+        case KEY_ALPHA: btn = PAX_BTN_START; break;
+        case KEY_FUNC: btn = PAX_BTN_SELECT; break;
+        case KEY_9: btn = PAX_BTN_B; break;
+        case KEY_3: btn = PAX_BTN_A; break;
+        case KEY_8: btn = PAX_BTN_DOWN; break;
+        case KEY_2: btn = PAX_BTN_UP; break;
+        case KEY_4: btn = PAX_BTN_LEFT; break;
+        case KEY_6: btn = PAX_BTN_RIGHT; break;
+        case KEY_0: /* Toggle once per press, not on every repeat */
+            if (now - turbo_seen > PAX_KEY_HOLD_NS)
+                pax_specials.fetch_or(PAX_SPECIAL_TURBO);
+            turbo_seen = now;
+            break;
+        case KEY_ESC: /* The emulation stops, leave the keypad to the menu. */
+            pax_specials.fetch_or(PAX_SPECIAL_QUIT);
+            return;
+        default: /* No key, don't spin if the read doesn't block */
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            break;
         }
-    } else {
-        /* The colors stored in pixbuf already went through the palette
-         * translation, but are still 2 bit monochrome. */
-        uint32_t palette[] = { 0xffffffff, 0xaaaaaaaa, 0x66666666, 0x11111111 };
-        for (int y_scr = 0; y_scr < 216; y_scr++) {
-            for (int x_scr = 0;x_scr < 240;x_scr++) {
-                int y = y_scr * 144 / 216;
-                int x = x_scr * 160 / 240;
-                int idx = x + y * GB_LCD_WIDTH;
-                fb.pixel(x_scr, 268 - y_scr + 52) = palette[pixbuf[idx]];
+
+        if (btn >= 0) {
+            uint64_t seen = pax_button_seen[btn].exchange(now,
+                    std::memory_order_relaxed);
+            if (now - seen > PAX_KEY_HOLD_NS) {
+                /* If full the oldest are long past, the poll sees them held. */
+                std::lock_guard<std::mutex> lock(pax_presses_lock);
+                if (pax_num_presses < PAX_MAX_PRESSES)
+                    pax_presses[pax_num_presses++] = { now, btn };
             }
         }
     }
 }
 
+static int pax_take_presses(struct pax_press *presses) {
+    std::lock_guard<std::mutex> lock(pax_presses_lock);
+    int n = pax_num_presses;
+    std::copy(pax_presses, pax_presses + n, presses);
+    pax_num_presses = 0;
+    return n;
+}
+
+static void pax_set_button(struct player_input *input, int btn, bool held) {
+    switch (btn) {
+    case PAX_BTN_LEFT: input->button_left = held; break;
+    case PAX_BTN_RIGHT: input->button_right = held; break;
+    case PAX_BTN_UP: input->button_up = held; break;
+    case PAX_BTN_DOWN: input->button_down = held; break;
+    case PAX_BTN_A: input->button_a = held; break;
+    case PAX_BTN_B: input->button_b = held; break;
+    case PAX_BTN_START: input->button_start = held; break;
+    case PAX_BTN_SELECT: input->button_select = held; break;
+    }
+}
+
 int gui_input_poll(struct player_input *input) {
-    input->special_quit = 0;
+    uint64_t now = pacer_now_ns();
+    uint32_t specials = pax_specials.exchange(0);
+    for (int btn = 0; btn < PAX_NUM_BUTTONS; btn++)
+        pax_set_button(input, btn, now -
+                pax_button_seen[btn].load(std::memory_order_relaxed) <
+                PAX_KEY_HOLD_NS);
+
+    input->special_quit = specials & PAX_SPECIAL_QUIT;
     input->special_savestate = 0;
     input->special_dbgbreak = 0;
-
-    //memset(input, 0, sizeof(struct player_input));
-    KeyCode key = kp.getKey();
-    switch (key) {
-    case KEY_ALPHA: input->button_start = 1; break;
-    case KEY_FUNC: input->button_select = 1; break;
-    case KEY_9: input->button_b = 1; break;
-    case KEY_3: input->button_a = 1; break;
-    case KEY_8: input->button_down = 1; break;
-    case KEY_2: input->button_up = 1; break;
-    case KEY_4: input->button_left = 1; break;
-    case KEY_6: input->button_right = 1; break;
-    case KEY_ESC: input->special_quit = 1; break;
-    default: break;
-    }
+    input->special_turbo = specials & PAX_SPECIAL_TURBO;
     return 0;
 }
 
@@ -142,6 +253,8 @@ int app_start(std::string rom_path) {
         .print_disas = 0,
         .print_mmu = 0,
         .audio_enable = AUDIO_ENABLE,
+        .blockcache_enable = BLOCKCACHE_ENABLE,
+        .runahead_frames = RUNAHEAD_FRAMES,
     };
 
     emu_args.rom_filename = (char*)rom_path.c_str();
@@ -150,6 +263,7 @@ int app_start(std::string rom_path) {
         fprintf(stderr, "Initialization failed\n");
         return 1;
     }
+    lcd_set_pixfmt(&gb_state, gui_lcd_color);
 
     /* Initialize frontend-specific GUI */
     if (gui_lcd_init(GB_LCD_WIDTH, GB_LCD_HEIGHT, GUI_ZOOM, GUI_WINDOW_TITLE)) {
@@ -171,28 +285,93 @@ int app_start(std::string rom_path) {
     struct timeval starttime, endtime;
     gettimeofday(&starttime, NULL);
 
+    /* Scaling and writing to the framebuffer overlaps with emulating the next
+     * frame on another core. */
+    struct tribuf *frames = tribuf_new(sizeof(struct pax_frame));
+    if (!frames) {
+        fprintf(stderr, "Couldn't allocate frame buffers\n");
+        return 1;
+    }
 
-    while (!gb_state.emu_state->quit) {
-        emu_step_frame(&gb_state);
+    /* With audio, the blocking playSound paces the emulation. */
+    struct pacer *pacer = pacer_new(
+            emu_args.audio_enable ? PACER_AUDIO : PACER_CLOCK,
+            GB_LCD_FRAME_CLKS / (double)GB_FREQ);
+    if (!pacer) {
+        fprintf(stderr, "Couldn't allocate frame pacer\n");
+        return 1;
+    }
+
+    std::thread presenter(pax_present, frames, pacer);
 
+    for (int i = 0; i < PAX_NUM_BUTTONS; i++)
+        pax_button_seen[i] = 0;
+    pax_specials = 0;
+    pax_num_presses = 0;
+    std::thread input_thread(pax_input_thread);
+    const uint64_t frame_ns = GB_LCD_FRAME_CLKS * 1000000000ull / GB_FREQ;
+
+    while (!gb_state.emu_state->quit) {
+        /* Input is polled right before emulating the frame it affects, which
+         * starts now. Whatever happened before is applied at its start, later
+         * would only add latency. Presses that came in since (while polling)
+         * are queued each at its own point in the frame. */
         struct player_input input_state;
+        struct pax_press presses[PAX_MAX_PRESSES];
+        uint64_t input_ns = pacer_now_ns();
         memset(&input_state, 0, sizeof(struct player_input));
         gui_input_poll(&input_state);
+        int num_presses = pax_take_presses(presses);
+        for (int i = 0; i < num_presses; i++)
+            if (presses[i].ns > input_ns)
+                pax_set_button(&input_state, presses[i].btn, 0);
         emu_process_inputs(&gb_state, &input_state);
 
-        gui_lcd_render_frame(gb_state.gb_type == GB_TYPE_CGB,
-                gb_state.emu_state->lcd_pixbuf);
+        input_state.special_quit = input_state.special_turbo = 0;
+        for (int i = 0; i < num_presses; i++) {
+            if (presses[i].ns <= input_ns)
+                continue;
+            uint64_t offset = std::min(presses[i].ns - input_ns, frame_ns) *
+                GB_LCD_FRAME_CLKS / frame_ns;
+            pax_set_button(&input_state, presses[i].btn, 1);
+            emu_queue_input(&gb_state, &input_state,
+                    gb_state.time_cycles + offset);
+        }
+
+        emu_step_frame(&gb_state);
+
+        struct pax_frame *frame = (struct pax_frame *)tribuf_back(frames);
+        frame->use_colors = gb_state.gb_type == GB_TYPE_CGB;
+        frame->input_ns = input_ns;
+        for (int y = 0; y < GB_LCD_HEIGHT; y++)
+            frame->line_hash[y] = lcd_line_hash(&gb_state, y);
+        memcpy(frame->pixels, gb_state.emu_state->lcd_pixbuf,
+                sizeof(frame->pixels));
+        tribuf_publish(frames);
 
-        if (gb_state.emu_state->audio_enable) /* TODO */
+        /* Turbo runs unpaced and muted (playSound would block). */
+        int turbo = gb_state.emu_state->turbo_frames > 1;
+        pacer_set_fast_forward(pacer, turbo);
+
+        if (!turbo && gb_state.emu_state->audio_enable) /* TODO */
             audio_update(&gb_state);
 #if AUDIO_ENABLE == 1
-        for(int i = 0;i < AUDIO_SNDBUF_SIZE * AUDIO_CHANNELS;i++) {
-            audio_outbuf[i] = audio_sndbuf[i] * 16;
+        if (!turbo) {
+            for(int i = 0;i < AUDIO_SNDBUF_SIZE * AUDIO_CHANNELS;i++) {
+                audio_outbuf[i] = audio_sndbuf[i] * 16;
+            }
+            snd.playSound(audio_outbuf, sizeof(int16_t) * AUDIO_SNDBUF_SIZE * AUDIO_CHANNELS);
         }
-        snd.playSound(audio_outbuf, sizeof(int16_t) * AUDIO_SNDBUF_SIZE * AUDIO_CHANNELS);
 #endif
+
+        pacer_wait(pacer);
     }
 
+    input_thread.join(); /* Already done after reading quit */
+    tribuf_close(frames);
+    presenter.join();
+    tribuf_free(frames);
+
     if (gb_state.emu_state->extram_dirty)
         emu_save(&gb_state, 1, gb_state.emu_state->save_filename_out);
 
@@ -206,11 +385,13 @@ int app_start(std::string rom_path) {
     int t_sec = endtime.tv_sec - starttime.tv_sec;
     double exectime = t_sec + (t_usec / 1000000.);
 
-    double emulated_secs = gb_state.emu_state->time_seconds +
-        gb_state.emu_state->time_cycles / 4194304.;
+    double emulated_secs = gb_state.time_cycles / (double)GB_FREQ;
 
     printf("\nEmulated %f sec in %f sec WCT, %.0f%%.\n", emulated_secs, exectime,
             emulated_secs / exectime * 100);
+    pacer_print_stats(pacer);
+    pacer_free(pacer);
+    emu_free(&gb_state);
 
     return 0;
 }
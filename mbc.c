@@ -0,0 +1,700 @@
+/*
+ * Memory bank controllers (mappers) of the cartridges.
+ *
+ * Every MBC handles writes to its registers by updating its bank registers and
+ * then mapping the selected ROM and RAM banks into the memory map (in 4K
+ * pages). Reads of ROM and RAM thus never go through here: only accesses to
+ * A000-BFFF which are not plain RAM (disabled RAM, RTC, sensors, ...) do.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mbc.h"
+#include "rtc.h"
+#include "hwdefs.h"
+
+#define MBC_PAGE_SIZE 0x1000
+
+static void mbc_map_pages(struct gb_state *s, int page, int num, u8 *base) {
+    for (int i = 0; i < num; i++)
+        s->mem_map_read[page + i] = base ? base + i * MBC_PAGE_SIZE : NULL;
+}
+
+/* Maps 16K ROM banks at 0000-3FFF and 4000-7FFF. Banks beyond the ROM size
+ * wrap, like on hardware where the upper bank lines aren't connected. */
+static void mbc_map_rom(struct gb_state *s, int bank0, int bank1) {
+    bank0 %= s->mem_num_banks_rom;
+    bank1 %= s->mem_num_banks_rom;
+    mbc_map_pages(s, 0x0, 4, &s->mem_ROM[bank0 * ROM_BANKSIZE]);
+    mbc_map_pages(s, 0x4, 4, &s->mem_ROM[bank1 * ROM_BANKSIZE]);
+}
+
+/* Maps an 8K RAM bank at A000-BFFF, if there is RAM and it's enabled. */
+static void mbc_map_ram(struct gb_state *s, int bank) {
+    u8 *base = NULL;
+    if (s->mem_extram_enabled && s->mem_num_banks_extram) {
+        bank %= s->mem_num_banks_extram;
+        base = &s->mem_EXTRAM[bank * EXTRAM_BANKSIZE];
+    }
+    mbc_map_pages(s, 0xa, 2, base);
+}
+
+static void mbc_ram_enable(struct gb_state *s, u8 value) {
+    s->mem_extram_enabled = (value & 0xf) == 0xa;
+
+    /* Turning off the RAM could indicate that battery-backed data is done
+     * being written and could be flushed to disk. */
+    if (!s->mem_extram_enabled)
+        s->emu_state->flush_extram = 1;
+}
+
+static u8 mbc_ram_read_unmapped(struct gb_state *s, u16 location) {
+    (void)s, (void)location;
+    return 0xff;
+}
+
+static void mbc_ram_write_mapped(struct gb_state *s, u16 location, u8 value) {
+    u8 *page = s->mem_map_read[location >> 12];
+    if (!page)
+        return;
+    page[location & (MBC_PAGE_SIZE - 1)] = value;
+    s->emu_state->extram_dirty = 1;
+}
+
+
+/*
+ * No MBC: 32K ROM, optionally 8K RAM.
+ */
+static void mbc_none_map(struct gb_state *s) {
+    mbc_map_rom(s, 0, 1);
+    mbc_map_ram(s, 0);
+}
+
+static void mbc_none_write(struct gb_state *s, u16 location, u8 value) {
+    (void)s, (void)location, (void)value;
+}
+
+
+/*
+ * MBC1: up to 2M ROM, 32K RAM. A 2-bit register holds either the upper bits of
+ * the ROM bank (mode 0), or the RAM bank and upper bits of the ROM bank mapped
+ * at 0000 (mode 1).
+ */
+static void mbc1_map(struct gb_state *s) {
+    int upper = s->mem_mbc1_rombankupper;
+    int mode = s->mem_mbc1_romram_select;
+    mbc_map_rom(s, mode ? upper << 5 : 0, (upper << 5) | s->mem_bank_rom);
+    mbc_map_ram(s, mode ? upper : 0);
+}
+
+static void mbc1_write(struct gb_state *s, u16 location, u8 value) {
+    switch (location >> 13) {
+    case 0: /* 0000 - 1FFF */
+        mbc_ram_enable(s, value);
+        break;
+    case 1: /* 2000 - 3FFF */
+        value &= 0x1f;
+        s->mem_bank_rom = value ? value : 1;
+        break;
+    case 2: /* 4000 - 5FFF */
+        s->mem_mbc1_rombankupper = value & 3;
+        break;
+    case 3: /* 6000 - 7FFF */
+        s->mem_mbc1_romram_select = value & 1;
+        break;
+    }
+    mbc1_map(s);
+}
+
+
+/*
+ * MBC2: up to 256K ROM, with 512x4 bits of RAM built in. Address bit 8 selects
+ * between the RAM enable and ROM bank register.
+ */
+static void mbc2_map(struct gb_state *s) {
+    mbc_map_rom(s, 0, s->mem_bank_rom);
+    mbc_map_pages(s, 0xa, 2, NULL);
+}
+
+static void mbc2_write(struct gb_state *s, u16 location, u8 value) {
+    if (location >= 0x4000)
+        return;
+    if (location & 0x100) {
+        value &= 0xf;
+        s->mem_bank_rom = value ? value : 1;
+    } else
+        mbc_ram_enable(s, value);
+    mbc2_map(s);
+}
+
+/* The 512 nibbles repeat over the whole area, upper bits are open bus. */
+static u8 mbc2_ram_read(struct gb_state *s, u16 location) {
+    if (!s->mem_extram_enabled)
+        return 0xff;
+    return s->mem_EXTRAM[location & 0x1ff] | 0xf0;
+}
+
+static void mbc2_ram_write(struct gb_state *s, u16 location, u8 value) {
+    if (!s->mem_extram_enabled)
+        return;
+    s->mem_EXTRAM[location & 0x1ff] = value & 0xf;
+    s->emu_state->extram_dirty = 1;
+}
+
+
+/*
+ * MBC3: up to 2M ROM, 32K RAM (64K on MBC30), optional RTC whose registers are
+ * selected in place of a RAM bank.
+ */
+static void mbc3_map(struct gb_state *s) {
+    mbc_map_rom(s, 0, s->mem_bank_rom);
+    if (s->mem_bank_extram < 0x08)
+        mbc_map_ram(s, s->mem_bank_extram);
+    else
+        mbc_map_pages(s, 0xa, 2, NULL);
+}
+
+static void mbc3_write(struct gb_state *s, u16 location, u8 value) {
+    switch (location >> 13) {
+    case 0: /* 0000 - 1FFF */
+        mbc_ram_enable(s, value);
+        break;
+    case 1: /* 2000 - 3FFF */
+        value &= 0x7f;
+        s->mem_bank_rom = value ? value : 1;
+        break;
+    case 2: /* 4000 - 5FFF: RAM bank (00-07) or RTC register (08-0C) */
+        s->mem_bank_extram = value & 0xf;
+        break;
+    case 3: /* 6000 - 7FFF */
+        /* Pokemon Red writes here because it's coded for MBC1, so don't
+         * complain if there is no RTC. */
+        if (s->has_rtc) {
+            if (s->mem_latch_rtc == 0x00 && value == 0x01)
+                rtc_latch(s);
+            s->mem_latch_rtc = value;
+        }
+        break;
+    }
+    mbc3_map(s);
+}
+
+static int mbc3_rtc_selected(struct gb_state *s) {
+    return s->has_rtc && s->mem_extram_enabled &&
+        s->mem_bank_extram >= 0x08 && s->mem_bank_extram <= 0x0c;
+}
+
+static u8 mbc3_ram_read(struct gb_state *s, u16 location) {
+    (void)location;
+    if (mbc3_rtc_selected(s))
+        return rtc_read(s, s->mem_bank_extram);
+    return 0xff;
+}
+
+static void mbc3_ram_write(struct gb_state *s, u16 location, u8 value) {
+    if (mbc3_rtc_selected(s))
+        rtc_write(s, s->mem_bank_extram, value);
+    else
+        mbc_ram_write_mapped(s, location, value);
+}
+
+
+/*
+ * MBC5: up to 8M ROM (9-bit bank, bank 0 can be mapped at 4000), 128K RAM. On
+ * rumble carts bit 3 of the RAM bank drives the motor.
+ */
+static void mbc5_map(struct gb_state *s) {
+    mbc_map_rom(s, 0, s->mem_bank_rom);
+    mbc_map_ram(s, s->mem_bank_extram);
+}
+
+static void mbc5_write(struct gb_state *s, u16 location, u8 value) {
+    switch (location >> 12) {
+    case 0x0: case 0x1:
+        mbc_ram_enable(s, value);
+        break;
+    case 0x2: /* Lower 8 bits ROM bank */
+        s->mem_bank_rom = (s->mem_bank_rom & (1<<8)) | value;
+        break;
+    case 0x3: /* Upper bit ROM bank */
+        s->mem_bank_rom = (s->mem_bank_rom & 0xff) | ((value & 1) << 8);
+        break;
+    case 0x4: case 0x5:
+        s->mem_bank_extram = value & (s->has_rumble ? 0x7 : 0xf);
+        break;
+    }
+    mbc5_map(s);
+}
+
+
+/*
+ * MBC6: two independently switched 8K ROM windows (4000, 6000) and two 4K RAM
+ * windows (A000, B000). The flash chip is not emulated, its banks read as ROM.
+ */
+static void mbc6_map(struct gb_state *s) {
+    int rom_banks = s->mem_num_banks_rom * 2;
+    u8 *ram_a = NULL, *ram_b = NULL;
+
+    mbc_map_pages(s, 0x0, 4, s->mem_ROM);
+    mbc_map_pages(s, 0x4, 2,
+            &s->mem_ROM[(s->mem_bank_rom % rom_banks) * 0x2000]);
+    mbc_map_pages(s, 0x6, 2,
+            &s->mem_ROM[(s->mem_bank_rom2 % rom_banks) * 0x2000]);
+
+    if (s->mem_extram_enabled && s->mem_num_banks_extram) {
+        int ram_banks = s->mem_num_banks_extram * 2;
+        ram_a = &s->mem_EXTRAM[(s->mem_bank_extram % ram_banks) * 0x1000];
+        ram_b = &s->mem_EXTRAM[(s->mem_bank_extram2 % ram_banks) * 0x1000];
+    }
+    mbc_map_pages(s, 0xa, 1, ram_a);
+    mbc_map_pages(s, 0xb, 1, ram_b);
+}
+
+static void mbc6_write(struct gb_state *s, u16 location, u8 value) {
+    if (location < 0x0400)
+        mbc_ram_enable(s, value);
+    else if (location < 0x0800)
+        s->mem_bank_extram = value;
+    else if (location < 0x0c00)
+        s->mem_bank_extram2 = value;
+    else if (location >= 0x2000 && location < 0x2800)
+        s->mem_bank_rom = value;
+    else if (location >= 0x3000 && location < 0x3800)
+        s->mem_bank_rom2 = value;
+    /* Flash enable/write enable/select are ignored. */
+    mbc6_map(s);
+}
+
+
+/*
+ * MBC7: up to 2M ROM, with an accelerometer and a 256 byte serial EEPROM
+ * (93LC56, 16-bit words) behind registers at A000-AFFF. Both RAM enables have
+ * to be set for these to be accessible.
+ */
+#define MBC7_ACCEL_CENTER 0x81d0
+
+enum {
+    MBC7_EEPROM_IDLE,
+    MBC7_EEPROM_COMMAND,
+    MBC7_EEPROM_WRITE,
+    MBC7_EEPROM_WRITE_ALL,
+    MBC7_EEPROM_READ,
+};
+
+static void mbc7_map(struct gb_state *s) {
+    mbc_map_rom(s, 0, s->mem_bank_rom);
+    mbc_map_pages(s, 0xa, 2, NULL);
+}
+
+static void mbc7_write(struct gb_state *s, u16 location, u8 value) {
+    switch (location >> 13) {
+    case 0: /* 0000 - 1FFF */
+        mbc_ram_enable(s, value);
+        break;
+    case 1: /* 2000 - 3FFF */
+        s->mem_bank_rom = value & 0x7f;
+        break;
+    case 2: /* 4000 - 5FFF */
+        s->mem_mbc7.ram_enable2 = value == 0x40;
+        break;
+    }
+    mbc7_map(s);
+}
+
+static u16 mbc7_eeprom_get(struct gb_state *s, u8 addr) {
+    return s->mem_EXTRAM[addr * 2] | (s->mem_EXTRAM[addr * 2 + 1] << 8);
+}
+
+static void mbc7_eeprom_set(struct gb_state *s, u8 addr, u16 value) {
+    if (!s->mem_mbc7.eeprom_write_enable)
+        return;
+    s->mem_EXTRAM[addr * 2] = value & 0xff;
+    s->mem_EXTRAM[addr * 2 + 1] = value >> 8;
+    s->emu_state->extram_dirty = 1;
+}
+
+/* Executes the command in the shift register: 2 bits opcode, 8 bits address. */
+static void mbc7_eeprom_command(struct gb_state *s) {
+    struct mbc7_state *m = &s->mem_mbc7;
+    u8 opcode = (m->eeprom_shift >> 8) & 3;
+    u8 addr = m->eeprom_shift & 0xff;
+
+    m->eeprom_addr = addr & 0x7f;
+    m->eeprom_state = MBC7_EEPROM_IDLE;
+    m->eeprom_shift = 0;
+    m->eeprom_bits = 0;
+
+    switch (opcode) {
+    case 2: /* READ, preceded by a dummy 0 bit */
+        m->eeprom_shift = mbc7_eeprom_get(s, m->eeprom_addr);
+        m->eeprom_state = MBC7_EEPROM_READ;
+        m->eeprom_do = 0;
+        break;
+    case 1: /* WRITE */
+        m->eeprom_state = MBC7_EEPROM_WRITE;
+        break;
+    case 3: /* ERASE */
+        mbc7_eeprom_set(s, m->eeprom_addr, 0xffff);
+        m->eeprom_do = 1;
+        break;
+    case 0:
+        switch (addr >> 6) {
+        case 0: /* EWDS */
+            m->eeprom_write_enable = 0;
+            break;
+        case 1: /* WRAL */
+            m->eeprom_state = MBC7_EEPROM_WRITE_ALL;
+            break;
+        case 2: /* ERAL */
+            for (int i = 0; i < 0x80; i++)
+                mbc7_eeprom_set(s, i, 0xffff);
+            m->eeprom_do = 1;
+            break;
+        case 3: /* EWEN */
+            m->eeprom_write_enable = 1;
+            break;
+        }
+        break;
+    }
+}
+
+/* Pins: CS (bit 7), CLK (bit 6) and DI (bit 1), data is clocked on the rising
+ * edge of CLK. */
+static void mbc7_eeprom_write(struct gb_state *s, u8 value) {
+    struct mbc7_state *m = &s->mem_mbc7;
+    u8 rising = (value & (1<<6)) && !(m->eeprom_pins & (1<<6));
+    u8 di = (value >> 1) & 1;
+    m->eeprom_pins = value;
+
+    if (!(value & (1<<7))) { /* Deselected: abort, and report ready */
+        m->eeprom_state = MBC7_EEPROM_IDLE;
+        m->eeprom_do = 1;
+        return;
+    }
+    if (!rising)
+        return;
+
+    switch (m->eeprom_state) {
+    case MBC7_EEPROM_IDLE: /* Wait for start bit */
+        if (di) {
+            m->eeprom_state = MBC7_EEPROM_COMMAND;
+            m->eeprom_shift = 0;
+            m->eeprom_bits = 0;
+        }
+        break;
+    case MBC7_EEPROM_COMMAND:
+        m->eeprom_shift = (m->eeprom_shift << 1) | di;
+        if (++m->eeprom_bits == 10)
+            mbc7_eeprom_command(s);
+        break;
+    case MBC7_EEPROM_WRITE:
+    case MBC7_EEPROM_WRITE_ALL:
+        m->eeprom_shift = (m->eeprom_shift << 1) | di;
+        if (++m->eeprom_bits == 16) {
+            if (m->eeprom_state == MBC7_EEPROM_WRITE_ALL)
+                for (int i = 0; i < 0x80; i++)
+                    mbc7_eeprom_set(s, i, m->eeprom_shift);
+            else
+                mbc7_eeprom_set(s, m->eeprom_addr, m->eeprom_shift);
+            m->eeprom_state = MBC7_EEPROM_IDLE;
+            m->eeprom_do = 1;
+        }
+        break;
+    case MBC7_EEPROM_READ: /* Continues with the next word */
+        m->eeprom_do = m->eeprom_shift >> 15;
+        m->eeprom_shift <<= 1;
+        if (++m->eeprom_bits == 16) {
+            m->eeprom_addr = (m->eeprom_addr + 1) & 0x7f;
+            m->eeprom_shift = mbc7_eeprom_get(s, m->eeprom_addr);
+            m->eeprom_bits = 0;
+        }
+        break;
+    }
+}
+
+static u8 mbc7_ram_read(struct gb_state *s, u16 location) {
+    struct mbc7_state *m = &s->mem_mbc7;
+    if (!s->mem_extram_enabled || !m->ram_enable2 || location >= 0xb000)
+        return 0xff;
+
+    switch ((location >> 4) & 0xf) {
+    case 0x2: return m->accel_x & 0xff;
+    case 0x3: return m->accel_x >> 8;
+    case 0x4: return m->accel_y & 0xff;
+    case 0x5: return m->accel_y >> 8;
+    case 0x6: return 0x00;
+    case 0x8: return (m->eeprom_pins & 0xc2) | m->eeprom_do;
+    }
+    return 0xff;
+}
+
+static void mbc7_ram_write(struct gb_state *s, u16 location, u8 value) {
+    struct mbc7_state *m = &s->mem_mbc7;
+    if (!s->mem_extram_enabled || !m->ram_enable2 || location >= 0xb000)
+        return;
+
+    switch ((location >> 4) & 0xf) {
+    case 0x0: /* Erase latched values */
+        if (value == 0x55) {
+            m->accel_latched = 0;
+            m->accel_x = m->accel_y = 0x8000;
+        }
+        break;
+    case 0x1: /* Latch, there is no tilt input so always level. */
+        if (value == 0xaa && !m->accel_latched) {
+            m->accel_latched = 1;
+            m->accel_x = m->accel_y = MBC7_ACCEL_CENTER;
+        }
+        break;
+    case 0x8:
+        mbc7_eeprom_write(s, value);
+        break;
+    }
+}
+
+
+/*
+ * MMM01: multi-game cartridges. At startup the menu in the last 32K of ROM is
+ * mapped, which then selects the game by writing the outer bank bits and
+ * setting the map bit, after which only the MBC1-like bank bits of the game can
+ * change. The MBC1 mode and multiplexing of bank bits are not emulated.
+ */
+static void mmm01_map(struct gb_state *s) {
+    u8 *r = s->mem_mmm01_regs;
+
+    if (!(r[0] & (1<<6))) {
+        mbc_map_rom(s, s->mem_num_banks_rom - 2, s->mem_num_banks_rom - 1);
+        mbc_map_ram(s, 0);
+        return;
+    }
+
+    int outer = (((r[2] >> 4) & 3) << 7) | (((r[1] >> 5) & 3) << 5);
+    int rom_mask = ((r[3] >> 2) & 0xf) << 1; /* Low bits fixed by the menu */
+    int low = r[1] & 0x1f;
+    if (!(low & ~rom_mask))
+        low |= 1;
+    mbc_map_rom(s, outer | (r[1] & rom_mask), outer | low);
+    mbc_map_ram(s, (((r[2] >> 2) & 3) << 2) | (r[2] & 3));
+}
+
+static void mmm01_write(struct gb_state *s, u16 location, u8 value) {
+    u8 *r = s->mem_mmm01_regs;
+    int mapped = r[0] & (1<<6);
+    int rom_mask = ((r[3] >> 2) & 0xf) << 1;
+
+    switch (location >> 13) {
+    case 0: /* RAM enable, RAM bank mask, map */
+        mbc_ram_enable(s, value);
+        r[0] = mapped ? (r[0] & 0x70) | (value & 0x0f) : value;
+        break;
+    case 1: /* ROM bank (low), ROM bank (mid) */
+        r[1] = mapped ? (r[1] & (0x60 | rom_mask)) | (value & 0x1f & ~rom_mask)
+                      : value;
+        break;
+    case 2: /* RAM bank (low), RAM bank (high), ROM bank (high) */
+        r[2] = mapped ? (r[2] & 0x3c) | (value & 0x03) : value;
+        break;
+    case 3: /* Mode, ROM bank mask */
+        r[3] = mapped ? (r[3] & 0xfe) | (value & 0x01) : value;
+        break;
+    }
+    mmm01_map(s);
+}
+
+
+/*
+ * HuC1: MBC1-like, but the RAM area can be switched to an infrared
+ * transceiver. There is no IR peer, so no light is ever seen.
+ */
+#define HUC_MODE_IR 0x0e
+
+static void huc1_map(struct gb_state *s) {
+    mbc_map_rom(s, 0, s->mem_bank_rom);
+    mbc_map_ram(s, s->mem_bank_extram);
+}
+
+static void huc1_write(struct gb_state *s, u16 location, u8 value) {
+    switch (location >> 13) {
+    case 0: /* 0000 - 1FFF */
+        s->mem_mbc_mode = value & 0xf;
+        s->mem_extram_enabled = s->mem_mbc_mode != HUC_MODE_IR;
+        if (value == 0)
+            s->emu_state->flush_extram = 1;
+        break;
+    case 1: /* 2000 - 3FFF */
+        value &= 0x3f;
+        s->mem_bank_rom = value ? value : 1;
+        break;
+    case 2: /* 4000 - 5FFF */
+        s->mem_bank_extram = value & 3;
+        break;
+    }
+    huc1_map(s);
+}
+
+static u8 huc_ram_read_ir(struct gb_state *s, u16 location) {
+    (void)location;
+    if (s->mem_mbc_mode == HUC_MODE_IR)
+        return 0xc0; /* No light */
+    return 0xff;
+}
+
+
+/*
+ * HuC3: like HuC1, but with more modes for the A000-BFFF area, including an RTC
+ * accessed through commands. The clock itself is not emulated, commands are
+ * accepted and answered with 0.
+ */
+#define HUC3_MODE_RAM_RO  0x00
+#define HUC3_MODE_RAM     0x0a
+#define HUC3_MODE_RTC_CMD 0x0b
+#define HUC3_MODE_RTC_RSP 0x0c
+#define HUC3_MODE_RTC_SEM 0x0d
+
+static void huc3_map(struct gb_state *s) {
+    mbc_map_rom(s, 0, s->mem_bank_rom);
+    mbc_map_ram(s, s->mem_bank_extram);
+}
+
+static void huc3_write(struct gb_state *s, u16 location, u8 value) {
+    switch (location >> 13) {
+    case 0: /* 0000 - 1FFF */
+        s->mem_mbc_mode = value & 0xf;
+        s->mem_extram_enabled = s->mem_mbc_mode == HUC3_MODE_RAM;
+        if (!s->mem_extram_enabled)
+            s->emu_state->flush_extram = 1;
+        break;
+    case 1: /* 2000 - 3FFF */
+        s->mem_bank_rom = value & 0x7f;
+        break;
+    case 2: /* 4000 - 5FFF */
+        s->mem_bank_extram = value & 0xf;
+        break;
+    }
+    huc3_map(s);
+}
+
+static u8 huc3_ram_read(struct gb_state *s, u16 location) {
+    switch (s->mem_mbc_mode) {
+    case HUC3_MODE_RAM_RO:
+        if (!s->mem_num_banks_extram)
+            return 0xff;
+        return s->mem_EXTRAM[(s->mem_bank_extram % s->mem_num_banks_extram) *
+            EXTRAM_BANKSIZE + location - 0xa000];
+    case HUC3_MODE_RTC_RSP:
+        return 0x80;
+    case HUC3_MODE_RTC_SEM: /* Command done */
+        return 0x01;
+    }
+    return huc_ram_read_ir(s, location);
+}
+
+
+/*
+ * Pocket Camera: up to 1M ROM and 128K RAM. RAM bank 0x10 selects the registers
+ * of the camera sensor instead. There is no sensor: captures finish at once,
+ * leaving the image in RAM untouched.
+ */
+static void camera_map(struct gb_state *s) {
+    mbc_map_rom(s, 0, s->mem_bank_rom);
+
+    /* RAM can always be read, only writes need it to be enabled. */
+    if (s->mem_mbc_mode || !s->mem_num_banks_extram)
+        mbc_map_pages(s, 0xa, 2, NULL);
+    else
+        mbc_map_pages(s, 0xa, 2, &s->mem_EXTRAM[(s->mem_bank_extram %
+                    s->mem_num_banks_extram) * EXTRAM_BANKSIZE]);
+}
+
+static void camera_write(struct gb_state *s, u16 location, u8 value) {
+    switch (location >> 13) {
+    case 0: /* 0000 - 1FFF */
+        mbc_ram_enable(s, value);
+        break;
+    case 1: /* 2000 - 3FFF */
+        s->mem_bank_rom = value & 0x3f;
+        break;
+    case 2: /* 4000 - 5FFF */
+        s->mem_mbc_mode = (value & 0x10) ? 1 : 0;
+        if (!s->mem_mbc_mode)
+            s->mem_bank_extram = value & 0xf;
+        break;
+    }
+    camera_map(s);
+}
+
+static u8 camera_ram_read(struct gb_state *s, u16 location) {
+    (void)s, (void)location;
+    return 0x00; /* Registers are write-only, except A000 (never busy). */
+}
+
+static void camera_ram_write(struct gb_state *s, u16 location, u8 value) {
+    if (s->mem_mbc_mode || !s->mem_extram_enabled)
+        return;
+    mbc_ram_write_mapped(s, location, value);
+}
+
+
+static const struct mbc_ops mbc_ops_none =
+    { "none", mbc_none_write, mbc_ram_read_unmapped, mbc_ram_write_mapped, mbc_none_map };
+static const struct mbc_ops mbc_ops_mbc1 =
+    { "MBC1", mbc1_write, mbc_ram_read_unmapped, mbc_ram_write_mapped, mbc1_map };
+static const struct mbc_ops mbc_ops_mbc2 =
+    { "MBC2", mbc2_write, mbc2_ram_read, mbc2_ram_write, mbc2_map };
+static const struct mbc_ops mbc_ops_mbc3 =
+    { "MBC3", mbc3_write, mbc3_ram_read, mbc3_ram_write, mbc3_map };
+static const struct mbc_ops mbc_ops_mbc5 =
+    { "MBC5", mbc5_write, mbc_ram_read_unmapped, mbc_ram_write_mapped, mbc5_map };
+static const struct mbc_ops mbc_ops_mbc6 =
+    { "MBC6", mbc6_write, mbc_ram_read_unmapped, mbc_ram_write_mapped, mbc6_map };
+static const struct mbc_ops mbc_ops_mbc7 =
+    { "MBC7", mbc7_write, mbc7_ram_read, mbc7_ram_write, mbc7_map };
+static const struct mbc_ops mbc_ops_mmm01 =
+    { "MMM01", mmm01_write, mbc_ram_read_unmapped, mbc_ram_write_mapped, mmm01_map };
+static const struct mbc_ops mbc_ops_huc1 =
+    { "HuC1", huc1_write, huc_ram_read_ir, mbc_ram_write_mapped, huc1_map };
+static const struct mbc_ops mbc_ops_huc3 =
+    { "HuC3", huc3_write, huc3_ram_read, mbc_ram_write_mapped, huc3_map };
+static const struct mbc_ops mbc_ops_camera =
+    { "Camera", camera_write, camera_ram_read, camera_ram_write, camera_map };
+
+/* Selects the implementation for the MBC of the cartridge. */
+int mbc_init(struct gb_state *s) {
+    switch (s->mbc) {
+    case MBC_NONE:   s->mbc_ops = &mbc_ops_none;   break;
+    case MBC_1:      s->mbc_ops = &mbc_ops_mbc1;   break;
+    case MBC_2:      s->mbc_ops = &mbc_ops_mbc2;   break;
+    case MBC_3:      s->mbc_ops = &mbc_ops_mbc3;   break;
+    case MBC_5:      s->mbc_ops = &mbc_ops_mbc5;   break;
+    case MBC_6:      s->mbc_ops = &mbc_ops_mbc6;   break;
+    case MBC_7:      s->mbc_ops = &mbc_ops_mbc7;   break;
+    case MBC_MMM01:  s->mbc_ops = &mbc_ops_mmm01;  break;
+    case MBC_HUC1:   s->mbc_ops = &mbc_ops_huc1;   break;
+    case MBC_HUC3:   s->mbc_ops = &mbc_ops_huc3;   break;
+    case MBC_CAMERA: s->mbc_ops = &mbc_ops_camera; break;
+    default:
+        fprintf(stderr, "Unsupported MBC: %d\n", s->mbc);
+        return 1;
+    }
+    return 0;
+}
+
+/* Power-on state of the bank registers. */
+void mbc_reset(struct gb_state *s) {
+    s->mem_bank_rom = 1;
+    s->mem_bank_rom2 = 0;
+    s->mem_bank_extram = 0;
+    s->mem_bank_extram2 = 0;
+    s->mem_extram_enabled = s->mbc == MBC_NONE;
+    s->mem_mbc1_rombankupper = 0;
+    s->mem_mbc1_romram_select = 0;
+    s->mem_mbc_mode = 0;
+    memset(s->mem_mmm01_regs, 0, sizeof(s->mem_mmm01_regs));
+
+    memset(&s->mem_mbc7, 0, sizeof(s->mem_mbc7));
+    s->mem_mbc7.accel_x = s->mem_mbc7.accel_y = 0x8000;
+    s->mem_mbc7.eeprom_do = 1;
+
+    rtc_reset(s);
+}
@@ -0,0 +1,23 @@
+#ifndef MBC_H
+#define MBC_H
+
+#include "types.h"
+
+/*
+ * Interface of a memory bank controller (mapper). The MBC only sees writes to
+ * its registers (0000-7FFF), writes to A000-BFFF and reads of A000-BFFF that
+ * are not mapped directly to cartridge RAM. Plain ROM and RAM banks are put in
+ * the memory map by `map`, so reads of those never reach the MBC.
+ */
+struct mbc_ops {
+    const char *name;
+    void (*write)(struct gb_state *s, u16 location, u8 value);
+    u8 (*ram_read)(struct gb_state *s, u16 location);
+    void (*ram_write)(struct gb_state *s, u16 location, u8 value);
+    void (*map)(struct gb_state *s);
+};
+
+int mbc_init(struct gb_state *s);
+void mbc_reset(struct gb_state *s);
+
+#endif
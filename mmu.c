@@ -3,6 +3,12 @@
 #include "mmu.h"
 #include "hwdefs.h"
 #include "debugger.h"
+#include "lcd.h"
+#include "dma.h"
+#include "mbc.h"
+#include "serial.h"
+#include "blockcache.h"
+#include "prof.h"
 
 #if 1
 #define MMU_DEBUG_W(fmt, ...) \
@@ -35,207 +41,63 @@
         } \
     } while (0)
 
-static void mmu_hdma_do(struct gb_state *s) {
-    /* DMA one block (0x10 byte), should be called at start of H-Blank. */
-    mmu_assert(s->io_hdma_running);
-    mmu_assert((s->io_hdma_status & (1<<7)) == 0);
-    mmu_assert((s->io_lcd_STAT & 3) == 0);
-
-    for (int i = 0; i < 0x10; i++) {
-        u8 dat = mmu_read(s, s->io_hdma_next_src++);
-        mmu_write(s, s->io_hdma_next_dst++, dat);
-    }
-
-    u32 clks = GB_HDMA_BLOCK_CLKS;
-    if (s->double_speed)
-        clks *= 2;
-    s->emu_state->last_op_cycles += clks;
-
-    s->io_hdma_status--;
-    if (s->io_hdma_status == 0xff) {
-        /* Underflow meant we copied the last block and are done. */
-        s->io_hdma_running = 0;
-    }
+/* The ROM bank currently mapped at 4000-7FFF. */
+int mmu_rom_bank(struct gb_state *s) {
+    return (s->mem_map_read[0x4] - s->mem_ROM) / ROM_BANKSIZE;
 }
 
-static void mmu_hdma_start(struct gb_state *s, u8 lenmode) {
-    u16 blocks = (lenmode & ~(1<<7)) + 1;
-    u16 len = blocks * 0x10;
-    u8 mode_hblank = (lenmode & (1<<7)) ? 1 : 0;
-    u16 src = ((s->io_hdma_src_high << 8) | s->io_hdma_src_low) & ~0xf;
-    u16 dst = ((s->io_hdma_dst_high << 8) | s->io_hdma_dst_low) & ~0xf;
-    dst = (dst & 0x1fff) | 0x8000; /* Ignore upper 3 bits (always in VRAM) */
-
-    printf("HDMA @%.2x:%.4x %.4x -> %.4x, blocks=%.2x mode_hblank=%d\n",
-            s->mem_bank_rom, s->pc,  src, dst, blocks, mode_hblank);
-
-    if (s->io_hdma_running && !mode_hblank) {
-        /* Cancel ongoing H-Blank HDMA transfer */
-        s->io_hdma_running = 0;
-        s->io_hdma_status = 0xff; /* done */
-        return;
+/* Rebuilds the memory map after switching any bank, or (un)mapping the BIOS.
+ * All per-MBC and per-model decisions for plain memory are made here, so the
+ * inlined fast paths of mmu_read and mmu_write are a single table lookup. */
+void mmu_update_map(struct gb_state *s) {
+    for (int i = 0; i < 16; i++)
+        s->mem_map_read[i] = s->mem_map_write[i] = NULL;
+
+    s->mbc_ops->map(s); /* 0000 - 7FFF, A000 - BFFF */
+    if (s->in_bios) { /* Reads of 0000 - 0FFF pick the BIOS or this page. */
+        s->mem_map_under_bios = s->mem_map_read[0x0];
+        s->mem_map_read[0x0] = NULL;
     }
 
-    mmu_assert(blocks > 0 && blocks <= 0x80);
-    mmu_assert(src + len <= 0x8000 || /* ROM */
-            (src >= 0xa000 && src + len <= 0xe000)); /* EXT_RAM */
-    mmu_assert(dst >= 0x8000 && dst + len <= 0xa000); /* VRAM */
+    s->mem_map_read[0x8] = &s->mem_VRAM[s->mem_bank_vram * VRAM_BANKSIZE];
+    s->mem_map_read[0x9] = s->mem_map_read[0x8] + 0x1000;
+    s->mem_map_read[0xc] = s->mem_WRAM;
+    s->mem_map_read[0xd] = &s->mem_WRAM[s->mem_bank_wram * WRAM_BANKSIZE];
+    s->mem_map_read[0xe] = s->mem_WRAM; /* Echo of C000 - CFFF */
 
-    if (!mode_hblank) {
-        for (u16 i = 0; i < len; i++)
-            mmu_write(s, dst++, mmu_read(s, src++));
-
-        s->io_hdma_status = 0xff; /* done */
-        u32 clks = blocks * GB_HDMA_BLOCK_CLKS;
-        if (s->double_speed)
-            clks *= 2;
-        s->emu_state->last_op_cycles += clks;
-    } else {
-        s->io_hdma_running = 1;
-        s->io_hdma_next_src = src;
-        s->io_hdma_next_dst = dst;
-        s->io_hdma_status = blocks - 1;
-
-        if ((s->io_lcd_STAT & 3) == 0) /* H-Blank */
-            mmu_hdma_do(s);
-    }
+    /* VRAM writes have to catch up the LCD first. */
+    s->mem_map_write[0xc] = s->mem_map_read[0xc];
+    s->mem_map_write[0xd] = s->mem_map_read[0xd];
 }
 
-void mmu_step(struct gb_state *s) {
-    if (s->emu_state->lcd_entered_hblank && s->io_hdma_running)
-        mmu_hdma_do(s);
-}
-
-void mmu_write(struct gb_state *s, u16 location, u8 value) {
+void mmu_write_unmapped(struct gb_state *s, u16 location, u8 value) {
+    PROF_ZONE("mmu_write_unmapped");
+    if (s->emu_blockcache_state) /* Peripherals may be behind in a block */
+        blockcache_sync(s);
     //MMU_DEBUG_W("Mem write (%x) %x: ", location, value);
     switch (location & 0xf000) {
-    case 0x0000: /* 0000 - 1FFF */
+    case 0x0000: /* 0000 - 7FFF */
     case 0x1000:
-        MMU_DEBUG_W("EXTRAM(+RTC) enable");
-        /* Dummy, we always have those enabled. */
-        /* Turning off the RAM could indicate that battery-backed data is done
-         * being written and could be flushed to disk. */
-        if (value == 0)
-            s->emu_state->flush_extram = 1;
-        break;
-    case 0x2000: /* 2000 - 3FFF */
+    case 0x2000:
     case 0x3000:
-        MMU_DEBUG_W("ROM bank number");
-        if (value == 0 && s->mbc != 5)
-            value = 1;
-
-        if (s->mbc == 0)
-            mmu_assert(value == 1);
-        else if (s->mbc == 1)
-            value &= 0x1f;
-        else if (s->mbc == 3)
-            value &= 0x7f;
-        else if (s->mbc == 5) {
-            /* MBC5 splits up this area into 2000-2fff for low bits rom bank,
-             * and 3000-3fff for the high bit. */
-            if (location < 0x3000) /* lower 8 bit */
-                s->mem_bank_rom = (s->mem_bank_rom & (1<<8)) | value;
-            else /* Upper bit */
-                s->mem_bank_rom = (s->mem_bank_rom & 0xff) | ((value & 1) << 8);
-            break;
-        } else
-            mmu_error("Area not implemented for this MBC (mbc=%d, loc=%.4x, val=%x)\n", s->mbc, location, value);
-        mmu_assert(s->mbc == 0 || value < s->mem_num_banks_rom);
-        s->mem_bank_rom = value;
-        break;
-    case 0x4000: /* 4000 - 5FFF */
+    case 0x4000:
     case 0x5000:
-        if (s->mbc == 1) {
-            if (s->mem_mbc1_romram_select == 0) { /* ROM mode */
-                MMU_DEBUG_W("upper bits ROM bank number");
-                s->mem_mbc1_rombankupper = value & 3;
-            } else {
-                MMU_DEBUG_W("EXTRAM bank number");
-                s->mem_mbc1_extrambank = value & 3;
-                if (s->mem_num_banks_extram == 1)
-                    s->mem_mbc1_extrambank &= 1;
-            }
-        } else if (s->mbc == 3) {
-            MMU_DEBUG_W("EXTRAM bank number -OR- RTC register select");
-            if (value < 8)
-                mmu_assert(value < s->mem_num_banks_extram);
-            else {
-                mmu_assert(value <= 0xc); /* RTC is at 08-0C */
-                mmu_assert(s->has_rtc);
-            }
-            s->mem_mbc3_extram_rtc_select = value;
-        } else if (s->mbc == 5) {
-            MMU_DEBUG_W("EXTRAM bank number");
-            s->mem_mbc5_extrambank = value & 0xf;
-            s->mem_mbc5_extrambank &= s->mem_num_banks_extram - 1;
-        } else
-            mmu_error("Area not implemented for this MBC (mbc=%d, loc=%.4x, val=%x)\n", s->mbc, location, value);
-        break;
-    case 0x6000: /* 6000 - 7FFF */
+    case 0x6000:
     case 0x7000:
-        if (s->mbc == 1) {
-            MMU_DEBUG_W("ROM/RAM mode select");
-            s->mem_mbc1_romram_select = value & 0x1;
-        } else if (s->has_rtc) { /* MBC3 only */
-            MMU_DEBUG_W("Latch clock data");
-            if (s->mem_latch_rtc == 0x01 && value == 0x01) {
-                /* TODO... actually latch something? */
-                s->mem_latch_rtc = s->mem_latch_rtc;
-            }
-            s->mem_latch_rtc = value;
-        } else if (s->mbc == 3 || s->mbc == 5) { /* MBC3 without RTC or MBC5 */
-            MMU_DEBUG_W("Invalid write for MBC%d", s->mbc);
-            /* Just ignore it - Pokemon Red writes here because it's coded for
-             * MBC1, but actually has an MBC3, for instance */
-        } else
-            mmu_error("Area not implemented for this MBC (mbc=%d, loc=%.4x, val=%x)\n", s->mbc, location, value);
+        MMU_DEBUG_W("%s register", s->mbc_ops->name);
+        s->mbc_ops->write(s, location, value);
         break;
     case 0x8000: /* 8000 - 9FFF */
     case 0x9000:
         MMU_DEBUG_W("VRAM (B%d)", s->mem_bank_vram);
+        lcd_catch_up(s);
         s->mem_VRAM[s->mem_bank_vram * VRAM_BANKSIZE + location - 0x8000]
             = value;
         break;
     case 0xa000: /* A000 - BFFF */
     case 0xb000:
-        if (s->mbc == 1) {
-            if (!s->has_extram)
-                break;
-            if (s->mem_mbc1_romram_select == 1) { /* RAM mode */
-                MMU_DEBUG_W("EXTRAM (B%d)", s->mem_mbc1_extrambank);
-                mmu_assert(s->mem_mbc1_extrambank < s->mem_num_banks_extram);
-                s->mem_EXTRAM[s->mem_mbc1_extrambank * EXTRAM_BANKSIZE + location - 0xa000] = value;
-            } else { /* ROM mode - we can only use bank 0 */
-                MMU_DEBUG_W("EXTRAM (B0)");
-                s->mem_EXTRAM[location - 0xa000] = value;
-            }
-            s->emu_state->extram_dirty = 1;
-        } else if (s->mbc == 3) {
-            MMU_DEBUG_W("EXTRAM (sw)/RTC (B%d)", s->mem_mbc3_extram_rtc_select);
-            if (s->mem_mbc3_extram_rtc_select < 0x04) {
-                s->mem_EXTRAM[s->mem_mbc3_extram_rtc_select * EXTRAM_BANKSIZE + location - 0xa000] = value;
-                s->emu_state->extram_dirty = 1;
-            } else if (s->mem_mbc3_extram_rtc_select >= 0x08 && s->mem_mbc3_extram_rtc_select <= 0x0c)
-                s->mem_RTC[s->mem_mbc3_extram_rtc_select] = value;
-            else
-                mmu_error("Writing to extram/rtc with invalid selection (%d) @%x, val=%x", s->mem_mbc3_extram_rtc_select, location, value);
-        } else if (s->mbc == 5) {
-            MMU_DEBUG_W("EXTRAM (B%d)", s->mem_mbc5_extrambank);
-            if (!s->has_extram)
-                break;
-            mmu_assert(s->mem_mbc5_extrambank < s->mem_num_banks_extram);
-            s->mem_EXTRAM[s->mem_mbc5_extrambank * EXTRAM_BANKSIZE + location - 0xa000] = value;
-            s->emu_state->extram_dirty = 1;
-        } else
-            mmu_error("Area not implemented for this MBC (mbc=%d, loc=%.4x, val=%x)\n", s->mbc, location, value);
-        break;
-    case 0xc000: /* C000 - CFFF */
-        MMU_DEBUG_W("WRAM B0");
-        s->mem_WRAM[location - 0xc000] = value;
-        break;
-    case 0xd000: /* D000 - DFFF */
-        MMU_DEBUG_W("WRAM B%d", s->mem_bank_wram);
-        s->mem_WRAM[s->mem_bank_wram * WRAM_BANKSIZE + location - 0xd000] = value;
+        MMU_DEBUG_W("EXTRAM (%s)", s->mbc_ops->name);
+        s->mbc_ops->ram_write(s, location, value);
         break;
     case 0xe000: /* E000 - FDFF */
         mmu_error("Writing to ECHO area (0xc00-0xfdff) @%x, val=%x", location, value);
@@ -248,7 +110,11 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
         }
         if (location < 0xfea0) { /* FE00 - FE9F */
             MMU_DEBUG_W("Sprite attribute table (OAM)");
+            if (s->io_dma_oam_cycles_left) /* Locked by OAM DMA */
+                break;
+            lcd_catch_up(s);
             s->mem_OAM[location - 0xfe00] = value;
+            s->emu_state->lcd_oam_dirty = 1;
             break;
         }
         if (location < 0xff00) { /* FEA0 - FEFF */
@@ -259,6 +125,11 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
         if (location < 0xff80) { /* FF00 - FF7F */
             //MMU_DEBUG_W("I/O ports ");
 
+            /* LCD control, scroll, palettes and CGB palette data. */
+            if ((location >= 0xff40 && location <= 0xff4b) ||
+                    (location >= 0xff68 && location <= 0xff6b))
+                lcd_catch_up(s);
+
             switch(location) {
             case 0xff00:
                 MMU_DEBUG_W("Joypad");
@@ -270,7 +141,7 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
                 break;
             case 0xff02:
                 MMU_DEBUG_W("Serial link control");
-                s->io_serial_control = value;
+                serial_write_control(s, value);
                 break;
             case 0xff04:
                 MMU_DEBUG_W("Timer Divider");
@@ -433,23 +304,22 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
                 break;
             case 0xff46:
                 MMU_DEBUG_W("DMA source=%.4x dest=0xfe00 (OAM)", value << 8);
-                /* Normally this transfer takes ~160ms (during which only HRAM
-                 * is accessible) but it's okay to be instantaneous. Normally
-                 * roms loop for ~200 cycles or so to wait.  */
-                for (unsigned i = 0; i < OAM_SIZE; i++)
-                    s->mem_OAM[i] = mmu_read(s, (value << 8) + i);
+                dma_oam_start(s, value);
                 break;
             case 0xff47:
                 MMU_DEBUG_W("Background palette");
                 s->io_lcd_BGP = value;
+                lcd_update_palettes(s);
                 break;
             case 0xff48:
                 MMU_DEBUG_W("Object palette 0");
                 s->io_lcd_OBP0 = value;
+                lcd_update_palettes(s);
                 break;
             case 0xff49:
                 MMU_DEBUG_W("Object palette 1");
                 s->io_lcd_OBP1 = value;
+                lcd_update_palettes(s);
                 break;
             case 0xff4a:
                 MMU_DEBUG_W("Window Y");
@@ -460,17 +330,21 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
                 s->io_lcd_WX = value;
                 break;
             case 0xff4d:
-                MMU_DEBUG_W("KEY1: CGB speed (ignored)");
+                MMU_DEBUG_W("KEY1: CGB speed switch prepare");
+                if (s->gb_type == GB_TYPE_CGB)
+                    s->speed_switch_prepare = value & 1;
                 break;
             case 0xff4f:
                 MMU_DEBUG_W("VRAM Bank");
                 mmu_assert(s->gb_type == GB_TYPE_CGB);
                 s->mem_bank_vram = value & 1;
+                mmu_update_map(s);
                 break;
             case 0xff50:
                 MMU_DEBUG_W("BIOS disable");
                 mmu_assert(s->in_bios);
                 s->in_bios = 0;
+                mmu_update_map(s);
                 break;
             case 0xff51:
                 MMU_DEBUG_W("HDMA source, high");
@@ -490,7 +364,7 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
                 break;
             case 0xff55:
                 MMU_DEBUG_W("HDMA length/mode and start transfer");
-                mmu_hdma_start(s, value);
+                dma_hdma_start(s, value);
                 break;
             case 0xff56:
                 MMU_DEBUG_W("Infrared");
@@ -504,6 +378,7 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
                 MMU_DEBUG_W("Background Palette Data idx=%d, inc=%d",
                         s->io_lcd_BGPI & 0x3f, s->io_lcd_BGPI & (1<<7)?1:0);
                 s->io_lcd_BGPD[s->io_lcd_BGPI & 0x3f] = value;
+                lcd_update_cgb_color(s, 0, s->io_lcd_BGPI & 0x3f);
                 if (s->io_lcd_BGPI & (1 << 7))
                     s->io_lcd_BGPI = (((s->io_lcd_BGPI & 0x3f) + 1) & 0x3f) | (1 << 7);
                 break;
@@ -515,6 +390,7 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
                 MMU_DEBUG_W("Sprite Palette Data idx=%d, inc=%d",
                         s->io_lcd_OBPI & 0x3f, s->io_lcd_OBPI & (1<<7)?1:0);
                 s->io_lcd_OBPD[s->io_lcd_OBPI & 0x3f] = value;
+                lcd_update_cgb_color(s, 1, s->io_lcd_OBPI & 0x3f);
                 if (s->io_lcd_OBPI & (1 << 7))
                     s->io_lcd_OBPI = (((s->io_lcd_OBPI & 0x3f) + 1) & 0x3f) | (1 << 7);
                 break;
@@ -525,6 +401,7 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
                     value = 1;
                 value &= s->mem_num_banks_wram - 1;
                 s->mem_bank_wram = value;
+                mmu_update_map(s);
                 break;
             case 0xff7f:
                 MMU_DEBUG_W("UNKNOWN I/O port (tetris hack)");
@@ -549,83 +426,29 @@ void mmu_write(struct gb_state *s, u16 location, u8 value) {
             s->interrupts_enable = value;
             break;
         }
+        break;
     default:
         mmu_error("Invalid write location: %x val=%x", location, value);
     }
 }
 
-u8 mmu_read(struct gb_state *s, u16 location) {
+u8 mmu_read_unmapped(struct gb_state *s, u16 location) {
+    PROF_ZONE("mmu_read_unmapped");
+    if (s->emu_blockcache_state)
+        blockcache_sync(s);
     /*MMU_DEBUG_R("Mem read (%x): ", location); */
-    if (s->in_bios && location < 0x100)
-    {
-        /*MMU_DEBUG_R("BIOS: %04x: %02x", location, s->bios[location]); */
-        return s->mem_BIOS[location];
-    }
-
     switch (location & 0xf000) {
-    case 0x0000: /* 0000 - 3FFF */
-    case 0x1000:
-    case 0x2000:
-    case 0x3000:
-        /*MMU_DEBUG_R("ROM B0 @ %4x", location); */
-        return s->mem_ROM[location];
-    case 0x4000: /* 4000 - 7FFF */
-    case 0x5000:
-    case 0x6000:
-    case 0x7000:
-    {
-        //MMU_DEBUG_R("ROM B%d, %4x", s->mem_bank_rom, s->mem_bank_rom * 0x4000 + (location - 0x4000));
-        u8 bank = s->mem_bank_rom;
-        if (s->mbc == 1 && s->mem_mbc1_romram_select == 0)
-            bank |= s->mem_mbc1_rombankupper << 5;
-        mmu_assert(s->mem_num_banks_rom > 0);
-        mmu_assert(bank > 0 || s->mbc == 5);
-        bank &= s->mem_num_banks_rom - 1;
-        return s->mem_ROM[bank * 0x4000 + (location - 0x4000)];
-    }
-    case 0x8000: /* 8000 - 9FFF */
-    case 0x9000:
-        MMU_DEBUG_R("VRAM");
-        return s->mem_VRAM[s->mem_bank_vram * VRAM_BANKSIZE + location - 0x8000];
+    case 0x0000: /* 0000 - 0FFF, while the BIOS is mapped over it */
+        if (s->in_bios && location < 0x100)
+        {
+            /*MMU_DEBUG_R("BIOS: %04x: %02x", location, s->bios[location]); */
+            return s->mem_BIOS[location];
+        }
+        return s->mem_map_under_bios[location];
     case 0xa000: /* A000 - BFFF */
     case 0xb000:
-        if (s->mbc == 1) {
-            MMU_DEBUG_R("EXTRAM (rom/ram: %d, B%d)", s->mem_mbc1_romram_select, s->mem_mbc1_extrambank);
-            if (!s->has_extram)
-                return 0xff;
-            if (s->mem_mbc1_romram_select == 1) { /* RAM mode */
-                mmu_assert(s->mem_mbc1_extrambank < s->mem_num_banks_extram);
-                return s->mem_EXTRAM[s->mem_mbc1_extrambank * EXTRAM_BANKSIZE + location - 0xa000];
-            } else /* ROM mode - we can only be bank 0 */
-                return s->mem_EXTRAM[location - 0xa000];
-        } else if (s->mbc == 3) {
-            MMU_DEBUG_R("EXTRAM (sw)/RTC (B%d)", s->mem_mbc3_extram_rtc_select);
-            if (s->mem_mbc3_extram_rtc_select < 0x04)
-                return s->mem_EXTRAM[s->mem_mbc3_extram_rtc_select * EXTRAM_BANKSIZE + location - 0xa000];
-            else if (s->mem_mbc3_extram_rtc_select >= 0x08 && s->mem_mbc3_extram_rtc_select <= 0x0c)
-                return s->mem_RTC[s->mem_mbc3_extram_rtc_select];
-            else
-                mmu_error("Reading from extram/rtc with invalid selection (%d) @%x", s->mem_mbc3_extram_rtc_select, location);
-        } else if (s->mbc == 5) {
-            MMU_DEBUG_R("EXTRAM B%d", s->mem_mbc5_extrambank);
-            if (!s->has_extram)
-                return 0xff;
-            mmu_assert(s->mem_mbc5_extrambank < s->mem_num_banks_extram);
-            return s->mem_EXTRAM[s->mem_mbc5_extrambank * EXTRAM_BANKSIZE + location - 0xa000];
-        } else
-            mmu_error("Area not implemented for this MBC (mbc=%d, location=%.4x)\n", s->mbc, location);
-
-        return 0;
-    case 0xc000: /* C000 - CFFF */
-        //MMU_DEBUG_R("WRAM B0  @%x", (location - 0xc000));
-        return s->mem_WRAM[location - 0xc000];
-    case 0xd000: /* D000 - DFFF */
-        MMU_DEBUG_R("WRAM B%d @%x", s->mem_bank_wram, location - 0xd000);
-        return s->mem_WRAM[s->mem_bank_wram * WRAM_BANKSIZE + location - 0xd000];
-    case 0xe000: /* E000 - FDFF */
-        return mmu_read(s, location - 0x2000); /* TODO XXX */
-        mmu_error("Reading from ECHO (0xc000 - 0xddff) B0: %x", location);
-        return 0;
+        MMU_DEBUG_R("EXTRAM (%s)", s->mbc_ops->name);
+        return s->mbc_ops->ram_read(s, location);
     case 0xf000:
         if (location < 0xfe00) {
             mmu_error("Reading from ECHO (0xc000 - 0xddff) B0: %x", location);
@@ -634,6 +457,8 @@ u8 mmu_read(struct gb_state *s, u16 location) {
 
         if (location < 0xfea0) { /* FE00 - FE9F */
             MMU_DEBUG_R("Sprite attribute table (OAM)");
+            if (s->io_dma_oam_cycles_left) /* Locked by OAM DMA */
+                return 0xff;
             return s->mem_OAM[location - 0xfe00];
         }
 
@@ -780,6 +605,9 @@ u8 mmu_read(struct gb_state *s, u16 location) {
             case 0xff45:
                 MMU_DEBUG_R("LCD LYC");
                 return s->io_lcd_LYC;
+            case 0xff46:
+                MMU_DEBUG_R("DMA source");
+                return s->io_dma_oam_src;
             case 0xff47:
                 MMU_DEBUG_R("Background palette");
                 return s->io_lcd_BGP;
@@ -796,8 +624,10 @@ u8 mmu_read(struct gb_state *s, u16 location) {
                 MMU_DEBUG_R("Window X");
                 return s->io_lcd_WX;
             case 0xff4d:
-                MMU_DEBUG_R("KEY1: CGB speed (ignored)");
-                return 1<<7; /* TODO XXX */
+                MMU_DEBUG_R("KEY1: CGB speed");
+                if (s->gb_type != GB_TYPE_CGB)
+                    return 0xff;
+                return (s->double_speed << 7) | 0x7e | s->speed_switch_prepare;
             case 0xff4f:
                 MMU_DEBUG_R("VRAM Bank");
                 mmu_assert(s->gb_type == GB_TYPE_CGB);
@@ -832,6 +662,7 @@ u8 mmu_read(struct gb_state *s, u16 location) {
             MMU_DEBUG_R("Interrupt enable");
             return s->interrupts_enable;
         }
+        break;
 
     default:
         mmu_error("Reading from invalid location @%x", location);
@@ -19,10 +19,28 @@
  *  $FFFF       Interrupt Enable Flag
  */
 
-void mmu_step(struct gb_state *s);
+int mmu_rom_bank(struct gb_state *s);
+void mmu_update_map(struct gb_state *s);
 
-u8 mmu_read(struct gb_state *s, u16 location);
-void mmu_write(struct gb_state *s, u16 location, u8 value);
+u8 mmu_read_unmapped(struct gb_state *s, u16 location);
+void mmu_write_unmapped(struct gb_state *s, u16 location, u8 value);
+
+/* Memory in the map (see mmu_update_map) is accessed directly, everything else
+ * (I/O, OAM, VRAM writes, MBC registers, BIOS) goes through the MMU. */
+static inline u8 mmu_read(struct gb_state *s, u16 location) {
+    u8 *page = s->mem_map_read[location >> 12];
+    if (page)
+        return page[location & 0xfff];
+    return mmu_read_unmapped(s, location);
+}
+
+static inline void mmu_write(struct gb_state *s, u16 location, u8 value) {
+    u8 *page = s->mem_map_write[location >> 12];
+    if (page)
+        page[location & 0xfff] = value;
+    else
+        mmu_write_unmapped(s, location, value);
+}
 
 u16 mmu_read16(struct gb_state *s, u16 location);
 void mmu_write16(struct gb_state *s, u16 location, u16 value);
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+
+#include "pacer.h"
+
+/* When this far behind (e.g. after a stall), start over from now instead of
+ * running fast to catch up. */
+#define PACER_MAX_LAG_FRAMES 4
+
+struct pacer {
+    enum pacer_mode mode;
+    int fast_forward;
+    uint64_t frame_ns;
+    uint64_t deadline_ns;
+    uint64_t last_frame_ns;
+
+    /* Frame times, updated by the emulation thread. */
+    uint64_t frames;
+    double frame_sum, frame_sum_sq, frame_min, frame_max; /* ns */
+    uint64_t late_frames;
+
+    /* Latencies, updated by whichever thread presents frames. */
+    uint64_t presented;
+    double latency_sum, latency_max; /* ns */
+};
+
+uint64_t pacer_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct pacer *pacer_new(enum pacer_mode mode, double frame_secs) {
+    struct pacer *p = calloc(1, sizeof(struct pacer));
+    if (!p)
+        return NULL;
+    p->mode = mode;
+    p->frame_ns = frame_secs * 1e9;
+    p->last_frame_ns = pacer_now_ns();
+    p->deadline_ns = p->last_frame_ns + p->frame_ns;
+    return p;
+}
+
+void pacer_free(struct pacer *p) {
+    free(p);
+}
+
+/* Runs frames as fast as possible, without sleeping. */
+void pacer_set_fast_forward(struct pacer *p, int enable) {
+    p->fast_forward = enable;
+}
+
+int pacer_fast_forward(struct pacer *p) {
+    return p->fast_forward;
+}
+
+static void pacer_sleep_until(uint64_t deadline_ns) {
+    struct timespec ts = {
+        .tv_sec = deadline_ns / 1000000000ull,
+        .tv_nsec = deadline_ns % 1000000000ull,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* Called once per emulated frame, returns at the time the next one should
+ * start. */
+void pacer_wait(struct pacer *p) {
+    uint64_t now = pacer_now_ns();
+
+    if (p->mode == PACER_CLOCK && !p->fast_forward) {
+        if (now > p->deadline_ns + PACER_MAX_LAG_FRAMES * p->frame_ns) {
+            p->late_frames++;
+            p->deadline_ns = now;
+        } else if (now < p->deadline_ns) {
+            pacer_sleep_until(p->deadline_ns);
+            now = pacer_now_ns();
+        } else if (now > p->deadline_ns + p->frame_ns)
+            p->late_frames++;
+        p->deadline_ns += p->frame_ns;
+    } else
+        p->deadline_ns = now + p->frame_ns;
+
+    double frame = now - p->last_frame_ns;
+    p->last_frame_ns = now;
+    if (!p->frames || frame < p->frame_min)
+        p->frame_min = frame;
+    if (frame > p->frame_max)
+        p->frame_max = frame;
+    p->frame_sum += frame;
+    p->frame_sum_sq += frame * frame;
+    p->frames++;
+}
+
+/* Called when a frame is on screen, with the time the input it reflects was
+ * polled. */
+void pacer_presented(struct pacer *p, uint64_t input_ns) {
+    double latency = pacer_now_ns() - input_ns;
+    if (latency > p->latency_max)
+        p->latency_max = latency;
+    p->latency_sum += latency;
+    p->presented++;
+}
+
+void pacer_get_stats(struct pacer *p, struct pacer_stats *stats) {
+    double n = p->frames ? p->frames : 1;
+    double avg = p->frame_sum / n;
+    double var = p->frame_sum_sq / n - avg * avg;
+
+    stats->frames = p->frames;
+    stats->frame_ms_avg = avg / 1e6;
+    stats->frame_ms_min = p->frame_min / 1e6;
+    stats->frame_ms_max = p->frame_max / 1e6;
+    stats->jitter_ms = sqrt(var > 0 ? var : 0) / 1e6;
+    stats->late_frames = p->late_frames;
+    stats->presented = p->presented;
+    stats->latency_ms_avg =
+        p->latency_sum / (p->presented ? p->presented : 1) / 1e6;
+    stats->latency_ms_max = p->latency_max / 1e6;
+}
+
+void pacer_print_stats(struct pacer *p) {
+    struct pacer_stats st;
+    pacer_get_stats(p, &st);
+    printf("Frames: %llu, frame time avg %.2f ms (min %.2f, max %.2f), "
+            "jitter %.2f ms, %llu late\n", (unsigned long long)st.frames,
+            st.frame_ms_avg, st.frame_ms_min, st.frame_ms_max, st.jitter_ms,
+            (unsigned long long)st.late_frames);
+    printf("Presented: %llu, input latency avg %.2f ms (max %.2f)\n",
+            (unsigned long long)st.presented, st.latency_ms_avg,
+            st.latency_ms_max);
+}
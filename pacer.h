@@ -0,0 +1,41 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+
+/*
+ * Frame pacing: keeps emulated frames at the speed of the real hardware using
+ * the monotonic clock, sleeping until the deadline of each frame instead of
+ * spinning. Also collects frame time and input-to-photon latency statistics.
+ */
+
+enum pacer_mode {
+    PACER_CLOCK, /* Sleep until the next frame deadline */
+    PACER_AUDIO, /* The audio output blocks, only keep statistics */
+};
+
+struct pacer_stats {
+    uint64_t frames;
+    double frame_ms_avg, frame_ms_min, frame_ms_max;
+    double jitter_ms; /* Standard deviation of the frame time */
+    uint64_t late_frames; /* Deadline missed by more than a frame */
+    uint64_t presented;
+    double latency_ms_avg, latency_ms_max; /* Input poll to frame on screen */
+};
+
+struct pacer;
+
+struct pacer *pacer_new(enum pacer_mode mode, double frame_secs);
+void pacer_free(struct pacer *p);
+
+uint64_t pacer_now_ns(void);
+void pacer_set_fast_forward(struct pacer *p, int enable);
+int pacer_fast_forward(struct pacer *p);
+
+void pacer_wait(struct pacer *p);
+void pacer_presented(struct pacer *p, uint64_t input_ns);
+
+void pacer_get_stats(struct pacer *p, struct pacer_stats *stats);
+void pacer_print_stats(struct pacer *p);
+
+#endif
@@ -16,6 +16,7 @@ struct player_input {
     bool special_quit;
     bool special_savestate;
     bool special_dbgbreak;
+    bool special_turbo; /* Toggles turbo mode */
 };
 
 #endif
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <time.h>
+
+#include "prof.h"
+
+#ifdef PROF_ENABLE
+
+/* Zones register themselves on first use. Instances may run on several
+ * threads, so the list and the counters are updated atomically. */
+static struct prof_zone *prof_zones;
+
+static u64 prof_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct prof_scope prof_zone_begin(struct prof_zone *zone) {
+    if (!__atomic_load_n(&zone->registered, __ATOMIC_ACQUIRE) &&
+            !__atomic_exchange_n(&zone->registered, 1, __ATOMIC_ACQ_REL)) {
+        zone->next = __atomic_load_n(&prof_zones, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&prof_zones, &zone->next, zone,
+                    0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    return (struct prof_scope){ zone, prof_now_ns() };
+}
+
+void prof_zone_end(struct prof_scope *scope) {
+    u64 ns = prof_now_ns() - scope->start_ns;
+    __atomic_fetch_add(&scope->zone->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&scope->zone->ns, ns, __ATOMIC_RELAXED);
+}
+
+static int prof_cmp_ns(const void *a, const void *b) {
+    const struct prof_zone *za = *(struct prof_zone * const *)a;
+    const struct prof_zone *zb = *(struct prof_zone * const *)b;
+    return za->ns < zb->ns ? 1 : za->ns > zb->ns ? -1 : 0;
+}
+
+void prof_print(FILE *f) {
+    struct prof_zone *zones[64];
+    int n = 0;
+
+    for (struct prof_zone *z = __atomic_load_n(&prof_zones, __ATOMIC_ACQUIRE);
+            z && n < 64; z = z->next)
+        zones[n++] = z;
+    qsort(zones, n, sizeof(zones[0]), prof_cmp_ns);
+
+    fprintf(f, "%-24s %12s %12s %10s\n", "Zone", "Calls", "Total ms",
+            "ns/call");
+    for (int i = 0; i < n; i++)
+        fprintf(f, "%-24s %12llu %12.1f %10.1f\n", zones[i]->name,
+                (unsigned long long)zones[i]->calls, zones[i]->ns / 1e6,
+                zones[i]->calls ? (double)zones[i]->ns / zones[i]->calls : 0.);
+}
+
+#else
+
+void prof_print(FILE *f) {
+    (void)f;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdio.h>
+
+#include "types.h"
+
+/*
+ * Profiling zones: PROF_ZONE("name") at the top of a block counts how often the
+ * block runs and the (inclusive) time spent in it. Only built in with
+ * PROF_ENABLE (the PAXGBC_PROF_ZONES build option), otherwise it compiles to
+ * nothing. Each zone costs two clock reads, so mostly useful for comparing
+ * coarse parts of the emulation rather than for tiny functions.
+ */
+
+#ifdef PROF_ENABLE
+
+struct prof_zone {
+    const char *name;
+    u64 calls;
+    u64 ns;
+    bool registered;
+    struct prof_zone *next;
+};
+
+struct prof_scope {
+    struct prof_zone *zone;
+    u64 start_ns;
+};
+
+struct prof_scope prof_zone_begin(struct prof_zone *zone);
+void prof_zone_end(struct prof_scope *scope);
+
+#define PROF_CONCAT_(a, b) a ## b
+#define PROF_CONCAT(a, b) PROF_CONCAT_(a, b)
+#define PROF_ZONE(zone_name) \
+    static struct prof_zone PROF_CONCAT(prof_zone_, __LINE__) = { \
+        .name = zone_name }; \
+    struct prof_scope PROF_CONCAT(prof_scope_, __LINE__) \
+        __attribute__((cleanup(prof_zone_end))) = \
+        prof_zone_begin(&PROF_CONCAT(prof_zone_, __LINE__))
+
+#else
+
+#define PROF_ZONE(zone_name) do { } while (0)
+
+#endif
+
+/* Prints all zones that ran, most time first. Does nothing without zones. */
+void prof_print(FILE *f);
+
+#endif
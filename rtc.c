@@ -0,0 +1,146 @@
+/*
+ * MBC3 real time clock.
+ *
+ * The clock isn't ticked along with the emulation. Instead only the host time
+ * at which the counter was (or would have been) zero is stored, and the
+ * registers are derived from the host time whenever they are latched or
+ * written. While halted the counter value is stored instead.
+ *
+ * The host wall clock (UNIX time) is used rather than a monotonic one, as the
+ * clock has to keep running while the emulator isn't, and the .sav footer
+ * stores a UNIX timestamp.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "rtc.h"
+
+/* Registers, as selected by EXTRAM banks 0x08-0x0c. */
+#define RTC_REG_S  0
+#define RTC_REG_M  1
+#define RTC_REG_H  2
+#define RTC_REG_DL 3
+#define RTC_REG_DH 4 /* Bit 0: day bit 8, bit 6: halt, bit 7: day carry. */
+
+#define RTC_DH_HALT  (1<<6)
+#define RTC_DH_CARRY (1<<7)
+
+#define RTC_DAY_SECS   (24 * 60 * 60)
+#define RTC_LIMIT_SECS (512 * RTC_DAY_SECS) /* Day counter is 9 bits */
+
+static const u8 rtc_reg_masks[5] = { 0x3f, 0x3f, 0x1f, 0xff, 0xc1 };
+
+/* Current value of the counter, in seconds. */
+static u32 rtc_counter(struct gb_state *s) {
+    if (s->rtc_flags & RTC_DH_HALT)
+        return s->rtc_halt_secs;
+
+    s64 now = time(NULL);
+    s64 secs = now - s->rtc_base;
+    if (secs < 0) { /* Host clock went back */
+        s->rtc_base = now;
+        secs = 0;
+    }
+    if (secs >= RTC_LIMIT_SECS) {
+        s->rtc_flags |= RTC_DH_CARRY;
+        s->rtc_base += secs / RTC_LIMIT_SECS * RTC_LIMIT_SECS;
+        secs %= RTC_LIMIT_SECS;
+    }
+    return secs;
+}
+
+static void rtc_get_regs(struct gb_state *s, u8 *regs) {
+    u32 secs = rtc_counter(s);
+    u32 days = secs / RTC_DAY_SECS;
+    regs[RTC_REG_S] = secs % 60;
+    regs[RTC_REG_M] = secs / 60 % 60;
+    regs[RTC_REG_H] = secs / 3600 % 24;
+    regs[RTC_REG_DL] = days & 0xff;
+    regs[RTC_REG_DH] = (days >> 8) | s->rtc_flags;
+}
+
+static void rtc_set_regs(struct gb_state *s, const u8 *regs, s64 now) {
+    u32 days = regs[RTC_REG_DL] | ((regs[RTC_REG_DH] & 1) << 8);
+    u32 secs = days * RTC_DAY_SECS + regs[RTC_REG_H] * 3600 + regs[RTC_REG_M] * 60 +
+        regs[RTC_REG_S];
+
+    s->rtc_flags = regs[RTC_REG_DH] & (RTC_DH_HALT | RTC_DH_CARRY);
+    s->rtc_halt_secs = secs;
+    s->rtc_base = now - secs;
+}
+
+void rtc_reset(struct gb_state *s) {
+    s->mem_latch_rtc = 0x01;
+    memset(s->mem_RTC, 0, sizeof(s->mem_RTC));
+    s->rtc_base = time(NULL);
+    s->rtc_halt_secs = 0;
+    s->rtc_flags = 0;
+}
+
+/* Copies the current time into the registers readable by the game. */
+void rtc_latch(struct gb_state *s) {
+    rtc_get_regs(s, s->mem_RTC);
+}
+
+u8 rtc_read(struct gb_state *s, u8 reg) {
+    return s->mem_RTC[reg - 0x08];
+}
+
+void rtc_write(struct gb_state *s, u8 reg, u8 value) {
+    u8 regs[5];
+    reg -= 0x08;
+    value &= rtc_reg_masks[reg];
+
+    rtc_get_regs(s, regs);
+    regs[reg] = value;
+    rtc_set_regs(s, regs, time(NULL));
+    s->mem_RTC[reg] = value;
+    s->emu_state->extram_dirty = 1;
+}
+
+static void rtc_put32(u8 *buf, u32 val) {
+    for (int i = 0; i < 4; i++)
+        buf[i] = val >> (i * 8);
+}
+
+static u32 rtc_get32(u8 *buf) {
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((u32)buf[3] << 24);
+}
+
+/*
+ * Footer of RTC_SAVE_SIZE bytes, all little endian: the current registers
+ * (S, M, H, DL, DH) as 5 32-bit words, the latched registers in the same
+ * format, and the UNIX time at which they were saved as 64-bit word.
+ */
+void rtc_save(struct gb_state *s, u8 *buf) {
+    u8 regs[5];
+    u64 now = time(NULL);
+    rtc_get_regs(s, regs);
+    for (int i = 0; i < 5; i++) {
+        rtc_put32(&buf[i * 4], regs[i]);
+        rtc_put32(&buf[20 + i * 4], s->mem_RTC[i]);
+    }
+    rtc_put32(&buf[40], now);
+    rtc_put32(&buf[44], now >> 32);
+}
+
+/* Loads the footer, which can also be the older 44 byte variant with a 32-bit
+ * timestamp. */
+int rtc_load(struct gb_state *s, u8 *buf, size_t size) {
+    u8 regs[5];
+    if (size != RTC_SAVE_SIZE && size != RTC_SAVE_SIZE - 4)
+        return 1;
+
+    for (int i = 0; i < 5; i++) {
+        regs[i] = rtc_get32(&buf[i * 4]) & rtc_reg_masks[i];
+        s->mem_RTC[i] = rtc_get32(&buf[20 + i * 4]) & rtc_reg_masks[i];
+    }
+    s64 saved = rtc_get32(&buf[40]);
+    if (size == RTC_SAVE_SIZE)
+        saved |= (s64)rtc_get32(&buf[44]) << 32;
+
+    /* The clock kept running (unless halted) since it was saved. */
+    rtc_set_regs(s, regs, saved);
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef RTC_H
+#define RTC_H
+
+#include <stddef.h>
+
+#include "types.h"
+
+/* Size of the RTC footer appended to the .sav (VBA-M/BGB format). */
+#define RTC_SAVE_SIZE 48
+
+void rtc_reset(struct gb_state *s);
+void rtc_latch(struct gb_state *s);
+u8 rtc_read(struct gb_state *s, u8 reg);
+void rtc_write(struct gb_state *s, u8 reg, u8 value);
+
+void rtc_save(struct gb_state *s, u8 *buf);
+int rtc_load(struct gb_state *s, u8 *buf, size_t size);
+
+#endif
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Usage: flamegraph.sh OUT.svg COMMAND [ARG]...
+#
+# Records COMMAND with perf (frame pointer call graphs) and renders a flamegraph
+# with Brendan Gregg's FlameGraph scripts, found in $FLAMEGRAPH_DIR or on PATH.
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 OUT.svg COMMAND [ARG]..." >&2
+    exit 1
+fi
+out="$1"
+shift
+
+if ! command -v perf >/dev/null 2>&1; then
+    echo "perf not found (linux-tools / linux-perf package)" >&2
+    exit 1
+fi
+
+collapse=stackcollapse-perf.pl
+flamegraph=flamegraph.pl
+if [ -n "$FLAMEGRAPH_DIR" ]; then
+    collapse="$FLAMEGRAPH_DIR/$collapse"
+    flamegraph="$FLAMEGRAPH_DIR/$flamegraph"
+fi
+for tool in "$collapse" "$flamegraph"; do
+    if ! command -v "$tool" >/dev/null 2>&1; then
+        echo "$tool not found, get https://github.com/brendangregg/FlameGraph" \
+            "and set FLAMEGRAPH_DIR" >&2
+        exit 1
+    fi
+done
+
+perf record -F 999 -g --call-graph fp -o perf.data -- "$@"
+perf script -i perf.data | "$collapse" | "$flamegraph" > "$out"
+echo "Flamegraph written to $out"
@@ -67,7 +67,7 @@ int gui_lcd_init(int width, int height, int zoom, char *wintitle) {
         return 1;
     }
 
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING, width, height);
     if (!texture){
         printf("SDL could not create screen texture: %s\n", SDL_GetError());
         SDL_Quit();
@@ -82,52 +82,73 @@ int gui_lcd_init(int width, int height, int zoom, char *wintitle) {
 }
 
 
-void gui_lcd_render_frame(char use_colors, uint16_t *pixbuf) {
-    uint32_t *pixels = NULL;
+/* Pixel format of the texture, the emulator converts colors to it when the
+ * palettes are written. */
+uint16_t gui_lcd_color(uint8_t r, uint8_t g, uint8_t b) {
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+void gui_lcd_render_frame(char use_colors, uint16_t *pixbuf,
+        const uint8_t *lines_changed) {
+    (void)use_colors;
+    /* The contents of a locked streaming texture are undefined, so all lines
+     * have to be written anyway. */
+    (void)lines_changed;
+    uint8_t *pixels = NULL;
     int pitch;
     if (SDL_LockTexture(texture, NULL, (void*)&pixels, &pitch)) {
         printf("SDL could not lock screen texture: %s\n", SDL_GetError());
         exit(1);
     }
 
-    if (use_colors) {
-        /* The colors stored in pixbuf are two byte each, 5 bits per rgb
-         * component: -bbbbbgg gggrrrrr. We need to extract these, scale these
-         * values from 0-1f to 0-ff and put them in RGBA format. For the scaling
-         * we'd have to multiply by 0xff/0x1f, which is 8.23, approx 8, which is
-         * a shift by 3. */
-        for (int y = 0; y < lcd_height; y++)
-            for (int x = 0; x < lcd_width; x++) {
-                int idx = x + y * lcd_width;
-                uint16_t rawcol = pixbuf[idx];
-                uint32_t r = ((rawcol >>  0) & 0x1f) << 3;
-                uint32_t g = ((rawcol >>  5) & 0x1f) << 3;
-                uint32_t b = ((rawcol >> 10) & 0x1f) << 3;
-                uint32_t col = (r << 24) | (g << 16) | (b << 8) | 0xff;
-                pixels[idx] = col;
-            }
-    } else {
-        /* The colors stored in pixbuf already went through the palette
-         * translation, but are still 2 bit monochrome. */
-        uint32_t palette[] = { 0xffffffff, 0xaaaaaaaa, 0x66666666, 0x11111111 };
-        for (int y = 0; y < lcd_height; y++)
-            for (int x = 0; x < lcd_width; x++) {
-                int idx = x + y * lcd_width;
-                pixels[idx] = palette[pixbuf[idx]];
-            }
-    }
+    for (int y = 0; y < lcd_height; y++)
+        memcpy(pixels + y * pitch, pixbuf + y * lcd_width,
+                lcd_width * sizeof(uint16_t));
 
     SDL_UnlockTexture(texture);
     SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
+}
+
+/* Buttons of a player: player 1 uses the arrow keys, Z, X, Enter and
+ * Backspace, player 2 (in link mode) I, J, K, L, N, M, O and U. */
+static void gui_button(struct player_input *input, struct player_input *input2,
+        SDL_Keycode key, bool pressed) {
+    switch (key) {
+    case SDLK_RETURN:    input->button_start = pressed; break;
+    case SDLK_BACKSPACE: input->button_select = pressed; break;
+    case SDLK_x:         input->button_b = pressed; break;
+    case SDLK_z:         input->button_a = pressed; break;
+    case SDLK_DOWN:      input->button_down = pressed; break;
+    case SDLK_UP:        input->button_up = pressed; break;
+    case SDLK_LEFT:      input->button_left = pressed; break;
+    case SDLK_RIGHT:     input->button_right = pressed; break;
+    }
 
-    SDL_Delay(1000/120);
+    if (!input2)
+        return;
+    switch (key) {
+    case SDLK_o:         input2->button_start = pressed; break;
+    case SDLK_u:         input2->button_select = pressed; break;
+    case SDLK_m:         input2->button_b = pressed; break;
+    case SDLK_n:         input2->button_a = pressed; break;
+    case SDLK_k:         input2->button_down = pressed; break;
+    case SDLK_i:         input2->button_up = pressed; break;
+    case SDLK_j:         input2->button_left = pressed; break;
+    case SDLK_l:         input2->button_right = pressed; break;
+    }
 }
 
 int gui_input_poll(struct player_input *input) {
+    return gui_input_poll2(input, NULL);
+}
+
+/* Polls the input of two players, the special keys go to the first. */
+int gui_input_poll2(struct player_input *input, struct player_input *input2) {
     input->special_quit = 0;
     input->special_savestate = 0;
     input->special_dbgbreak = 0;
+    input->special_turbo = 0;
 
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
@@ -141,29 +162,13 @@ int gui_input_poll(struct player_input *input) {
 
             case SDLK_b:         input->special_dbgbreak = 1; break;
             case SDLK_s:         input->special_savestate = 1; break;
-
-            case SDLK_RETURN:    input->button_start = 1; break;
-            case SDLK_BACKSPACE: input->button_select = 1; break;
-            case SDLK_x:         input->button_b = 1; break;
-            case SDLK_z:         input->button_a = 1; break;
-            case SDLK_DOWN:      input->button_down = 1; break;
-            case SDLK_UP:        input->button_up = 1; break;
-            case SDLK_LEFT:      input->button_left = 1; break;
-            case SDLK_RIGHT:     input->button_right = 1; break;
+            case SDLK_TAB:       input->special_turbo = 1; break;
             }
+            gui_button(input, input2, event.key.keysym.sym, 1);
             break;
 
         case SDL_KEYUP:
-            switch (event.key.keysym.sym) {
-            case SDLK_RETURN:    input->button_start = 0; break;
-            case SDLK_BACKSPACE: input->button_select = 0; break;
-            case SDLK_x:         input->button_b = 0; break;
-            case SDLK_z:         input->button_a = 0; break;
-            case SDLK_DOWN:      input->button_down = 0; break;
-            case SDLK_UP:        input->button_up = 0; break;
-            case SDLK_LEFT:      input->button_left = 0; break;
-            case SDLK_RIGHT:     input->button_right = 0; break;
-            }
+            gui_button(input, input2, event.key.keysym.sym, 0);
             break;
 
         case SDL_QUIT:
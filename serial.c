@@ -0,0 +1,615 @@
+/*
+ * Serial port (link cable). A transfer started with the internal clock shifts
+ * out SB in 8 clocks of 8192 Hz (262144 Hz in CGB fast mode, both doubled in
+ * double speed), while shifting in the byte of the other side, and then raises
+ * the serial interrupt. With the external clock, the other side starts it.
+ *
+ * The other side is a transport:
+ *  - null: nothing connected, 0xff is shifted in and transfers with the
+ *    external clock never complete.
+ *  - capture: like null, but records the bytes sent, test ROMs print their
+ *    results there.
+ *  - unix: another instance, over a UNIX stream socket.
+ *  - pair: another instance in the same process, running on another thread.
+ *
+ * The unix transport never blocks. If the byte of the other side hasn't
+ * arrived when a transfer should complete, it is polled again later, as if the
+ * other side were slower.
+ *
+ * The pair transport runs the two instances in lockstep instead: the other side
+ * replies once its clock reaches the end of the transfer, and the side that
+ * started it waits for that reply. Both publish their clock whenever they poll,
+ * and while the port is in use, a side that gets more than a transfer ahead of
+ * the other waits for it. Otherwise both run freely, there is no locking
+ * outside of these waits.
+ *
+ * Live transports (sockets, pairs) can't be rolled back, so they are left alone
+ * while running ahead: transfers then just don't complete.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "serial.h"
+#include "hwdefs.h"
+
+#define serial_error(fmt, ...) \
+    do { \
+        printf("Serial link error: " fmt "\n", ##__VA_ARGS__); \
+        return 1; \
+    } while (0)
+
+/* How often live transports are polled for transfers of the other side. */
+#define SERIAL_POLL_CLKS 1024
+
+/* Pair: how far a side may get ahead of the other, and for how long after a
+ * transfer that is enforced. */
+#define SERIAL_PAIR_WINDOW_CLKS 4096
+#define SERIAL_PAIR_ACTIVE_CLKS 65536
+
+/* Messages of the unix transport: a type, a byte and the sequence number of
+ * the transfer, so replies to cancelled transfers can be told apart. */
+#define SERIAL_MSG_MASTER 'M' /* Started a transfer, with this byte. */
+#define SERIAL_MSG_SLAVE  'S' /* Reply to a transfer, with this byte. */
+
+struct serial_ops {
+    bool live; /* Talks to another process, can't run ahead. */
+    /* Starts a transfer with the internal clock. */
+    void (*send)(struct gb_state *s, u8 value);
+    /* Returns the byte shifted in by the transfer, or -1 if it hasn't
+     * arrived yet. */
+    int (*recv)(struct gb_state *s);
+    /* Handles transfers started by the other side, NULL if it can't. */
+    void (*poll)(struct gb_state *s);
+    /* Forgets the transfer started by send, which the game stopped before it
+     * completed. NULL if there is nothing to forget. */
+    void (*cancel)(struct gb_state *s);
+};
+
+/* A message of the pair transport: the byte with the sequence number of the
+ * transfer above it (see SERIAL_MSG_*), or -1 if there is none, and for
+ * SERIAL_PAIR_MASTER the time the transfer ends. */
+struct serial_pair_msg {
+    atomic_int value;
+    u64 end_cycles;
+};
+
+/*
+ * Shared by the two sides of a pair. Each side has a mailbox per message
+ * type. There is at most one message of each type in flight per side, a side
+ * only starts one transfer at a time and only replies to the one of the other
+ * side. The lock is only taken to post a message or to wait.
+ */
+struct serial_pair {
+    struct serial_pair_msg mailbox[2][2]; /* [side][SERIAL_PAIR_MASTER/SLAVE] */
+    atomic_ullong time_cycles[2]; /* Clock of each side, as last polled */
+    atomic_int waiting[2]; /* Side waits for the clock of the other */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool closed; /* One side went away */
+    int refs;
+};
+
+#define SERIAL_PAIR_MASTER 0
+#define SERIAL_PAIR_SLAVE  1
+
+struct serial_link {
+    /* unix */
+    int listen_fd; /* Waiting for the other side to connect, or -1. */
+    int fd; /* Connection to the other side, or -1. */
+    char *path; /* Socket to remove at the end, if created here. */
+    u8 msg[3]; /* Message being received */
+    int msg_len;
+
+    /* pair */
+    struct serial_pair *pair;
+    int side;
+    u64 active_until; /* Keep in lockstep until then (time_cycles). */
+
+    bool waiting; /* Sent the byte of a transfer, waiting for the reply. */
+    int reply; /* Byte received for the transfer, -1 if none. */
+    u8 seq; /* Of the last transfer started, its reply carries it too. */
+};
+
+static void serial_null_send(struct gb_state *s, u8 value) {
+    (void)s;
+    (void)value;
+}
+
+static int serial_null_recv(struct gb_state *s) {
+    (void)s;
+    return 0xff;
+}
+
+static void serial_capture_send(struct gb_state *s, u8 value) {
+    struct emu_state *es = s->emu_state;
+
+    if (es->serial_out_len < es->serial_out_size)
+        es->serial_out[es->serial_out_len++] = value;
+}
+
+static void serial_link_close(struct serial_link *l) {
+    close(l->fd);
+    l->fd = -1;
+    l->msg_len = 0;
+    if (l->waiting) { /* Unplugged */
+        l->waiting = 0;
+        l->reply = 0xff;
+    }
+}
+
+static void serial_link_write(struct serial_link *l, u8 type, u8 value,
+        u8 seq) {
+    u8 msg[3] = { type, value, seq };
+
+    if (send(l->fd, msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg))
+        serial_link_close(l);
+}
+
+/*
+ * The other side clocked a transfer, shifting in the given byte. Returns the
+ * byte shifted out. Our side only takes part if it started a transfer with the
+ * external clock.
+ */
+static u8 serial_receive(struct gb_state *s, u8 value) {
+    u8 out = s->io_serial_data;
+
+    if ((s->io_serial_control & 0x81) == 0x80) {
+        s->io_serial_data = value;
+        s->io_serial_control &= ~0x80;
+        s->interrupts_request |= 1 << 3;
+    }
+    return out;
+}
+
+/* Accepts the other side, and handles all messages it sent. */
+static void serial_link_process(struct gb_state *s) {
+    struct serial_link *l = s->emu_state->serial_link;
+
+    if (l->fd < 0 && l->listen_fd >= 0) {
+        l->fd = accept(l->listen_fd, NULL, NULL);
+        if (l->fd >= 0)
+            fcntl(l->fd, F_SETFL, O_NONBLOCK);
+    }
+
+    while (l->fd >= 0) {
+        ssize_t n = read(l->fd, l->msg + l->msg_len,
+                sizeof(l->msg) - l->msg_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            serial_link_close(l);
+            return;
+        }
+
+        l->msg_len += n;
+        if (l->msg_len < (int)sizeof(l->msg))
+            continue;
+        l->msg_len = 0;
+
+        if (l->msg[0] == SERIAL_MSG_MASTER)
+            serial_link_write(l, SERIAL_MSG_SLAVE,
+                    serial_receive(s, l->msg[1]), l->msg[2]);
+        else if (l->msg[0] == SERIAL_MSG_SLAVE && l->waiting &&
+                l->msg[2] == l->seq) {
+            l->waiting = 0;
+            l->reply = l->msg[1];
+        }
+    }
+}
+
+static void serial_link_send(struct gb_state *s, u8 value) {
+    struct serial_link *l = s->emu_state->serial_link;
+
+    l->reply = -1;
+    if (l->fd < 0) { /* Nothing connected */
+        l->reply = 0xff;
+        return;
+    }
+    l->waiting = 1;
+    serial_link_write(l, SERIAL_MSG_MASTER, value, ++l->seq);
+}
+
+/* The reply may still arrive, it is then ignored for its sequence number. */
+static void serial_link_cancel(struct gb_state *s) {
+    struct serial_link *l = s->emu_state->serial_link;
+
+    l->waiting = 0;
+    l->reply = -1;
+}
+
+static int serial_link_recv(struct gb_state *s) {
+    struct serial_link *l = s->emu_state->serial_link;
+
+    if (l->waiting)
+        serial_link_process(s);
+    if (l->waiting)
+        return -1;
+
+    /* Also when started before the link was set up. */
+    int reply = l->reply >= 0 ? l->reply : 0xff;
+    l->reply = -1;
+    return reply;
+}
+
+static void serial_pair_post(struct serial_pair *p, int side, int type,
+        int value, u64 end_cycles) {
+    struct serial_pair_msg *msg = &p->mailbox[side][type];
+
+    pthread_mutex_lock(&p->lock);
+    msg->end_cycles = end_cycles;
+    atomic_store(&msg->value, value);
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static bool serial_pair_pending(struct serial_pair *p, int side, int type) {
+    return atomic_load(&p->mailbox[side][type].value) >= 0;
+}
+
+/* Whether a transfer started by the other side has reached its end on our
+ * clock, so we have to reply to it. */
+static bool serial_pair_due(struct gb_state *s) {
+    struct serial_link *l = s->emu_state->serial_link;
+    struct serial_pair_msg *msg =
+        &l->pair->mailbox[l->side][SERIAL_PAIR_MASTER];
+
+    return atomic_load(&msg->value) >= 0 && s->time_cycles >= msg->end_cycles;
+}
+
+/* Replies to a transfer started by the other side, once our clock reaches its
+ * end. */
+static void serial_pair_reply(struct gb_state *s) {
+    struct serial_link *l = s->emu_state->serial_link;
+    struct serial_pair *p = l->pair;
+    struct serial_pair_msg *msg = &p->mailbox[l->side][SERIAL_PAIR_MASTER];
+
+    if (!serial_pair_due(s))
+        return;
+
+    int value = atomic_exchange(&msg->value, -1);
+    if (value < 0) /* Cancelled meanwhile */
+        return;
+    l->active_until = s->time_cycles + SERIAL_PAIR_ACTIVE_CLKS;
+    serial_pair_post(p, !l->side, SERIAL_PAIR_SLAVE,
+            (value & ~0xff) | serial_receive(s, value & 0xff), 0);
+}
+
+/* Publishes our clock, waking up the other side if it waits for it. */
+static void serial_pair_publish(struct gb_state *s) {
+    struct serial_link *l = s->emu_state->serial_link;
+    struct serial_pair *p = l->pair;
+
+    atomic_store(&p->time_cycles[l->side], s->time_cycles);
+    if (atomic_load(&p->waiting[!l->side])) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+static bool serial_pair_ahead(struct gb_state *s) {
+    struct serial_link *l = s->emu_state->serial_link;
+    struct serial_pair *p = l->pair;
+
+    return s->time_cycles > atomic_load(&p->time_cycles[!l->side]) +
+        SERIAL_PAIR_WINDOW_CLKS;
+}
+
+/* Polled every SERIAL_POLL_CLKS: replies to the other side, and waits for it
+ * while too far ahead during a transfer. */
+static void serial_pair_process(struct gb_state *s) {
+    struct serial_link *l = s->emu_state->serial_link;
+    struct serial_pair *p = l->pair;
+
+    serial_pair_publish(s);
+    serial_pair_reply(s);
+
+    if (!(s->io_serial_control & 0x80) && s->time_cycles >= l->active_until)
+        return;
+    if (!serial_pair_ahead(s))
+        return;
+
+    atomic_store(&p->waiting[l->side], 1);
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->closed && serial_pair_ahead(s) && !serial_pair_due(s))
+            pthread_cond_wait(&p->cond, &p->lock);
+        bool done = p->closed || !serial_pair_ahead(s);
+        pthread_mutex_unlock(&p->lock);
+
+        serial_pair_reply(s);
+        if (done)
+            break;
+    }
+    atomic_store(&p->waiting[l->side], 0);
+}
+
+static void serial_pair_send(struct gb_state *s, u8 value) {
+    struct serial_link *l = s->emu_state->serial_link;
+
+    l->waiting = 1;
+    l->active_until = s->time_cycles + SERIAL_PAIR_ACTIVE_CLKS;
+    serial_pair_post(l->pair, !l->side, SERIAL_PAIR_MASTER,
+            (++l->seq << 8) | value, s->serial_next_cycles);
+}
+
+/* Takes the transfer back if the other side didn't reply to it yet, else its
+ * reply is ignored for its sequence number. */
+static void serial_pair_cancel(struct gb_state *s) {
+    struct serial_link *l = s->emu_state->serial_link;
+    struct serial_pair *p = l->pair;
+
+    l->waiting = 0;
+    atomic_store(&p->mailbox[!l->side][SERIAL_PAIR_MASTER].value, -1);
+}
+
+/* Waits for the reply, meanwhile replying to the other side in case it started
+ * a transfer at the same time. */
+static int serial_pair_recv(struct gb_state *s) {
+    struct serial_link *l = s->emu_state->serial_link;
+    struct serial_pair *p = l->pair;
+
+    if (!l->waiting) /* Started before the link was set up */
+        return 0xff;
+
+    serial_pair_publish(s);
+    for (;;) {
+        serial_pair_reply(s);
+        int reply = atomic_exchange(
+                &p->mailbox[l->side][SERIAL_PAIR_SLAVE].value, -1);
+        if (reply >= 0 && (u8)(reply >> 8) == l->seq) {
+            l->waiting = 0;
+            return reply & 0xff;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        while (!p->closed && !serial_pair_due(s) &&
+                !serial_pair_pending(p, l->side, SERIAL_PAIR_SLAVE))
+            pthread_cond_wait(&p->cond, &p->lock);
+        bool closed = p->closed;
+        pthread_mutex_unlock(&p->lock);
+
+        if (closed) { /* Unplugged */
+            l->waiting = 0;
+            return 0xff;
+        }
+    }
+}
+
+static const struct serial_ops serial_ops_null =
+    { 0, serial_null_send, serial_null_recv, NULL, NULL };
+static const struct serial_ops serial_ops_capture =
+    { 0, serial_capture_send, serial_null_recv, NULL, NULL };
+static const struct serial_ops serial_ops_unix =
+    { 1, serial_link_send, serial_link_recv, serial_link_process,
+      serial_link_cancel };
+static const struct serial_ops serial_ops_pair =
+    { 1, serial_pair_send, serial_pair_recv, serial_pair_process,
+      serial_pair_cancel };
+
+static const struct serial_ops *serial_ops(struct gb_state *s) {
+    struct emu_state *es = s->emu_state;
+    return es->serial_ops ? es->serial_ops : &serial_ops_null;
+}
+
+/* Whether the transport can be used now (see the top of this file). */
+static bool serial_can_io(struct gb_state *s) {
+    return !serial_ops(s)->live || !s->emu_state->runahead_active;
+}
+
+static void serial_schedule_poll(struct gb_state *s) {
+    s->serial_next_cycles = serial_ops(s)->poll ?
+        s->time_cycles + SERIAL_POLL_CLKS : UINT64_MAX;
+}
+
+void serial_write_control(struct gb_state *s, u8 value) {
+    const struct serial_ops *ops = serial_ops(s);
+
+    /* Stopping or restarting a transfer in flight. */
+    if ((s->io_serial_control & 0x81) == 0x81 && serial_can_io(s) &&
+            ops->cancel)
+        ops->cancel(s);
+    s->io_serial_control = value;
+
+    if ((value & 0x81) != 0x81) { /* Not (or no longer) clocking a transfer */
+        serial_schedule_poll(s);
+        return;
+    }
+
+    int bit_clks = s->gb_type == GB_TYPE_CGB && (value & 0x02) ?
+        GB_SERIAL_FAST_BIT_CLKS : GB_SERIAL_BIT_CLKS;
+    s->serial_next_cycles = s->time_cycles +
+        ((8 * bit_clks) >> s->double_speed);
+
+    if (serial_can_io(s))
+        ops->send(s, s->io_serial_data);
+}
+
+/* Called by emu_step once time_cycles reaches serial_next_cycles. */
+void serial_step(struct gb_state *s) {
+    const struct serial_ops *ops = serial_ops(s);
+    bool can_io = serial_can_io(s);
+
+    if (can_io && ops->poll)
+        ops->poll(s);
+
+    if ((s->io_serial_control & 0x81) == 0x81) {
+        int value = can_io ? ops->recv(s) : -1;
+        if (value < 0) {
+            s->serial_next_cycles = s->time_cycles + SERIAL_POLL_CLKS;
+            return;
+        }
+        s->io_serial_data = value;
+        s->io_serial_control &= ~0x80;
+        s->interrupts_request |= 1 << 3;
+    }
+    serial_schedule_poll(s);
+}
+
+static struct serial_link *serial_link_new(void) {
+    struct serial_link *l = calloc(1, sizeof(struct serial_link));
+    if (!l)
+        return NULL;
+    l->listen_fd = -1;
+    l->fd = -1;
+    l->reply = -1;
+    return l;
+}
+
+/* Captures the first size bytes sent from now on into emu_state->serial_out,
+ * replacing the previous transport. Returns non-zero if the buffer can't be
+ * allocated. */
+int serial_capture(struct gb_state *s, size_t size) {
+    struct emu_state *es = s->emu_state;
+
+    serial_free(s);
+    es->serial_out = malloc(size);
+    if (!es->serial_out)
+        return 1;
+    es->serial_out_size = size;
+    es->serial_ops = &serial_ops_capture;
+    return 0;
+}
+
+/*
+ * Links to another instance over the UNIX socket at path, replacing the
+ * previous transport. Connects if the other instance is already listening
+ * there, otherwise listens for it to connect.
+ */
+int serial_link_unix(struct gb_state *s, const char *path) {
+    struct emu_state *es = s->emu_state;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        serial_error("Socket path \"%s\" too long", path);
+    strcpy(addr.sun_path, path);
+
+    serial_free(s);
+    struct serial_link *l = serial_link_new();
+    if (!l)
+        serial_error("Couldn't allocate link");
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        free(l);
+        serial_error("Couldn't create socket: %s", strerror(errno));
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        printf("Linked to \"%s\"\n", path);
+        l->fd = fd;
+    } else {
+        if (errno == ECONNREFUSED) /* Left over from an earlier run */
+            unlink(path);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+                listen(fd, 1)) {
+            int err = errno;
+            close(fd);
+            free(l);
+            serial_error("Couldn't listen on \"%s\": %s", path, strerror(err));
+        }
+        printf("Waiting for link on \"%s\"\n", path);
+        l->listen_fd = fd;
+        l->path = strdup(path);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    es->serial_link = l;
+    es->serial_ops = &serial_ops_unix;
+    if ((s->io_serial_control & 0x81) != 0x81)
+        serial_schedule_poll(s);
+    return 0;
+}
+
+/*
+ * Links two instances of this process, replacing their previous transports.
+ * Each has to run on its own thread, a transfer waits for the other side to
+ * reply (see the top of this file).
+ */
+int serial_link_pair(struct gb_state *a, struct gb_state *b) {
+    struct gb_state *sides[2] = { a, b };
+
+    struct serial_pair *p = calloc(1, sizeof(struct serial_pair));
+    if (!p)
+        serial_error("Couldn't allocate link");
+    for (int side = 0; side < 2; side++) {
+        atomic_init(&p->mailbox[side][SERIAL_PAIR_MASTER].value, -1);
+        atomic_init(&p->mailbox[side][SERIAL_PAIR_SLAVE].value, -1);
+        atomic_init(&p->time_cycles[side], sides[side]->time_cycles);
+        atomic_init(&p->waiting[side], 0);
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    for (int side = 0; side < 2; side++) {
+        struct gb_state *s = sides[side];
+        serial_free(s);
+        struct serial_link *l = serial_link_new();
+        if (!l) {
+            if (side)
+                serial_free(a);
+            else
+                free(p);
+            serial_error("Couldn't allocate link");
+        }
+        l->pair = p;
+        l->side = side;
+        p->refs++;
+
+        s->emu_state->serial_link = l;
+        s->emu_state->serial_ops = &serial_ops_pair;
+        if ((s->io_serial_control & 0x81) != 0x81)
+            serial_schedule_poll(s);
+    }
+    return 0;
+}
+
+/* Disconnects the transport, going back to null. */
+void serial_free(struct gb_state *s) {
+    struct emu_state *es = s->emu_state;
+    struct serial_link *l = es->serial_link;
+
+    if (l) {
+        if (l->fd >= 0)
+            close(l->fd);
+        if (l->listen_fd >= 0)
+            close(l->listen_fd);
+        if (l->path)
+            unlink(l->path);
+        free(l->path);
+
+        struct serial_pair *p = l->pair;
+        if (p) {
+            pthread_mutex_lock(&p->lock);
+            p->closed = 1;
+            pthread_cond_broadcast(&p->cond);
+            int refs = --p->refs;
+            pthread_mutex_unlock(&p->lock);
+            if (!refs) {
+                pthread_mutex_destroy(&p->lock);
+                pthread_cond_destroy(&p->cond);
+                free(p);
+            }
+        }
+
+        free(l);
+        es->serial_link = NULL;
+    }
+
+    free(es->serial_out);
+    es->serial_out = NULL;
+    es->serial_out_len = 0;
+    es->serial_out_size = 0;
+    es->serial_ops = NULL;
+}
@@ -0,0 +1,16 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stddef.h>
+
+#include "types.h"
+
+void serial_write_control(struct gb_state *s, u8 value);
+void serial_step(struct gb_state *s);
+
+int serial_capture(struct gb_state *s, size_t size);
+int serial_link_unix(struct gb_state *s, const char *path);
+int serial_link_pair(struct gb_state *a, struct gb_state *b);
+void serial_free(struct gb_state *s);
+
+#endif
@@ -0,0 +1,344 @@
+/*
+ * Standalone frontend using SDL2 (see sdl.c) for video, audio and input.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "hwdefs.h"
+#include "emu.h"
+#include "lcd.h"
+#include "audio.h"
+#include "debugger.h"
+#include "disassembler.h"
+#include "gui.h"
+#include "pacer.h"
+#include "tribuf.h"
+#include "serial.h"
+
+#define GUI_WINDOW_TITLE "KoenGB"
+#define GUI_ZOOM 4
+
+static void print_usage(char *progname) {
+    printf("Usage: %s [option]... rom\n\n", progname);
+    printf("GameBoy emulator by Koen Koning.\n\n");
+    printf("Options:\n");
+    printf(" -B, --break-start   Break into debugger before executing first "
+            "instruction.\n");
+    printf(" -D, --print-disas   Print every instruction before executing "
+            "it.\n");
+    printf(" -M, --print-mmu     Print every memory access.\n");
+    printf(" -b, --bios=FILE     Use the specified BIOS file.\n");
+    printf(" -l, --load-state=FILE\n");
+    printf("                     Load the specified state file.\n");
+    printf(" -S, --load-save=FILE\n");
+    printf("                     Load the specified save file (external "
+            "RAM).\n");
+    printf(" -A, --audio         Enable (experimental) audio.\n");
+    printf(" -c, --block-cache   Cache decoded blocks of hot ROM code.\n");
+    printf(" -r, --runahead=N    Show the state N frames ahead to hide input "
+            "lag.\n");
+    printf(" -L, --link=SOCKET   Link cable to the instance started with the "
+            "same\n");
+    printf("                     UNIX socket path.\n");
+    printf(" -P, --link-rom=ROM  Run a second instance with ROM, linked to the "
+            "first,\n");
+    printf("                     side by side (use a copy of the ROM for the "
+            "same game,\n");
+    printf("                     the save file is named after it).\n");
+    printf(" -h, --help          Print this help and exit.\n");
+}
+
+static int parse_args(int argc, char **argv, struct emu_args *args,
+        char **link_rom) {
+    static struct option long_options[] = {
+        {"break-start", no_argument,       NULL, 'B'},
+        {"print-disas", no_argument,       NULL, 'D'},
+        {"print-mmu",   no_argument,       NULL, 'M'},
+        {"bios",        required_argument, NULL, 'b'},
+        {"load-state",  required_argument, NULL, 'l'},
+        {"load-save",   required_argument, NULL, 'S'},
+        {"audio",       no_argument,       NULL, 'A'},
+        {"block-cache", no_argument,       NULL, 'c'},
+        {"runahead",    required_argument, NULL, 'r'},
+        {"link",        required_argument, NULL, 'L'},
+        {"link-rom",    required_argument, NULL, 'P'},
+        {"help",        no_argument,       NULL, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    memset(args, 0, sizeof(struct emu_args));
+    *link_rom = NULL;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "BDMb:l:S:Acr:L:P:h", long_options,
+                    NULL)) != -1) {
+        switch (opt) {
+        case 'B': args->break_at_start = 1; break;
+        case 'D': args->print_disas = 1; break;
+        case 'M': args->print_mmu = 1; break;
+        case 'b': args->bios_filename = optarg; break;
+        case 'l': args->state_filename = optarg; break;
+        case 'S': args->save_filename = optarg; break;
+        case 'A': args->audio_enable = 1; break;
+        case 'c': args->blockcache_enable = 1; break;
+        case 'r': args->runahead_frames = atoi(optarg); break;
+        case 'L': args->link_path = optarg; break;
+        case 'P': *link_rom = optarg; break;
+        case 'h':
+            print_usage(argv[0]);
+            exit(0);
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    args->rom_filename = argv[optind];
+    return 0;
+}
+
+/*
+ * Link mode: two instances connected by a link cable (serial_link_pair), each
+ * emulated and paced on its own thread. The main thread handles SDL and shows
+ * the newest frames of both side by side.
+ */
+struct link_instance {
+    struct gb_state gb_state;
+    struct pacer *pacer;
+    struct tribuf *frames; /* LCD pixels */
+    pthread_t thread;
+
+    /* Input from the main thread. Specials accumulate until the emulation
+     * thread takes them. */
+    pthread_mutex_t input_lock;
+    struct player_input input;
+};
+
+static atomic_int link_quit;
+
+static void *link_run(void *arg) {
+    struct link_instance *li = arg;
+    struct gb_state *s = &li->gb_state;
+    size_t frame_size = GB_LCD_WIDTH * GB_LCD_HEIGHT * sizeof(u16);
+
+    while (!atomic_load(&link_quit) && !s->emu_state->quit) {
+        pthread_mutex_lock(&li->input_lock);
+        struct player_input input = li->input;
+        li->input.special_savestate = 0;
+        li->input.special_dbgbreak = 0;
+        li->input.special_turbo = 0;
+        pthread_mutex_unlock(&li->input_lock);
+        emu_process_inputs(s, &input);
+
+        emu_step_frame(s);
+        memcpy(tribuf_back(li->frames), s->emu_state->lcd_pixbuf, frame_size);
+        tribuf_publish(li->frames);
+
+        pacer_set_fast_forward(li->pacer, s->emu_state->turbo_frames > 1);
+        pacer_wait(li->pacer);
+    }
+
+    /* Unplug the cable, so the other instance doesn't wait for this one. */
+    serial_free(s);
+    tribuf_close(li->frames);
+    return NULL;
+}
+
+static void link_set_input(struct link_instance *li,
+        struct player_input *input) {
+    pthread_mutex_lock(&li->input_lock);
+    bool savestate = li->input.special_savestate || input->special_savestate;
+    bool dbgbreak = li->input.special_dbgbreak || input->special_dbgbreak;
+    bool turbo = li->input.special_turbo || input->special_turbo;
+    li->input = *input;
+    li->input.special_quit = 0;
+    li->input.special_savestate = savestate;
+    li->input.special_dbgbreak = dbgbreak;
+    li->input.special_turbo = turbo;
+    pthread_mutex_unlock(&li->input_lock);
+}
+
+static int run_linked(struct emu_args *emu_args, char *link_rom) {
+    static struct link_instance insts[2];
+    struct emu_args emu_args2 = {
+        .rom_filename = link_rom,
+        .blockcache_enable = emu_args->blockcache_enable,
+    };
+    struct emu_args *args[2] = { emu_args, &emu_args2 };
+    int w = GB_LCD_WIDTH, h = GB_LCD_HEIGHT;
+
+    if (emu_args->audio_enable || emu_args->link_path)
+        printf("Audio and -L are not supported in link mode, ignored\n");
+    emu_args->audio_enable = 0;
+    emu_args->link_path = NULL;
+
+    for (int i = 0; i < 2; i++) {
+        struct link_instance *li = &insts[i];
+        if (emu_init(&li->gb_state, args[i])) {
+            fprintf(stderr, "Initialization of instance %d failed\n", i + 1);
+            return 1;
+        }
+        lcd_set_pixfmt(&li->gb_state, gui_lcd_color);
+        li->pacer = pacer_new(PACER_CLOCK, GB_LCD_FRAME_CLKS / (double)GB_FREQ);
+        li->frames = tribuf_new(w * h * sizeof(u16));
+        if (!li->pacer || !li->frames) {
+            fprintf(stderr, "Couldn't allocate frame buffers\n");
+            return 1;
+        }
+        pthread_mutex_init(&li->input_lock, NULL);
+    }
+    if (serial_link_pair(&insts[0].gb_state, &insts[1].gb_state))
+        return 1;
+
+    if (gui_lcd_init(2 * w, h, GUI_ZOOM, GUI_WINDOW_TITLE)) {
+        fprintf(stderr, "Couldn't initialize GUI LCD\n");
+        return 1;
+    }
+    u16 *screen = malloc(2 * w * h * sizeof(u16));
+    if (!screen) {
+        fprintf(stderr, "Couldn't allocate screen\n");
+        return 1;
+    }
+
+    for (int i = 0; i < 2; i++)
+        pthread_create(&insts[i].thread, NULL, link_run, &insts[i]);
+
+    /* Both players share the keyboard, see gui_input_poll2. */
+    struct player_input input[2];
+    memset(input, 0, sizeof(input));
+
+    for (;;) {
+        gui_input_poll2(&input[0], &input[1]);
+        if (input[0].special_quit)
+            break;
+        input[1].special_turbo = input[0].special_turbo;
+        for (int i = 0; i < 2; i++)
+            link_set_input(&insts[i], &input[i]);
+
+        u16 *frame0 = tribuf_wait(insts[0].frames);
+        u16 *frame1 = tribuf_wait(insts[1].frames);
+        if (!frame0 || !frame1)
+            break;
+        for (int y = 0; y < h; y++) {
+            memcpy(screen + y * 2 * w, frame0 + y * w, w * sizeof(u16));
+            memcpy(screen + y * 2 * w + w, frame1 + y * w, w * sizeof(u16));
+        }
+        gui_lcd_render_frame(insts[0].gb_state.gb_type == GB_TYPE_CGB, screen,
+                NULL);
+    }
+
+    atomic_store(&link_quit, 1);
+    for (int i = 0; i < 2; i++) {
+        struct link_instance *li = &insts[i];
+        pthread_join(li->thread, NULL);
+
+        struct gb_state *s = &li->gb_state;
+        if (s->emu_state->extram_dirty)
+            emu_save(s, 1, s->emu_state->save_filename_out);
+        printf("Instance %d:\n", i + 1);
+        pacer_print_stats(li->pacer);
+
+        pacer_free(li->pacer);
+        tribuf_free(li->frames);
+        pthread_mutex_destroy(&li->input_lock);
+        emu_free(s);
+    }
+    free(screen);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static struct gb_state gb_state;
+    struct emu_args emu_args;
+    char *link_rom;
+
+    if (parse_args(argc, argv, &emu_args, &link_rom))
+        return 1;
+
+    if (link_rom)
+        return run_linked(&emu_args, link_rom);
+
+    if (emu_init(&gb_state, &emu_args)) {
+        fprintf(stderr, "Initialization failed\n");
+        return 1;
+    }
+    lcd_set_pixfmt(&gb_state, gui_lcd_color);
+
+    /* Initialize frontend-specific GUI */
+    if (gui_lcd_init(GB_LCD_WIDTH, GB_LCD_HEIGHT, GUI_ZOOM, GUI_WINDOW_TITLE)) {
+        fprintf(stderr, "Couldn't initialize GUI LCD\n");
+        return 1;
+    }
+    if (emu_args.audio_enable) {
+        if (gui_audio_init(AUDIO_SAMPLE_RATE, AUDIO_CHANNELS, AUDIO_SNDBUF_SIZE,
+                    gb_state.emu_state->audio_sndbuf)) {
+            fprintf(stderr, "Couldn't initialize GUI audio\n");
+            return 1;
+        }
+    }
+
+    /* SDL pulls audio from a callback, so the clock paces the frames. */
+    struct pacer *pacer = pacer_new(PACER_CLOCK,
+            GB_LCD_FRAME_CLKS / (double)GB_FREQ);
+    if (!pacer) {
+        fprintf(stderr, "Couldn't allocate frame pacer\n");
+        return 1;
+    }
+
+    printf("==========================\n");
+    printf("=== Starting execution ===\n");
+    printf("==========================\n\n");
+
+    /* SDL reports key presses and releases, so the input state is kept. */
+    struct player_input input_state;
+    memset(&input_state, 0, sizeof(struct player_input));
+
+    uint64_t start_ns = pacer_now_ns();
+    while (!gb_state.emu_state->quit) {
+        gui_input_poll(&input_state);
+        uint64_t input_ns = pacer_now_ns();
+        emu_process_inputs(&gb_state, &input_state);
+
+        emu_step_frame(&gb_state);
+
+        int turbo = gb_state.emu_state->turbo_frames > 1;
+        pacer_set_fast_forward(pacer, turbo);
+
+        gui_lcd_render_frame(gb_state.gb_type == GB_TYPE_CGB,
+                gb_state.emu_state->lcd_pixbuf, NULL);
+        pacer_presented(pacer, input_ns);
+
+        if (gb_state.emu_state->audio_enable) /* TODO */
+            audio_update(&gb_state);
+
+        pacer_wait(pacer);
+    }
+
+    if (gb_state.emu_state->extram_dirty)
+        emu_save(&gb_state, 1, gb_state.emu_state->save_filename_out);
+
+    double exectime = (pacer_now_ns() - start_ns) / 1e9;
+    double emulated_secs = gb_state.time_cycles / (double)GB_FREQ;
+
+    printf("\nEmulation ended at instr: ");
+    disassemble(&gb_state);
+    dbg_print_regs(&gb_state);
+
+    printf("\nEmulated %f sec in %f sec WCT, %.0f%%.\n", emulated_secs, exectime,
+            emulated_secs / exectime * 100);
+    pacer_print_stats(pacer);
+    pacer_free(pacer);
+    emu_free(&gb_state);
+
+    return 0;
+}
@@ -5,6 +5,10 @@
 
 #include "state.h"
 #include "hwdefs.h"
+#include "rtc.h"
+#include "cpu.h"
+#include "lcd.h"
+#include "audio.h"
 
 #define err(fmt, ...) \
     do { \
@@ -93,10 +97,11 @@ void print_rom_header_info(u8* rom) {
 
 struct rominfo {
     enum gb_type gb_type;
-    int mbc;
+    enum gb_mbc mbc;
     char has_extram:1;
     char has_battery:1;
     char has_rtc:1;
+    char has_rumble:1;
     int num_rom_banks;
     int num_wram_banks;
     int num_extram_banks;
@@ -104,6 +109,13 @@ struct rominfo {
 };
 
 
+static int rom_header_valid(u8 *hdr) {
+    u8 sum = 0;
+    for (unsigned i = ROMHDR_TITLE; i < ROMHDR_CHECKSUM; i++)
+        sum = sum - hdr[i] - 1;
+    return sum == hdr[ROMHDR_CHECKSUM];
+}
+
 int rom_get_info(u8 *rom, size_t rom_size, struct rominfo *ret_rominfo) {
 
     /* Cart info from header */
@@ -112,16 +124,26 @@ int rom_get_info(u8 *rom, size_t rom_size, struct rominfo *ret_rominfo) {
             ROMHDR_EXTRAMSIZE >= rom_size)
         err("Given ROM too small to read header fields (%zu)", rom_size);
 
+    /* MMM01 carts boot into a menu in the last 32K, which has the header
+     * describing the whole cartridge. */
+    if (rom_size > 0x8000) {
+        u8 *menu = &rom[rom_size - 0x8000];
+        if (menu[ROMHDR_CARTTYPE] >= 0x0b && menu[ROMHDR_CARTTYPE] <= 0x0d &&
+                rom_header_valid(menu))
+            rom = menu;
+    }
+
     u8 hdr_cart_type = rom[ROMHDR_CARTTYPE];
     u8 hdr_rom_size = rom[ROMHDR_ROMSIZE];
     u8 hdr_extram_size = rom[ROMHDR_EXTRAMSIZE];
     u8 hdr_cgb_flag = rom[ROMHDR_CGBFLAG];
 
     enum gb_type rom_gb_type;
-    int mbc = 0; /* Memory Bank Controller */
+    enum gb_mbc mbc = MBC_NONE; /* Memory Bank Controller */
     int extram = 0;
     int battery = 0;
     int rtc = 0; /* Real time clock */
+    int rumble = 0;
     int rom_banks = 0;
     int extram_banks = 0;
     int wram_banks = 0;
@@ -133,34 +155,34 @@ int rom_get_info(u8 *rom, size_t rom_size, struct rominfo *ret_rominfo) {
         rom_gb_type = GB_TYPE_GB;
 
     switch (hdr_cart_type) {
-    case 0x00:                                              break;
-    case 0x01: mbc = 1;                                     break;
-    case 0x02: mbc = 1; extram = 1;                         break;
-    case 0x03: mbc = 1; extram = 1; battery = 1;            break;
-    case 0x05: mbc = 2;                                     break;
-    case 0x06: mbc = 2;             battery = 1;            break;
-    case 0x08:          extram = 1;                         break;
-    case 0x09:          extram = 1; battery = 1;            break;
-    case 0x0f: mbc = 3;             battery = 1; rtc = 1;   break;
-    case 0x10: mbc = 3; extram = 1; battery = 1; rtc = 1;   break;
-    case 0x11: mbc = 3;                                     break;
-    case 0x12: mbc = 3; extram = 1;                         break;
-    case 0x13: mbc = 3; extram = 1; battery = 1;            break;
-    case 0x15: mbc = 4;                                     break;
-    case 0x16: mbc = 4; extram = 1;                         break;
-    case 0x17: mbc = 4; extram = 1; battery = 1;            break;
-    case 0x19: mbc = 5;                                     break;
-    case 0x1a: mbc = 5; extram = 1;                         break;
-    case 0x1b: mbc = 5; extram = 1; battery = 1;            break;
-    case 0x1c: mbc = 5;                                     break; /* rumble */
-    case 0x1d: mbc = 5; extram = 1;                         break; /* rumble */
-    case 0x1e: mbc = 5; extram = 1; battery = 1;            break; /* rumble */
-    case 0x20: mbc = 6;                                     break;
-    /* MMM01 unsupported */
-    /* MBC7 Sensor not supported */
-    /* Camera not supported */
+    case 0x00:                                                          break;
+    case 0x01: mbc = MBC_1;                                             break;
+    case 0x02: mbc = MBC_1;      extram = 1;                            break;
+    case 0x03: mbc = MBC_1;      extram = 1; battery = 1;               break;
+    case 0x05: mbc = MBC_2;      extram = 1;                            break;
+    case 0x06: mbc = MBC_2;      extram = 1; battery = 1;               break;
+    case 0x08:                   extram = 1;                            break;
+    case 0x09:                   extram = 1; battery = 1;               break;
+    case 0x0b: mbc = MBC_MMM01;                                         break;
+    case 0x0c: mbc = MBC_MMM01;  extram = 1;                            break;
+    case 0x0d: mbc = MBC_MMM01;  extram = 1; battery = 1;               break;
+    case 0x0f: mbc = MBC_3;                  battery = 1; rtc = 1;      break;
+    case 0x10: mbc = MBC_3;      extram = 1; battery = 1; rtc = 1;      break;
+    case 0x11: mbc = MBC_3;                                             break;
+    case 0x12: mbc = MBC_3;      extram = 1;                            break;
+    case 0x13: mbc = MBC_3;      extram = 1; battery = 1;               break;
+    case 0x19: mbc = MBC_5;                                             break;
+    case 0x1a: mbc = MBC_5;      extram = 1;                            break;
+    case 0x1b: mbc = MBC_5;      extram = 1; battery = 1;               break;
+    case 0x1c: mbc = MBC_5;                               rumble = 1;   break;
+    case 0x1d: mbc = MBC_5;      extram = 1;              rumble = 1;   break;
+    case 0x1e: mbc = MBC_5;      extram = 1; battery = 1; rumble = 1;   break;
+    case 0x20: mbc = MBC_6;      extram = 1; battery = 1;               break;
+    case 0x22: mbc = MBC_7;      extram = 1; battery = 1; rumble = 1;   break;
+    case 0xfc: mbc = MBC_CAMERA; extram = 1; battery = 1;               break;
+    case 0xfe: mbc = MBC_HUC3;   extram = 1; battery = 1;               break;
+    case 0xff: mbc = MBC_HUC1;   extram = 1; battery = 1;               break;
     /* Bandai TAMA5 not supported */
-    /* HuCn not supported */
     default:
         err("Unsupported cartridge type: %x", hdr_cart_type);
     }
@@ -193,8 +215,15 @@ int rom_get_info(u8 *rom, size_t rom_size, struct rominfo *ret_rominfo) {
         err("Unsupported EXT_RAM size: %x", hdr_extram_size);
     }
 
-    assert((extram == 0 && extram_banks == 0) ||
-           (extram == 1 && extram_banks > 0));
+    /* MBC2 (512x4 bits) and MBC7 (256 byte EEPROM) have their RAM built in,
+     * which isn't listed in the header. */
+    if (mbc == MBC_2 || mbc == MBC_7)
+        extram_banks = 1;
+
+    if (!extram)
+        extram_banks = 0;
+    else if (!extram_banks)
+        err("Cartridge type %x has RAM, but no RAM size given", hdr_cart_type);
 
     if (rom_gb_type == GB_TYPE_GB) {
         wram_banks = 2;
@@ -210,6 +239,7 @@ int rom_get_info(u8 *rom, size_t rom_size, struct rominfo *ret_rominfo) {
     ret_rominfo->has_extram = extram;
     ret_rominfo->has_battery = battery;
     ret_rominfo->has_rtc = rtc;
+    ret_rominfo->has_rumble = rumble;
     ret_rominfo->num_rom_banks = rom_banks;
     ret_rominfo->num_wram_banks = wram_banks;
     ret_rominfo->num_extram_banks = extram_banks;
@@ -219,6 +249,66 @@ int rom_get_info(u8 *rom, size_t rom_size, struct rominfo *ret_rominfo) {
     return 0;
 }
 
+/* Alignment of everything in the arena, a cache line. */
+#define STATE_ARENA_ALIGN 64
+
+static size_t state_arena_align(size_t size) {
+    return (size + STATE_ARENA_ALIGN - 1) & ~(size_t)(STATE_ARENA_ALIGN - 1);
+}
+
+/*
+ * Allocates the arena holding all mutable memory of the instance, for the
+ * number of banks in the state. The emulated state comes first (emu_state,
+ * WRAM, VRAM, EXTRAM) so a snapshot is one copy. The caches of the CPU, LCD and
+ * audio follow, their init functions take them with state_arena_alloc. ROM and
+ * BIOS are allocated separately since they never change.
+ */
+static int state_alloc_arena(struct gb_state *s) {
+    size_t wram_size = WRAM_BANKSIZE * s->mem_num_banks_wram;
+    size_t vram_size = VRAM_BANKSIZE * s->mem_num_banks_vram;
+    size_t extram_size = EXTRAM_BANKSIZE * s->mem_num_banks_extram;
+    size_t size = state_arena_align(sizeof(struct emu_state)) +
+        state_arena_align(wram_size) + state_arena_align(vram_size) +
+        state_arena_align(extram_size) +
+        state_arena_align(cpu_arena_size()) +
+        state_arena_align(lcd_arena_size()) +
+        state_arena_align(audio_arena_size());
+
+    void *arena;
+    if (posix_memalign(&arena, STATE_ARENA_ALIGN, size))
+        err("Couldn't allocate %zu bytes of memory", size);
+    memset(arena, 0, size);
+    s->mem_arena = arena;
+    s->mem_arena_size = size;
+    s->mem_arena_used = 0;
+
+    s->emu_state = state_arena_alloc(s, sizeof(struct emu_state));
+    s->mem_WRAM = state_arena_alloc(s, wram_size);
+    s->mem_VRAM = state_arena_alloc(s, vram_size);
+    s->mem_EXTRAM = extram_size ? state_arena_alloc(s, extram_size) : NULL;
+    s->mem_arena_snap_size = s->mem_arena_used;
+    return 0;
+}
+
+/* Takes zeroed memory from the arena, NULL if it wasn't sized for it. */
+void *state_arena_alloc(struct gb_state *s, size_t size) {
+    size = state_arena_align(size);
+    if (s->mem_arena_used + size > s->mem_arena_size)
+        return NULL;
+    void *ret = s->mem_arena + s->mem_arena_used;
+    s->mem_arena_used += size;
+    return ret;
+}
+
+/* Frees the memory of the instance (but not the block cache). */
+void state_free(struct gb_state *s) {
+    free(s->mem_ROM);
+    free(s->mem_BIOS);
+    free(s->mem_arena);
+    s->mem_ROM = s->mem_BIOS = s->mem_arena = NULL;
+    s->emu_state = NULL;
+}
+
 int state_new_from_rom(struct gb_state *s, u8 *rom, size_t rom_size) {
 
 
@@ -234,22 +324,18 @@ int state_new_from_rom(struct gb_state *s, u8 *rom, size_t rom_size) {
     s->has_extram = rominfo.has_extram;
     s->has_battery = rominfo.has_battery;
     s->has_rtc = rominfo.has_rtc;
+    s->has_rumble = rominfo.has_rumble;
 
     s->mem_num_banks_rom = rominfo.num_rom_banks;
     s->mem_num_banks_wram = rominfo.num_wram_banks;
     s->mem_num_banks_extram = rominfo.num_extram_banks;
     s->mem_num_banks_vram = rominfo.num_vram_banks;
 
-    s->mem_ROM = NULL;
-    s->mem_WRAM = NULL;
-    s->mem_EXTRAM = NULL;
-    s->mem_VRAM = NULL;
-
     s->mem_ROM = malloc(ROM_BANKSIZE * s->mem_num_banks_rom);
-    s->mem_WRAM = malloc(WRAM_BANKSIZE * s->mem_num_banks_wram);
-    if (s->mem_num_banks_extram)
-        s->mem_EXTRAM = malloc(EXTRAM_BANKSIZE * s->mem_num_banks_extram);
-    s->mem_VRAM = malloc(VRAM_BANKSIZE * s->mem_num_banks_vram);
+    if (!s->mem_ROM)
+        err("Couldn't allocate ROM");
+    if (state_alloc_arena(s))
+        return 1;
 
     memset(s->mem_ROM, 0, ROM_BANKSIZE * s->mem_num_banks_rom);
     memcpy(s->mem_ROM, rom, rom_size);
@@ -274,8 +360,10 @@ void state_add_bios(struct gb_state *s, u8 *bios, size_t bios_size) {
  * emulator, not the state of the emulated hardware.
  */
 void init_emu_state(struct gb_state *s) {
-    s->emu_state = calloc(1, sizeof(struct emu_state));
+    memset(s->emu_state, 0, sizeof(struct emu_state));
     s->emu_state->dbg_breakpoint = 0xffff;
+    s->emu_state->turbo_frames = 1;
+    s->emu_state->input_next_cycles = UINT64_MAX;
 }
 
 /*
@@ -325,8 +413,8 @@ int state_save(struct gb_state *s, u8 **ret_state_buf, size_t *ret_state_size) {
  * of the state is not compatible with the program (different sizes of `struct
  * gb_state`).
  *
- * This function allocates memory for the underlying buffers of the `struct
- * gb_state` that form the memory of the gameboy (ROM, WRAM, EXT_RAM, VRAM).
+ * This function allocates memory for the ROM and the arena holding the other
+ * memory of the gameboy (WRAM, EXT_RAM, VRAM).
  */
 int state_load(struct gb_state *s, u8 *state_buf, size_t state_buf_size) {
     assert(state_buf_size >= sizeof(u32));
@@ -342,32 +430,34 @@ int state_load(struct gb_state *s, u8 *state_buf, size_t state_buf_size) {
 
     struct gb_state *fs = (struct gb_state*)(&state_hdr[1]);
     *s = *fs;
+    s->mem_BIOS = NULL;
 
     size_t romsize = ROM_BANKSIZE * s->mem_num_banks_rom;
     assert(state_buf_size >= romsize);
     state_buf_size -= romsize;
     s->mem_ROM = malloc(romsize);
+    if (!s->mem_ROM)
+        err("Couldn't allocate ROM");
+    if (state_alloc_arena(s))
+        return 1;
     u8 *romstart = (u8*)(fs + 1);
     memcpy(s->mem_ROM, romstart, romsize);
 
     size_t wramsize = WRAM_BANKSIZE * s->mem_num_banks_wram;
     assert(state_buf_size >= wramsize);
     state_buf_size -= wramsize;
-    s->mem_WRAM = malloc(wramsize);
     u8 *wramstart = romstart + romsize;
     memcpy(s->mem_WRAM, wramstart, wramsize);
 
     size_t extramsize = EXTRAM_BANKSIZE * s->mem_num_banks_extram;
     assert(state_buf_size >= extramsize);
     state_buf_size -= extramsize;
-    s->mem_EXTRAM = malloc(extramsize);
     u8 *extramstart = wramstart + wramsize;
     memcpy(s->mem_EXTRAM, extramstart, extramsize);
 
     size_t vramsize = VRAM_BANKSIZE * s->mem_num_banks_vram;
     assert(state_buf_size >= vramsize);
     state_buf_size -= vramsize;
-    s->mem_VRAM = malloc(vramsize);
     u8 *vramstart = extramstart + extramsize;
     memcpy(s->mem_VRAM, vramstart, vramsize);
 
@@ -380,19 +470,69 @@ int state_load(struct gb_state *s, u8 *state_buf, size_t state_buf_size) {
 int state_save_extram(struct gb_state *s, u8 **ret_state_buf,
         size_t *ret_state_size) {
     size_t extramsize = s->mem_num_banks_extram * EXTRAM_BANKSIZE;
-    *ret_state_buf = malloc(extramsize);
+    size_t rtcsize = s->has_rtc ? RTC_SAVE_SIZE : 0;
+    *ret_state_buf = malloc(extramsize + rtcsize);
     memcpy(*ret_state_buf, s->mem_EXTRAM, extramsize);
-    *ret_state_size = extramsize;
+    if (s->has_rtc)
+        rtc_save(s, *ret_state_buf + extramsize);
+    *ret_state_size = extramsize + rtcsize;
     return 0;
 }
 
 int state_load_extram(struct gb_state *s, u8 *state_buf,
         size_t state_buf_size) {
     size_t extramsize = s->mem_num_banks_extram * EXTRAM_BANKSIZE;
-    if (state_buf_size != extramsize)
+    if (state_buf_size < extramsize)
         err("Mismatch in size, save has size %zu, emulator %zu bytes",
                 state_buf_size, extramsize);
 
-    memcpy(s->mem_EXTRAM, state_buf, state_buf_size);
+    /* Optionally followed by the RTC. */
+    if (state_buf_size > extramsize) {
+        if (!s->has_rtc || rtc_load(s, state_buf + extramsize,
+                    state_buf_size - extramsize))
+            err("Mismatch in size, save has size %zu, emulator %zu bytes",
+                    state_buf_size, extramsize);
+    }
+
+    memcpy(s->mem_EXTRAM, state_buf, extramsize);
     return 0;
 }
+
+struct state_snapshot {
+    struct gb_state gb;
+    size_t size;
+    u8 mem[]; /* Start of the arena */
+};
+
+struct state_snapshot *state_snapshot_new(struct gb_state *s) {
+    struct state_snapshot *snap = malloc(sizeof(*snap) + s->mem_arena_snap_size);
+    if (!snap)
+        return NULL;
+    snap->size = s->mem_arena_snap_size;
+    return snap;
+}
+
+void state_snapshot_free(struct state_snapshot *snap) {
+    free(snap);
+}
+
+/*
+ * Copies the state that emulation can change: the hardware state (including
+ * OAM and HRAM), and the start of the arena with the emulator state (clock,
+ * queued inputs) and the RAMs. ROM, the caches of the LCD and the block cache
+ * are left alone, so a snapshot is only valid for the instance it was taken
+ * from.
+ */
+void state_snapshot_take(struct gb_state *s, struct state_snapshot *snap) {
+    snap->gb = *s;
+    memcpy(snap->mem, s->mem_arena, snap->size);
+}
+
+void state_snapshot_restore(struct gb_state *s, struct state_snapshot *snap) {
+    *s = snap->gb;
+    memcpy(s->mem_arena, snap->mem, snap->size);
+
+    /* The LCD caches may have been updated for the state rolled back. */
+    s->emu_state->lcd_oam_dirty = 1;
+    lcd_update_palettes(s);
+}
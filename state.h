@@ -7,6 +7,8 @@ void print_rom_header_info(u8* rom);
 int state_new_from_rom(struct gb_state *s, u8 *rom, size_t rom_size);
 void state_add_bios(struct gb_state *s, u8 *bios, size_t bios_size);
 void init_emu_state(struct gb_state *s);
+void *state_arena_alloc(struct gb_state *s, size_t size);
+void state_free(struct gb_state *s);
 
 /* Store/load dump of entire state (breaks when datastructures change). */
 int state_save(struct gb_state *s, u8 **ret_state_buf, size_t *ret_state_size);
@@ -17,4 +19,14 @@ int state_save_extram(struct gb_state *s, u8 **ret_state_buf,
         size_t *ret_state_size);
 int state_load_extram(struct gb_state *s, u8 *state_buf, size_t state_buf_size);
 
+/* In-memory snapshot of the emulated state of one instance, for rolling back
+ * (run-ahead). Allocated once, taking and restoring it is a copy of gb_state and
+ * of the start of the arena. */
+struct state_snapshot;
+
+struct state_snapshot *state_snapshot_new(struct gb_state *s);
+void state_snapshot_free(struct state_snapshot *snap);
+void state_snapshot_take(struct gb_state *s, struct state_snapshot *snap);
+void state_snapshot_restore(struct gb_state *s, struct state_snapshot *snap);
+
 #endif
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "tribuf.h"
+
+/* Set in the middle index when it holds a frame not yet taken. */
+#define TRIBUF_FRESH 4
+
+struct tribuf {
+    void *bufs[3];
+    atomic_int middle;
+    int back; /* Only touched by the producer */
+    int front; /* Only touched by the consumer */
+
+    /* Only to sleep while there is nothing to consume, buffers are swapped
+     * without holding it. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int closed;
+};
+
+struct tribuf *tribuf_new(size_t buf_size) {
+    struct tribuf *tb = calloc(1, sizeof(struct tribuf));
+    if (!tb)
+        return NULL;
+    for (int i = 0; i < 3; i++) {
+        tb->bufs[i] = calloc(1, buf_size);
+        if (!tb->bufs[i]) {
+            tribuf_free(tb);
+            return NULL;
+        }
+    }
+    tb->back = 0;
+    atomic_init(&tb->middle, 1);
+    tb->front = 2;
+    pthread_mutex_init(&tb->lock, NULL);
+    pthread_cond_init(&tb->cond, NULL);
+    return tb;
+}
+
+void tribuf_free(struct tribuf *tb) {
+    if (!tb)
+        return;
+    for (int i = 0; i < 3; i++)
+        free(tb->bufs[i]);
+    pthread_mutex_destroy(&tb->lock);
+    pthread_cond_destroy(&tb->cond);
+    free(tb);
+}
+
+/* Buffer the producer can fill with the next frame. */
+void *tribuf_back(struct tribuf *tb) {
+    return tb->bufs[tb->back];
+}
+
+/* Makes the back buffer the newest frame, and takes the previous middle buffer
+ * (consumed or not) as the new back buffer. */
+void tribuf_publish(struct tribuf *tb) {
+    int old = atomic_exchange_explicit(&tb->middle, tb->back | TRIBUF_FRESH,
+            memory_order_acq_rel);
+    tb->back = old & ~TRIBUF_FRESH;
+
+    pthread_mutex_lock(&tb->lock);
+    pthread_cond_signal(&tb->cond);
+    pthread_mutex_unlock(&tb->lock);
+}
+
+/* Waits for a frame newer than the last one returned, and returns it. The
+ * buffer stays valid until the next call. Returns NULL once closed. */
+void *tribuf_wait(struct tribuf *tb) {
+    pthread_mutex_lock(&tb->lock);
+    while (!tb->closed &&
+            !(atomic_load_explicit(&tb->middle, memory_order_acquire) &
+                TRIBUF_FRESH))
+        pthread_cond_wait(&tb->cond, &tb->lock);
+    int closed = tb->closed;
+    pthread_mutex_unlock(&tb->lock);
+    if (closed)
+        return NULL;
+
+    int old = atomic_exchange_explicit(&tb->middle, tb->front,
+            memory_order_acq_rel);
+    tb->front = old & ~TRIBUF_FRESH;
+    return tb->bufs[tb->front];
+}
+
+/* Wakes up the consumer to stop. */
+void tribuf_close(struct tribuf *tb) {
+    pthread_mutex_lock(&tb->lock);
+    tb->closed = 1;
+    pthread_cond_signal(&tb->cond);
+    pthread_mutex_unlock(&tb->lock);
+}
@@ -0,0 +1,24 @@
+#ifndef TRIBUF_H
+#define TRIBUF_H
+
+#include <stddef.h>
+
+/*
+ * Triple buffer to hand frames from the emulation thread to a presentation
+ * thread. The producer fills the back buffer and publishes it, the consumer
+ * takes the newest published buffer. Both swap their buffer with the middle one
+ * atomically, so neither ever waits for the other to finish with a buffer.
+ * Frames published faster than they are consumed are dropped.
+ */
+struct tribuf;
+
+struct tribuf *tribuf_new(size_t buf_size);
+void tribuf_free(struct tribuf *tb);
+
+void *tribuf_back(struct tribuf *tb);
+void tribuf_publish(struct tribuf *tb);
+
+void *tribuf_wait(struct tribuf *tb);
+void tribuf_close(struct tribuf *tb);
+
+#endif
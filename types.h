@@ -1,9 +1,12 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "player_input.h"
+
 typedef uint8_t  u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
@@ -19,45 +22,132 @@ typedef int64_t s64;
 #define FLAG_N 0x40
 #define FLAG_Z 0x80
 
-/* State of the emulator itself, not of the hardware. */
-struct emu_state {
-    bool quit;
-    bool make_savestate;
+#define EMU_INPUT_QUEUE_LEN 8
 
-    bool audio_enable;
-    u8 *audio_sndbuf;
+/* Input to apply once the emulation reaches the given time. */
+struct emu_input_event {
+    u64 time_cycles;
+    struct player_input input;
+};
 
+/*
+ * State of the emulator itself, not of the hardware. Fields checked on every
+ * step come first.
+ */
+struct emu_state {
     bool lcd_entered_hblank; /* Set at the end of every HBlank. */
     bool lcd_entered_vblank; /* Set at the beginning of every VBlank. */
-    u16 *lcd_pixbuf; /* 2-bit or 15-bit color per pixel. */
-
-    bool flush_extram; /* Flush battery-backed RAM when it's disabled. */
-    bool extram_dirty; /* Write battery-backed RAM periodically when dirty. */
+    bool lcd_oam_dirty; /* OAM was written, objects need to be re-indexed. */
+    bool lcd_skip_render; /* Frame won't be shown, don't draw any lines. */
 
     bool dbg_break_next;
     bool dbg_print_disas;
     bool dbg_print_mmu;
     u16 dbg_breakpoint;
 
-    u32 last_op_cycles; /* The duration of the last intruction. Normally just
-                           the CPU executing the instruction, but the MMU could
-                           take longer in the case of some DMA ops. */
-    u32 time_cycles;
-    u32 time_seconds;
+    bool quit;
+    bool make_savestate;
+    bool flush_extram; /* Flush battery-backed RAM when it's disabled. */
+    bool extram_dirty; /* Write battery-backed RAM periodically when dirty. */
+    bool runahead_active;
+
+    /* Inputs queued by the frontend, sorted by time. input_next_cycles is the
+     * time of the first one, or UINT64_MAX if there are none. */
+    u64 input_next_cycles;
+    int input_queue_len;
+    struct emu_input_event input_queue[EMU_INPUT_QUEUE_LEN];
+
+    /* Idle loop detection: registers at the previous backward branch. Kept
+     * here so it is part of snapshots, skipping depends on it. */
+    u16 idle_loop_target;
+    u16 idle_loop_regs[5];
+
+    u16 *lcd_pixbuf; /* 2-bit or 15-bit color per pixel. */
+
+    bool audio_enable;
+    u8 *audio_sndbuf;
+
+    int turbo_frames; /* Frames run per emu_step_frame, 1 when not in turbo. */
+
+    /* Other side of the serial port (see serial.c), NULL if nothing is
+     * connected. */
+    const struct serial_ops *serial_ops;
+    struct serial_link *serial_link;
 
-    char state_filename_out[1024];
-    char save_filename_out[1024];
+    /* Bytes sent over the serial port, if captured (see serial_capture). */
+    u8 *serial_out;
+    size_t serial_out_len;
+    size_t serial_out_size;
+
+    /* Frames emulated (and rolled back) after every frame to show a later one,
+     * hiding the input lag of the game. */
+    int runahead_frames;
+    struct state_snapshot *runahead_snap;
+
+    char *state_filename_out;
+    char *save_filename_out;
 };
 
 /* State of the cpu part of the emulation, not of the hardware. */
 struct emu_cpu_state;
 
+/* Decoded blocks of the block cache, if enabled. */
+struct emu_blockcache_state;
+
+/* Caches of the LCD renderer. */
+struct emu_lcd_state;
+
+/* Sound buffer and state of the audio generator. */
+struct emu_audio_state;
+
+/* Implementation of the cartridge MBC. */
+struct mbc_ops;
+
+/* Transport of the serial port, and the state of a socket link. */
+struct serial_ops;
+struct serial_link;
+
 enum gb_type {
     GB_TYPE_GB,
     GB_TYPE_CGB,
 };
 
-/* TODO split this up into module-managed components (cpu, mmu, ...) */
+/* Memory bank controller (mapper) of the cartridge. */
+enum gb_mbc {
+    MBC_NONE = 0,
+    MBC_1 = 1,
+    MBC_2 = 2,
+    MBC_3 = 3,
+    MBC_5 = 5,
+    MBC_6 = 6,
+    MBC_7 = 7,
+    MBC_MMM01,
+    MBC_HUC1,
+    MBC_HUC3,
+    MBC_CAMERA,
+};
+
+/* MBC7 accelerometer and serial (93LC56) EEPROM. */
+struct mbc7_state {
+    u8 ram_enable2;
+    u8 accel_latched;
+    u16 accel_x, accel_y;
+    u8 eeprom_pins; /* Last write: CS (7), CLK (6), DI (1) */
+    u8 eeprom_do;
+    u8 eeprom_state;
+    u8 eeprom_bits;
+    u8 eeprom_write_enable;
+    u16 eeprom_shift;
+    u8 eeprom_addr;
+};
+
+/*
+ * State of the emulated hardware. What is used for (almost) every instruction
+ * comes first, so it shares as few cache lines as possible: the CPU registers
+ * and interrupts, the clock and the memory map. The rest follows roughly by
+ * how often it is used, with rarely used I/O and memory (sound, CGB palettes,
+ * OAM, HRAM, MBC and RTC registers) at the end.
+ */
 struct gb_state {
 
     /*
@@ -115,15 +205,39 @@ struct gb_state {
 
     char in_bios:1; /* At start BIOS is temporarily mapped at 0000-0100. */
     char halt_for_interrupts:1; /* Don't run instructions until interrupt. */
-    char double_speed:1; /* CGB: we can run at double CPU speed. */
+    u8 double_speed:1; /* CGB: we can run at double CPU speed. */
+    u8 speed_switch_prepare:1; /* CGB: switch speed on next STOP (KEY1). */
 
     u8 interrupts_master_enabled:1;
     u8 interrupts_enable; /* Bitmask of which interrupts are enabled. */
     u8 interrupts_request; /* Bitmask of which interrupts are pending. */
 
+    u32 last_op_cycles; /* The duration of the last intruction. Normally just
+                           the CPU executing the instruction, but the MMU could
+                           take longer in the case of some DMA ops. */
+    u64 time_cycles; /* Master clock, in (single speed) GB_FREQ clks. */
+    u64 serial_next_cycles; /* Next serial_step, UINT64_MAX if not needed. */
+
+    /* Host memory backing each 4K page, or NULL if accesses have to go
+     * through the MMU (I/O, registers, special cartridge hardware). Rebuilt on
+     * every bank switch by mmu_update_map. Only WRAM is mapped for writes. */
+    u8 *mem_map_read[16];
+    u8 *mem_map_write[16];
 
     /*
-     * I/O ports (and some additional variables to manage I/O)
+     * Internal emulator state
+     */
+
+    struct emu_state *emu_state;
+    struct emu_cpu_state *emu_cpu_state;
+    struct emu_blockcache_state *emu_blockcache_state;
+    struct emu_lcd_state *emu_lcd_state;
+    struct emu_audio_state *emu_audio_state;
+
+
+    /*
+     * I/O ports used on every step (and some additional variables to manage
+     * them)
      */
 
     int io_lcd_mode_cycles_left;
@@ -150,14 +264,9 @@ struct gb_state {
     u8 io_lcd_LY;   /* Current LCD Y line */
     u8 io_lcd_LYC;  /* LCD Y line compare  */
 
-    /* Palette data for both monochrome (non-CGB) and color (CGB) */
     u8 io_lcd_BGP;  /* Background palette data (monochrome, non-CGB) */
     u8 io_lcd_OBP0; /* Object palette 0 data (monochrome, non-CGB) */
     u8 io_lcd_OBP1; /* Object palette 1 data (monochrome, non-CGB) */
-    u8 io_lcd_BGPI; /* Background palette index (color, CGB) */
-    u8 io_lcd_BGPD[0x40]; /* Background palettes (color, CGB) */
-    u8 io_lcd_OBPI; /* Sprite palette index (color, CGB) */
-    u8 io_lcd_OBPD[0x40]; /* Sprite/object palettes for CGB. */
 
     u8 io_timer_DIV;
     u32 io_timer_DIV_cycles;
@@ -166,15 +275,60 @@ struct gb_state {
     u8 io_timer_TMA;
     u8 io_timer_TAC;
 
-    u8 io_serial_data;
-    u8 io_serial_control;
+    /* CGB DMA transfers (HDMA) */
+    u8 io_hdma_src_high, io_hdma_src_low;
+    u8 io_hdma_dst_high, io_hdma_dst_low;
+    u8 io_hdma_status; /* (remaining) length in lower bits, high bit 1=done. */
+    char io_hdma_running:1;
+    u16 io_hdma_next_src, io_hdma_next_dst;
 
-    u8 io_infrared;
+    /* OAM DMA */
+    u8 io_dma_oam_src;
+    u16 io_dma_oam_cycles_left; /* OAM is inaccessible while transferring. */
 
     u8 io_buttons;
     u8 io_buttons_dirs;
     u8 io_buttons_buttons;
 
+
+    /*
+     * Memory (MMU) state
+     */
+
+    u8 *mem_ROM; /* Between 16K and 4M (banked) */
+    u8 *mem_WRAM; /* Internal RAM (WRAM), 8K non-CGB, 32K CGB (banked) */
+    u8 *mem_EXTRAM; /* External (cartridge) RAM, optional, max 32K (banked) */
+    u8 *mem_VRAM; /* Video RAM, 8K non-CGB, 16K CGB (banked) */
+    u8 *mem_BIOS;
+    u8 *mem_map_under_bios; /* Page of ROM the MBC maps at 0000 - 0FFF, while
+                               the BIOS is mapped over the start of it. */
+
+    /* Bank registers, as written by the game. Their meaning (and which banks
+     * end up mapped) depends on the MBC. */
+    int mem_bank_rom, mem_num_banks_rom;
+    int mem_bank_wram, mem_num_banks_wram;
+    int mem_bank_extram, mem_num_banks_extram; /* MBC3: also RTC select. */
+    int mem_bank_vram, mem_num_banks_vram;
+    int mem_bank_rom2; /* MBC6: ROM bank at 6000-7FFF. */
+    int mem_bank_extram2; /* MBC6: RAM bank at B000-BFFF. */
+    u8 mem_extram_enabled;
+
+
+    /*
+     * Rarely used I/O ports
+     */
+
+    /* Palette data (color, CGB) */
+    u8 io_lcd_BGPI; /* Background palette index (color, CGB) */
+    u8 io_lcd_BGPD[0x40]; /* Background palettes (color, CGB) */
+    u8 io_lcd_OBPI; /* Sprite palette index (color, CGB) */
+    u8 io_lcd_OBPD[0x40]; /* Sprite/object palettes for CGB. */
+
+    u8 io_serial_data;
+    u8 io_serial_control;
+
+    u8 io_infrared;
+
     u8 io_sound_enabled;
     u8 io_sound_out_terminal;
     u8 io_sound_terminal_control;
@@ -202,59 +356,41 @@ struct gb_state {
     u8 io_sound_channel4_poly;
     u8 io_sound_channel4_consec_initial;
 
-    /* CGB DMA transfers (HDMA) */
-    u8 io_hdma_src_high, io_hdma_src_low;
-    u8 io_hdma_dst_high, io_hdma_dst_low;
-    u8 io_hdma_status; /* (remaining) length in lower bits, high bit 1=done. */
-    char io_hdma_running:1;
-    u16 io_hdma_next_src, io_hdma_next_dst;
-
 
     /*
-     * Memory (MMU) state
+     * Rarely used memory and cartridge hardware (including memory bank
+     * controller)
      */
 
-    int mem_bank_rom, mem_num_banks_rom;
-    int mem_bank_wram, mem_num_banks_wram;
-    int mem_bank_extram, mem_num_banks_extram;
-    int mem_bank_vram, mem_num_banks_vram;
-    u8 mem_mbc1_rombankupper; /* MBC1 - Upper bits ROM bank (if selected). */
-    u8 mem_mbc1_extrambank; /* MBC1 - EXT_RAM bank (if selected). */
-    u8 mem_mbc1_romram_select; /* MBC1 - Mode for above field (ROM/RAM). */
-    u8 mem_mbc3_extram_rtc_select;
-    u8 mem_mbc5_extrambank;
-
-    u8 *mem_ROM; /* Between 16K and 4M (banked) */
-    u8 *mem_WRAM; /* Internal RAM (WRAM), 8K non-CGB, 32K CGB (banked) */
-    u8 *mem_EXTRAM; /* External (cartridge) RAM, optional, max 32K (banked) */
-    u8 *mem_VRAM; /* Video RAM, 8K non-CGB, 16K CGB (banked) */
     u8 mem_OAM[0xa0]; /* Sprite/Object attributes */
     u8 mem_HRAM[0x7f];
-    u8 *mem_BIOS;
-
-    u8 mem_latch_rtc;
-    u8 mem_RTC[0x05]; /* Real time clock, select by extram banks 0x08-0x0c */
 
+    u8 mem_mbc1_rombankupper; /* MBC1 - Upper bits ROM bank, or RAM bank. */
+    u8 mem_mbc1_romram_select; /* MBC1 - Mode for above field (ROM/RAM). */
+    u8 mem_mbc_mode; /* HuC1/HuC3/Camera: what is at A000-BFFF. */
+    u8 mem_mmm01_regs[4]; /* MMM01: last writes to 0000, 2000, 4000, 6000. */
+    struct mbc7_state mem_mbc7;
 
-    /*
-     * Cartridge hardware (including memory bank controller)
-     */
+    u8 mem_latch_rtc;
+    u8 mem_RTC[0x05]; /* Latched real time clock, select by extram banks 0x08-0x0c */
+    s64 rtc_base; /* Host time (UNIX seconds) at which the clock was 0. */
+    u32 rtc_halt_secs; /* Clock value (seconds) while halted. */
+    u8 rtc_flags; /* Halt and day carry bits of the RTC (as in DH). */
 
     enum gb_type gb_type;
-    int mbc;
+    enum gb_mbc mbc;
+    const struct mbc_ops *mbc_ops;
     char has_extram;
     char has_battery;
     char has_rtc;
+    char has_rumble;
 
-
-    /*
-     * Internal emulator state
-     */
-
-    struct emu_state *emu_state;
-    struct emu_cpu_state *emu_cpu_state;
+    /* All mutable memory of the instance in one allocation (see state.c).
+     * The first mem_arena_snap_size bytes are the emulated state (emu_state
+     * and the RAMs above), the rest are caches of the emulator. */
+    u8 *mem_arena;
+    size_t mem_arena_size, mem_arena_used, mem_arena_snap_size;
 };
 
-
 #endif
 